@@ -0,0 +1,58 @@
+// $Id: arena.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <iostream>
+#include <new>
+
+using namespace std;
+
+#include "arena.h"
+#include "debug.h"
+
+void* node_arena::allocate (size_t bytes) {
+   if (bytes > MAX_BLOCK) return ::operator new (bytes);
+   size_t rounded = bytes == 0 ? GRAIN : (bytes + GRAIN - 1) / GRAIN * GRAIN;
+   free_block*& head = free_lists[rounded / GRAIN - 1];
+   lock_guard<mutex> guard (lock);
+   ++blocks_in_use;
+   if (head != nullptr) {
+      free_block* block = head;
+      head = block->next;
+      return block;
+   }
+   if (static_cast<size_t> (slab_end - slab_next) < rounded) {
+      // Whatever is left of the old slab is too small; abandon it.
+      slabs.push_back (make_unique<char[]> (SLAB_SIZE));
+      slab_next = slabs.back().get();
+      slab_end = slab_next + SLAB_SIZE;
+      DEBUGF ('a', "slab " << slabs.size() << " at "
+              << static_cast<void*> (slab_next));
+   }
+   void* block = slab_next;
+   slab_next += rounded;
+   return block;
+}
+
+void node_arena::deallocate (void* block, size_t bytes) {
+   if (bytes > MAX_BLOCK) {
+      ::operator delete (block);
+      return;
+   }
+   size_t rounded = bytes == 0 ? GRAIN : (bytes + GRAIN - 1) / GRAIN * GRAIN;
+   free_block*& head = free_lists[rounded / GRAIN - 1];
+   lock_guard<mutex> guard (lock);
+   --blocks_in_use;
+   free_block* freed = static_cast<free_block*> (block);
+   freed->next = head;
+   head = freed;
+}
+
+size_t node_arena::slab_count() {
+   lock_guard<mutex> guard (lock);
+   return slabs.size();
+}
+
+size_t node_arena::live_blocks() {
+   lock_guard<mutex> guard (lock);
+   return blocks_in_use;
+}
+
@@ -0,0 +1,79 @@
+// $Id: arena.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// node_arena -
+//    A slab allocator for the small objects the tree is made of.
+//    Requests are rounded up to a multiple of GRAIN bytes and served
+//    from a free list per rounded size.  An empty free list is refilled
+//    by carving from the current slab, and a new slab is taken from
+//    operator new when that one runs out.  Freed blocks go back on
+//    their free list for reuse; slabs are returned to the system only
+//    when the arena is destroyed, so the arena must outlive everything
+//    allocated from it.  Requests larger than MAX_BLOCK bypass the
+//    arena.  A mutex serializes all of this, because subtrees may be
+//    freed on the reclaimer thread.
+// arena_allocator -
+//    A standard allocator over a node_arena, for allocate_shared and
+//    the containers.
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+class node_arena {
+   private:
+      static constexpr size_t GRAIN {16};
+      static constexpr size_t MAX_BLOCK {512};
+      static constexpr size_t SLAB_SIZE {64 * 1024};
+      struct free_block { free_block* next; };
+      mutex lock;
+      free_block* free_lists[MAX_BLOCK / GRAIN] {};
+      vector<unique_ptr<char[]>> slabs;
+      char* slab_next {nullptr};
+      char* slab_end {nullptr};
+      size_t blocks_in_use {0};
+   public:
+      node_arena() = default;
+      node_arena (const node_arena&) = delete;
+      node_arena& operator= (const node_arena&) = delete;
+      void* allocate (size_t bytes);
+      void deallocate (void* block, size_t bytes);
+      size_t slab_count();
+      size_t live_blocks();
+};
+
+template <typename item_t>
+class arena_allocator {
+   template <typename> friend class arena_allocator;
+   private:
+      node_arena* arena;
+   public:
+      using value_type = item_t;
+      explicit arena_allocator (node_arena& arena_): arena (&arena_) {}
+      template <typename other_t>
+      arena_allocator (const arena_allocator<other_t>& that):
+                       arena (that.arena) {}
+      item_t* allocate (size_t count) {
+         static_assert (alignof (item_t) <= 16, "over-aligned type");
+         return static_cast<item_t*> (
+                arena->allocate (count * sizeof (item_t)));
+      }
+      void deallocate (item_t* block, size_t count) {
+         arena->deallocate (block, count * sizeof (item_t));
+      }
+      template <typename other_t>
+      bool operator== (const arena_allocator<other_t>& that) const {
+         return arena == that.arena;
+      }
+      template <typename other_t>
+      bool operator!= (const arena_allocator<other_t>& that) const {
+         return arena != that.arena;
+      }
+};
+
+#endif
+
@@ -0,0 +1,997 @@
+// $Id: bench.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// bench -
+//    Microbenchmarks for the file_sys internals, driven directly
+//    rather than through the command interpreter.  Each benchmark is
+//    selected by name on the command line; with no operands, all of
+//    them are run.  With -m, ops reports its results as tab-separated
+//    values, one line per shape and command, for comparing runs.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <streambuf>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#include "commands.h"
+#include "file_sys.h"
+#include "util.h"
+
+using bench_clock = chrono::steady_clock;
+
+// operator new -
+//    Counted, so that bench_alloc can report heap allocations per node.
+//    Everything else in the program pays one relaxed increment.  All
+//    three are kept out of line, or GCC, seeing malloc and free meet
+//    once they are inlined, takes them for a mismatched pair.
+
+static atomic<size_t> heap_allocations {0};
+
+[[gnu::noinline]] void* operator new (size_t bytes) {
+   heap_allocations.fetch_add (1, memory_order_relaxed);
+   void* block = malloc (bytes == 0 ? 1 : bytes);
+   if (block == nullptr) throw bad_alloc();
+   return block;
+}
+
+[[gnu::noinline]] void operator delete (void* block) noexcept {
+   free (block);
+}
+[[gnu::noinline]] void operator delete (void* block, size_t) noexcept {
+   free (block);
+}
+
+// time_per_op -
+//    Runs fn once per element of keys, repeated for rounds, and
+//    returns the mean nanoseconds per call.
+
+template <typename function>
+double time_per_op (const vector<string>& keys, int rounds,
+                    function fn) {
+   auto start = bench_clock::now();
+   for (int round = 0; round < rounds; ++round) {
+      for (const auto& key: keys) fn (string_view (key));
+   }
+   chrono::duration<double,nano> elapsed = bench_clock::now() - start;
+   return elapsed.count() / (static_cast<double> (keys.size()) * rounds);
+}
+
+// null_sink -
+//    Counts the lines of a listing and discards them, so that only
+//    the cost of producing it is measured.
+
+class null_sink: public ls_sink {
+   public:
+      size_t lines {0};
+      virtual void begin (string_view) override { ++lines; }
+      virtual void entry (uint64_t, size_t, string_view, bool) override {
+         ++lines;
+      }
+      virtual void block (string_view text) override {
+         lines += count (text.begin(), text.end(), '\n');
+      }
+};
+
+vector<string> make_names (size_t count) {
+   vector<string> names;
+   names.reserve (count);
+   char buffer[32];
+   for (size_t i = 0; i < count; ++i) {
+      snprintf (buffer, sizeof buffer, "entry%08zu", i);
+      names.emplace_back (buffer);
+   }
+   return names;
+}
+
+// counting_less -
+//    A transparent comparator that counts its calls, so the number
+//    of key comparisons per lookup can be reported alongside time.
+
+struct counting_less {
+   using is_transparent = void;
+   static size_t calls;
+   template <typename left, typename right>
+   bool operator() (const left& a, const right& b) const {
+      ++calls;
+      return string_view (a) < string_view (b);
+   }
+};
+size_t counting_less::calls {0};
+
+// bench_lookup -
+//    Compares the old two-descent lookup (find, then operator[] with
+//    a temporary string key) against one transparent find by
+//    string_view, on both a bare map and a real directory.
+
+void bench_lookup() {
+   tree_state tree;
+   constexpr size_t ENTRIES {100000};
+   constexpr int ROUNDS {10};
+   vector<string> names = make_names (ENTRIES);
+
+   map<string,inode_ptr> old_map;
+   map<string,inode_ptr,counting_less> counted_map;
+   directory dir;
+   for (const auto& name: names) {
+      old_map[name] = counted_map[name] = dir.mkfile (name, tree, FIRST_EPOCH);
+   }
+
+   vector<string> probes = names;
+   shuffle (probes.begin(), probes.end(), mt19937 {109});
+
+   size_t found = 0;
+   double twice = time_per_op (probes, ROUNDS, [&] (string_view name) {
+      string key (name);
+      inode_ptr node = old_map.find (key) != old_map.end()
+                     ? old_map[key] : nullptr;
+      found += node != nullptr;
+   });
+   double once = time_per_op (probes, ROUNDS, [&] (string_view name) {
+      found += dir.getNodeByName (name, LIVE_VIEW) != nullptr;
+   });
+
+   counting_less::calls = 0;
+   time_per_op (probes, 1, [&] (string_view name) {
+      string key (name);
+      inode_ptr node = counted_map.find (key) != counted_map.end()
+                     ? counted_map[key] : nullptr;
+      found += node != nullptr;
+   });
+   double twice_compares = static_cast<double> (counting_less::calls)
+                         / probes.size();
+   counting_less::calls = 0;
+   time_per_op (probes, 1, [&] (string_view name) {
+      found += counted_map.find (name) != counted_map.end();
+   });
+   double once_compares = static_cast<double> (counting_less::calls)
+                        / probes.size();
+
+   cout << "lookup: " << ENTRIES << " entries, "
+        << probes.size() * ROUNDS << " probes" << endl
+        << "   find + operator[] (string key): " << twice << " ns/op, "
+        << twice_compares << " compares/op" << endl
+        << "   getNodeByName (string_view):    " << once << " ns/op, "
+        << once_compares << " compares/op" << endl
+        << "   speedup: " << twice / once << "x"
+        << " (" << found << " hits)" << endl;
+}
+
+// bench_bigdir -
+//    Lookups and ordered walks over a directory of a million entries,
+//    hashed by dirent_table, against the same names in an ordered map.
+
+void bench_bigdir() {
+   tree_state tree;
+   constexpr size_t ENTRIES {1000000};
+   vector<string> names = make_names (ENTRIES);
+   shuffle (names.begin(), names.end(), mt19937 {109});
+
+   map<string,inode_ptr,less<>> tree_map;
+   directory dir;
+   for (const auto& name: names) {
+      tree_map.emplace (name, dir.mkfile (name, tree, FIRST_EPOCH));
+   }
+   shuffle (names.begin(), names.end(), mt19937 {110});
+
+   size_t found = 0;
+   double tree_find = time_per_op (names, 1, [&] (string_view name) {
+      found += tree_map.find (name) != tree_map.end();
+   });
+   double table_find = time_per_op (names, 1, [&] (string_view name) {
+      found += dir.getNodeByName (name, LIVE_VIEW) != nullptr;
+   });
+
+   // Listing needs the directory to be linked into a tree.
+   inode_state state;
+   state.mkdir ("big");
+   state.cd ("big");
+   for (const auto& name: names) state.make (name, {});
+   null_sink sink;
+   auto start = bench_clock::now();
+   state.getLS ("", sink);
+   chrono::duration<double,milli> first = bench_clock::now() - start;
+   start = bench_clock::now();
+   state.getLS ("", sink);
+   chrono::duration<double,milli> cached = bench_clock::now() - start;
+
+   cout << "bigdir: " << ENTRIES << " entries" << endl
+        << "   map find:           " << tree_find << " ns/op" << endl
+        << "   dirent_table find:  " << table_find << " ns/op" << endl
+        << "   ls, sorting:        " << first.count() << " ms" << endl
+        << "   ls, cached order:   " << cached.count() << " ms"
+        << " (" << found << " hits)" << endl;
+}
+
+// heap_in_use -
+//    Bytes malloc has handed out and not had back.
+
+size_t heap_in_use() {
+   struct mallinfo2 info = mallinfo2();
+   return info.uordblks + info.hblkhd;
+}
+
+// bench_names -
+//    Ten million entries, ten to each of a million directories, named
+//    from a small vocabulary as real layouts are, held as the sorted
+//    vector of strings every small directory used to be, then in
+//    dirent_tables over interned names.  Entries are made without
+//    nodes, so that only the cost of the names is measured.
+
+void bench_names() {
+   constexpr size_t DIRS {1000000};
+   constexpr size_t PER_DIR {10};
+   const vector<string> vocabulary {
+      "config", "data", "index", "log", "README.md", "Makefile", "src",
+      "build", "metadata.json", "checkpoint-latest.bin", "lib", "tmp",
+      "application.properties", "requirements-dev.txt", "cache",
+      "package-lock.json",
+   };
+   auto name_of = [&] (size_t dir, size_t entry) -> const string& {
+      return vocabulary[(dir * 7 + entry) % vocabulary.size()];
+   };
+   auto report = [&] (const char* label, size_t bytes,
+                      chrono::duration<double,nano> built, double find) {
+      cout << label << static_cast<double> (bytes) / (DIRS * PER_DIR)
+           << " bytes/entry, "
+           << built.count() / (DIRS * PER_DIR) << " ns/insert, "
+           << find << " ns/find" << endl;
+   };
+   cout << "names: " << DIRS * PER_DIR << " entries in " << DIRS
+        << " directories, " << vocabulary.size() << " distinct names"
+        << endl;
+   size_t found = 0;
+   {
+      using entry = pair<string,inode_ptr>;
+      size_t before = heap_in_use();
+      auto start = bench_clock::now();
+      vector<vector<entry>> dirs (DIRS);
+      for (size_t dir = 0; dir < DIRS; ++dir) {
+         for (size_t i = 0; i < PER_DIR; ++i) {
+            const string& name = name_of (dir, i);
+            auto pos = lower_bound (dirs[dir].begin(), dirs[dir].end(), name,
+                       [] (const entry& held, const string& key) {
+                          return held.first < key;
+                       });
+            dirs[dir].emplace (pos, name, nullptr);
+         }
+      }
+      chrono::duration<double,nano> built = bench_clock::now() - start;
+      size_t bytes = heap_in_use() - before;
+      double find = time_per_op (vocabulary, DIRS / vocabulary.size(),
+                                 [&, dir = size_t (0)] (string_view name) mutable {
+         auto& held = dirs[dir++ % DIRS];
+         auto pos = lower_bound (held.begin(), held.end(), name,
+                    [] (const entry& a, string_view key) {
+                       return string_view (a.first) < key;
+                    });
+         found += pos != held.end() and pos->first == name;
+      });
+      report ("   strings:  ", bytes, built, find);
+   }
+   {
+      size_t before = heap_in_use();
+      auto start = bench_clock::now();
+      vector<dirent_table> dirs (DIRS);
+      for (size_t dir = 0; dir < DIRS; ++dir) {
+         for (size_t i = 0; i < PER_DIR; ++i) {
+            dirs[dir].emplace (name_of (dir, i));
+         }
+      }
+      chrono::duration<double,nano> built = bench_clock::now() - start;
+      size_t bytes = heap_in_use() - before;
+      double find = time_per_op (vocabulary, DIRS / vocabulary.size(),
+                                 [&, dir = size_t (0)] (string_view name) mutable {
+         found += dirs[dir++ % DIRS].find (name) != nullptr;
+      });
+      report ("   interned: ", bytes, built, find);
+      cout << "   " << name_ref::interned() << " names interned"
+           << " (" << found << " hits)" << endl;
+   }
+}
+
+// build_balanced -
+//    Fills path with a tree of the given fanout and depth, with the
+//    given number of plain files in every directory.
+
+void build_balanced (inode_state& state, const string& path,
+                     int fanout, int depth, int files) {
+   for (int file = 0; file < files; ++file) {
+      state.make (path + "/file" + to_string (file), "data ");
+   }
+   if (depth == 0) return;
+   for (int dir = 0; dir < fanout; ++dir) {
+      string child = path + "/dir" + to_string (dir);
+      state.mkdir (child);
+      build_balanced (state, child, fanout, depth - 1, files);
+   }
+}
+
+// bench_lsr -
+//    lsr over a balanced tree at increasing thread counts, up to the
+//    number of hardware threads (and at least 8).
+
+void bench_lsr() {
+   inode_state state;
+   state.mkdir ("/tree");
+   build_balanced (state, "/tree", 8, 5, 20);
+
+   size_t max_jobs = max<size_t> (thread::hardware_concurrency(), 8);
+   double serial = 0;
+   cout << "lsr: balanced tree, fanout 8, depth 5, 20 files per directory"
+        << endl;
+   for (size_t jobs = 1; jobs <= max_jobs; jobs *= 2) {
+      null_sink sink;
+      auto start = bench_clock::now();
+      state.getLSR ("/tree", sink, jobs);
+      chrono::duration<double,milli> elapsed = bench_clock::now() - start;
+      if (jobs == 1) serial = elapsed.count();
+      cout << "   -j " << jobs << ": " << elapsed.count() << " ms, "
+           << sink.lines << " lines, speedup "
+           << serial / elapsed.count() << "x" << endl;
+   }
+}
+
+// bench_rmr -
+//    Latency of rmr on a large subtree when the subtree is freed in
+//    line and when it is handed to the background reclaimer, and the
+//    time the reclaimer then needs to drain.
+
+void bench_rmr() {
+   cout << "rmr: balanced tree, fanout 8, depth 5, 20 files per directory"
+        << endl;
+   for (bool background: {false, true}) {
+      inode_state state;
+      state.setBackgroundReclaim (background);
+      state.mkdir ("/tree");
+      build_balanced (state, "/tree", 8, 5, 20);
+      auto start = bench_clock::now();
+      state.rmr ("tree");
+      chrono::duration<double,milli> removed = bench_clock::now() - start;
+      state.drainReclaim();
+      chrono::duration<double,milli> drained = bench_clock::now() - start;
+      cout << (background ? "   background: " : "   in line:    ")
+           << removed.count() << " ms to return, "
+           << drained.count() << " ms until freed" << endl;
+   }
+}
+
+// bench_alloc -
+//    Heap allocations per mkdir and per make, counted through operator
+//    new above, and how many arena slabs the nodes occupy.  Directory
+//    tables and file contents too long for the string's own buffer
+//    still come from the heap.
+
+void bench_alloc() {
+   constexpr size_t NODES {100000};
+   vector<string> names = make_names (NODES);
+   vector<string> paths;
+   paths.reserve (NODES);
+   for (const auto& name: names) paths.push_back ("/d/" + name);
+   const string data {"data "};
+
+   cout << "alloc: " << NODES << " nodes in one directory" << endl;
+   for (bool files: {false, true}) {
+      inode_state state;
+      state.mkdir ("/d");
+      size_t slabs = state.nodeArena().slab_count();
+      size_t before = heap_allocations.load();
+      auto start = bench_clock::now();
+      for (const auto& path: paths) {
+         if (files) state.make (path, data);
+               else state.mkdir (path);
+      }
+      chrono::duration<double,nano> elapsed = bench_clock::now() - start;
+      size_t count = heap_allocations.load() - before;
+      cout << (files ? "   make:  " : "   mkdir: ")
+           << static_cast<double> (count) / NODES << " heap allocs/node, "
+           << elapsed.count() / NODES << " ns/node, "
+           << state.nodeArena().slab_count() - slabs << " slabs" << endl;
+   }
+}
+
+// bench_append -
+//    Growing one file a line at a time with append, against rewriting
+//    it whole with make each time, as was the only way before.
+
+void bench_append() {
+   constexpr size_t LINES {200000};
+   constexpr size_t REWRITES {2000};
+   const string line (63, 'x');
+
+   inode_state state;
+   auto start = bench_clock::now();
+   for (size_t count = 0; count < LINES; ++count) {
+      state.append ("/log", line);
+   }
+   chrono::duration<double,nano> appended = bench_clock::now() - start;
+
+   string whole;
+   start = bench_clock::now();
+   for (size_t count = 0; count < REWRITES; ++count) {
+      whole += line;
+      state.make ("/rewritten", whole);
+   }
+   chrono::duration<double,nano> rewritten = bench_clock::now() - start;
+
+   cout << "append: 63-byte lines" << endl
+        << "   append: " << appended.count() / LINES << " ns/line over "
+        << LINES << " lines" << endl
+        << "   make:   " << rewritten.count() / REWRITES
+        << " ns/line over " << REWRITES << " lines" << endl;
+}
+
+// bench_snapshot -
+//    The cost of taking a snapshot of a large tree, and what it keeps
+//    alive: the same changes are made with and without a snapshot,
+//    and the nodes still held afterwards are compared.
+
+void bench_snapshot() {
+   cout << "snapshot: balanced tree, fanout 8, depth 4, 20 files per "
+        << "directory; rewrite 1000 files, then rmr 1/8 of the tree"
+        << endl;
+   for (bool snapped: {false, true}) {
+      inode_state state;
+      state.mkdir ("/tree");
+      build_balanced (state, "/tree", 8, 4, 20);
+      size_t nodes = state.nodeArena().live_blocks();
+
+      auto start = bench_clock::now();
+      if (snapped) state.snapshot ("before");
+      chrono::duration<double,nano> taken = bench_clock::now() - start;
+
+      for (int file = 0; file < 1000; ++file) {
+         state.make ("/tree/dir" + to_string (file % 8) + "/dir"
+                     + to_string (file / 8 % 8) + "/file"
+                     + to_string (file % 20), "rewritten ");
+      }
+      state.rmr ("/tree/dir7");
+      size_t kept = state.nodeArena().live_blocks();
+      cout << (snapped ? "   snapshot:    " : "   no snapshot: ")
+           << kept << " of " << nodes << " nodes still held";
+      if (snapped) cout << ", " << taken.count() << " ns to take";
+      cout << endl;
+   }
+}
+
+// bench_image -
+//    Saving a large tree to an image and loading it back, against
+//    building the same tree one mkdir and make at a time.
+
+void bench_image() {
+   const string filename {"yshell_bench.image"};
+   inode_state state;
+   auto start = bench_clock::now();
+   state.mkdir ("/tree");
+   build_balanced (state, "/tree", 10, 4, 80);
+   chrono::duration<double> built = bench_clock::now() - start;
+   size_t nodes = state.nodeArena().live_blocks();
+
+   start = bench_clock::now();
+   state.save (filename);
+   chrono::duration<double> saved = bench_clock::now() - start;
+
+   inode_state loaded;
+   start = bench_clock::now();
+   loaded.load (filename);
+   chrono::duration<double> load_time = bench_clock::now() - start;
+
+   inode_state mounted;
+   start = bench_clock::now();
+   mounted.mount (filename, "/");
+   chrono::duration<double,micro> mount_time = bench_clock::now() - start;
+   null_sink lines;
+   start = bench_clock::now();
+   mounted.getLS ("/tree/dir3/dir1", lines);
+   chrono::duration<double,micro> first_ls = bench_clock::now() - start;
+   start = bench_clock::now();
+   mounted.getLSR ("/", lines);
+   chrono::duration<double> mapped_lsr = bench_clock::now() - start;
+   start = bench_clock::now();
+   loaded.getLSR ("/", lines);
+   chrono::duration<double> loaded_lsr = bench_clock::now() - start;
+   remove (filename.c_str());
+
+   cout << "image: " << nodes << " nodes" << endl
+        << "   mkdir/make: " << built.count() << " s" << endl
+        << "   save:       " << saved.count() << " s" << endl
+        << "   load:       " << load_time.count() << " s, "
+        << load_time.count() * 1e9 / nodes << " ns/node" << endl
+        << "   mount:      " << mount_time.count() << " us, then "
+        << first_ls.count() << " us for a first ls" << endl
+        << "   lsr /:      " << mapped_lsr.count() << " s mounted, "
+        << loaded_lsr.count() << " s loaded" << endl;
+}
+
+// bench_journal -
+//    The same stream of mkdir and make, with no journal and with the
+//    journal under several group commit settings.
+
+void bench_journal() {
+   constexpr size_t DIRS {1000};
+   constexpr size_t FILES {10};
+   const string filename {"yshell_bench.journal"};
+   struct setting {
+      const char* name;
+      bool journaled;
+      group_commit group;
+   };
+   const setting settings[] {
+      {"no journal", false, {}},
+      {"sync every change", true, {1, chrono::milliseconds (0)}},
+      {"batch 16", true, {16, chrono::milliseconds (0)}},
+      {"batch 256", true, {256, chrono::milliseconds (0)}},
+      {"batch 4096 or 5 ms", true, {4096, chrono::milliseconds (5)}},
+   };
+   cout << "journal: " << DIRS << " mkdir, each with " << FILES
+        << " make" << endl;
+   double baseline = 0;
+   for (const auto& run: settings) {
+      remove (filename.c_str());
+      inode_state state;
+      if (run.journaled) state.openJournal (filename, run.group);
+      auto start = bench_clock::now();
+      for (size_t dir = 0; dir < DIRS; ++dir) {
+         string path = "/dir" + to_string (dir);
+         state.mkdir (path);
+         for (size_t file = 0; file < FILES; ++file) {
+            state.make (path + "/file" + to_string (file), "some data ");
+         }
+      }
+      if (run.journaled) state.changeLog()->flush();
+      chrono::duration<double,nano> elapsed = bench_clock::now() - start;
+      double per_op = elapsed.count() / (DIRS * (FILES + 1));
+      if (not run.journaled) baseline = per_op;
+      cout << "   " << run.name << ": " << per_op << " ns/op";
+      if (run.journaled) {
+         cout << ", " << per_op / baseline << "x, "
+              << state.changeLog()->syncs() << " syncs";
+      }
+      cout << endl;
+   }
+   remove (filename.c_str());
+}
+
+// bench_dispatch -
+//    Looking up command words through the compile-time perfect hash,
+//    against the unordered_map of strings it replaced.
+
+void bench_dispatch() {
+   constexpr int ROUNDS {200000};
+   const vector<string> words {
+      "ls", "cd", "make", "cat", "mkdir", "pwd", "rm", "lsr",
+      "append", "rmr", "echo", "snapshot", "prompt", "mount",
+   };
+   unordered_map<string,command_fn> table;
+   for (const auto& word: words) table[word] = find_command_fn (word);
+
+   size_t found = 0;
+   double hashed = time_per_op (words, ROUNDS, [&] (string_view word) {
+      found += find_command_fn (word) != nullptr;
+   });
+   double mapped = time_per_op (words, ROUNDS, [&] (string_view word) {
+      found += table.find (string (word)) != table.end();
+   });
+   size_t before = heap_allocations;
+   for (const auto& word: words) find_command_fn (word);
+   size_t allocations = heap_allocations - before;
+   cout << "dispatch: " << words.size() << " command words" << endl
+        << "   perfect hash:  " << hashed << " ns/lookup, "
+        << allocations << " allocations" << endl
+        << "   unordered_map: " << mapped << " ns/lookup ("
+        << found << " found)" << endl;
+}
+
+// bench_disjoint -
+//    Threads, each a session of its own on one shared tree, making and
+//    removing entries in a subtree of their own, with every command
+//    holding the tree's lock as the server does: shared, with each
+//    directory locked on its own, or, as before, exclusively.  Only
+//    with as many cores as threads can the shared runs scale.
+
+void bench_disjoint() {
+   constexpr size_t ROUNDS {20000};
+   const size_t counts[] {1, 2, 4, 8};
+   cout << "disjoint: " << ROUNDS << " rounds of mkdir, make, rm, rm"
+        << " per thread, " << thread::hardware_concurrency()
+        << " cores" << endl;
+   for (bool exclusive: {false, true}) {
+      double single = 0;
+      for (size_t threads: counts) {
+         auto tree = make_shared<tree_state>();
+         auto run = [&] (size_t id) {
+            inode_state session (tree);
+            auto locked = [&] (auto change) {
+               if (exclusive) {
+                  unique_lock<shared_mutex> guard (tree->lock);
+                  change();
+               }else {
+                  shared_lock<shared_mutex> guard (tree->lock);
+                  change();
+               }
+            };
+            string top = "/t" + to_string (id);
+            locked ([&] { session.mkdir (top); });
+            for (size_t round = 0; round < ROUNDS; ++round) {
+               string dir = top + "/d" + to_string (round % 64);
+               string file = dir + "/f";
+               locked ([&] { session.mkdir (dir); });
+               locked ([&] { session.make (file, "data "); });
+               locked ([&] { session.rm (file); });
+               locked ([&] { session.rm (dir); });
+            }
+         };
+         vector<thread> workers;
+         auto start = bench_clock::now();
+         for (size_t id = 0; id < threads; ++id) {
+            workers.emplace_back (run, id);
+         }
+         for (auto& worker: workers) worker.join();
+         chrono::duration<double> elapsed = bench_clock::now() - start;
+         double rate = threads * ROUNDS * 4 / elapsed.count();
+         if (threads == 1) single = rate;
+         cout << "   " << (exclusive ? "tree lock" : "directory locks")
+              << ", " << threads << " threads: " << rate / 1e6
+              << " Mops/s, " << rate / single << "x" << endl;
+      }
+   }
+}
+
+// bench_reads -
+//    Threads, each a session of its own on one shared tree, reading:
+//    catting files four directories down and changing into the
+//    directories above them, while one more thread keeps appending to
+//    those files and making and removing entries beside them, which
+//    also keeps emptying the dentry caches.  Every command holds the
+//    tree's lock shared, as the server does, and the walks are made
+//    without locks, then with them.
+
+void bench_reads() {
+   constexpr size_t ROUNDS {50000};
+   constexpr size_t FILES {16};
+   const size_t counts[] {1, 2, 4, 8};
+   cout << "reads: " << ROUNDS << " rounds of cat, cd per thread,"
+        << " one writer, " << thread::hardware_concurrency()
+        << " cores" << endl;
+   for (bool lockfree: {true, false}) {
+      double single = 0;
+      for (size_t threads: counts) {
+         auto tree = make_shared<tree_state>();
+         inode_state setup (tree);
+         setup.setLockFreeReads (lockfree);
+         vector<string> dirs;
+         vector<string> files;
+         for (size_t i = 0; i < FILES; ++i) {
+            string dir = "/r" + to_string (i % 4);
+            for (const char* step: {"/a", "/b", "/c"}) {
+               if (i < 4) setup.mkdir (dir);
+               dir += step;
+            }
+            if (i < 4) setup.mkdir (dir);
+            dirs.push_back (dir);
+            files.push_back (dir + "/file" + to_string (i));
+            setup.make (files.back(), "data ");
+         }
+         atomic<bool> done {false};
+         auto read = [&] (size_t id) {
+            inode_state session (tree);
+            ostream discard (nullptr);
+            session.setOutput (discard);
+            for (size_t round = 0; round < ROUNDS; ++round) {
+               size_t which = (round * 7 + id) % FILES;
+               shared_lock<shared_mutex> guard (tree->lock);
+               session.cat (files[which]);
+               session.cd (dirs[which]);
+            }
+         };
+         auto write = [&] {
+            inode_state session (tree);
+            for (size_t round = 0; not done; ++round) {
+               size_t which = round % FILES;
+               shared_lock<shared_mutex> guard (tree->lock);
+               session.append (files[which], "more");
+               string scratch = dirs[which] + "/scratch" + to_string (which);
+               session.mkdir (scratch);
+               session.rm (scratch);
+            }
+         };
+         thread writer (write);
+         vector<thread> readers;
+         auto start = bench_clock::now();
+         for (size_t id = 0; id < threads; ++id) {
+            readers.emplace_back (read, id);
+         }
+         for (auto& reader: readers) reader.join();
+         chrono::duration<double> elapsed = bench_clock::now() - start;
+         done = true;
+         writer.join();
+         double rate = threads * ROUNDS * 2 / elapsed.count();
+         if (threads == 1) single = rate;
+         cout << "   " << (lockfree ? "without locks" : "locked walk")
+              << ", " << threads << " threads: " << rate / 1e6
+              << " Mops/s, " << rate / single << "x" << endl;
+      }
+   }
+}
+
+// bench_dedup -
+//    Files made from a few templates, whose bodies the content store
+//    keeps once each, against as many files all different, whose
+//    bodies it cannot share.
+
+void bench_dedup() {
+   constexpr size_t FILES {100000};
+   constexpr size_t TEMPLATES {8};
+   vector<string> bodies;
+   for (size_t i = 0; i < TEMPLATES; ++i) {
+      bodies.push_back (string (1000, 'a' + i) + " template");
+   }
+
+   cout << "dedup: " << FILES << " files of " << bodies[0].size()
+        << " bytes" << endl;
+   for (bool shared: {true, false}) {
+      inode_state state;
+      state.mkdir ("/d");
+      size_t before = heap_allocations.load();
+      auto start = bench_clock::now();
+      for (size_t i = 0; i < FILES; ++i) {
+         string path = "/d/f" + to_string (i);
+         if (shared) state.make (path, bodies[i % TEMPLATES]);
+                else state.make (path, bodies[i % TEMPLATES] + to_string (i));
+      }
+      chrono::duration<double,nano> elapsed = bench_clock::now() - start;
+      size_t count = heap_allocations.load() - before;
+      content_store::usage used = state.sharedTree()->bodies.measure();
+      cout << (shared ? "   from templates: " : "   all different:  ")
+           << elapsed.count() / FILES << " ns/make, "
+           << static_cast<double> (count) / FILES << " heap allocs/file, "
+           << used.bodies << " bodies, " << used.bytes << " bytes stored, "
+           << used.saved << " saved" << endl;
+   }
+}
+
+// discard_buf -
+//    A streambuf that takes everything written to it and keeps none of
+//    it, so that cat and ls pay for writing their output, but not for
+//    a terminal.
+
+class discard_buf: public streambuf {
+   protected:
+      virtual streamsize xsputn (const char*, streamsize count) override {
+         return count;
+      }
+      virtual int_type overflow (int_type byte) override {
+         return traits_type::not_eof (byte);
+      }
+};
+
+// tree_shape -
+//    A tree of directories depth levels deep, each directory above the
+//    bottom level holding fanout subdirectories and files plain files
+//    of file_bytes bytes each.  The commands measured work in the
+//    directories just above the bottom level, where the entries are.
+
+struct tree_shape {
+   const char* name;
+   size_t depth;
+   size_t fanout;
+   size_t files;
+   size_t file_bytes;
+};
+
+const tree_shape shapes[] {
+   {"deep", 512, 1, 1, 16},
+   {"wide", 1, 50000, 50000, 16},
+   {"balanced", 4, 8, 4, 64},
+   {"large", 1, 4, 16, 256 * 1024},
+};
+
+static bool machine_readable {false};
+
+// build_shape -
+//    Builds shape below path, and returns the directories holding its
+//    bottom level, as prefixes to which a slash and a name are added:
+//    the root is the empty string.
+
+vector<string> build_shape (inode_state& state, const tree_shape& shape,
+                            const string& path, size_t level) {
+   string body (shape.file_bytes, 'x');
+   for (size_t file = 0; file < shape.files; ++file) {
+      state.make (path + "/f" + to_string (file), body);
+   }
+   if (level + 1 == shape.depth) {
+      for (size_t sub = 0; sub < shape.fanout; ++sub) {
+         state.mkdir (path + "/d" + to_string (sub));
+      }
+      return {path};
+   }
+   vector<string> targets;
+   for (size_t sub = 0; sub < shape.fanout; ++sub) {
+      string subdir = path + "/d" + to_string (sub);
+      state.mkdir (subdir);
+      vector<string> below = build_shape (state, shape, subdir, level + 1);
+      targets.insert (targets.end(), below.begin(), below.end());
+   }
+   return targets;
+}
+
+// measure -
+//    Times fn (i) once for each i, up to MAX_OPS of them, stopping
+//    early once BUDGET has passed and MIN_OPS have been timed, and
+//    reports the rate and the 50th and 99th percentile latencies.
+//    Only the calls themselves are timed, not the loop around them.
+
+constexpr size_t MIN_OPS {5};
+constexpr size_t MAX_OPS {2000};
+constexpr chrono::milliseconds BUDGET {250};
+
+template <typename function>
+size_t measure (const tree_shape& shape, const char* command,
+                size_t limit, function fn) {
+   vector<double> samples;
+   auto deadline = bench_clock::now() + BUDGET;
+   for (size_t op = 0; op < limit; ++op) {
+      if (op >= MIN_OPS and bench_clock::now() > deadline) break;
+      auto start = bench_clock::now();
+      fn (op);
+      chrono::duration<double,nano> elapsed = bench_clock::now() - start;
+      samples.push_back (elapsed.count());
+   }
+   double total = 0;
+   for (double sample: samples) total += sample;
+   sort (samples.begin(), samples.end());
+   auto percentile = [&] (size_t percent) {
+      size_t rank = (samples.size() * percent + 99) / 100;
+      return samples[max<size_t> (rank, 1) - 1];
+   };
+   double rate = samples.size() / (total / 1e9);
+   if (machine_readable) {
+      printf ("%s\t%s\t%zu\t%.0f\t%.0f\t%.0f\n", shape.name, command,
+              samples.size(), rate, percentile (50), percentile (99));
+   }else {
+      printf ("      %-6s %5zu ops %12.0f ops/s   p50 %10.0f ns"
+              "   p99 %10.0f ns\n", command, samples.size(), rate,
+              percentile (50), percentile (99));
+   }
+   fflush (stdout);
+   return samples.size();
+}
+
+// bench_ops -
+//    Each command, through inode_state as a session would call it, on
+//    each shape of tree.  mkdir and make add entries beside the bottom
+//    level, cat reads the files made, rm removes them, and rmr the
+//    directories made, each first given a few files.  ls lists the
+//    directories of the bottom level in turn, and lsr the whole tree.
+
+void bench_ops() {
+   discard_buf nowhere;
+   ostream discard (&nowhere);
+   if (machine_readable) {
+      cout << "shape\tcommand\tops\tops_per_s\tp50_ns\tp99_ns" << endl;
+   }else {
+      cout << "ops: per-command latency, at most " << MAX_OPS
+           << " ops or " << BUDGET.count() << " ms each" << endl;
+   }
+   for (const auto& shape: shapes) {
+      inode_state state;
+      state.setOutput (discard);
+      vector<string> targets = build_shape (state, shape, "", 0);
+      if (not machine_readable) {
+         cout << "   " << shape.name << ": depth " << shape.depth
+              << ", fanout " << shape.fanout << ", " << shape.files
+              << " files of " << shape.file_bytes << " bytes a directory"
+              << endl;
+      }
+      auto dir = [&] (size_t op) {
+         const string& target = targets[op % targets.size()];
+         return target.empty() ? string ("/") : target;
+      };
+      auto at = [&] (size_t op, const char* prefix) {
+         return targets[op % targets.size()] + "/" + prefix
+              + to_string (op);
+      };
+      string body (shape.file_bytes, 'y');
+      size_t dirs = measure (shape, "mkdir", MAX_OPS, [&] (size_t op) {
+         state.mkdir (at (op, "m"));
+      });
+      size_t files = measure (shape, "make", MAX_OPS, [&] (size_t op) {
+         state.make (at (op, "n"), body + to_string (op));
+      });
+      measure (shape, "cat", files, [&] (size_t op) {
+         state.cat (at (op, "n"));
+      });
+      measure (shape, "ls", MAX_OPS, [&] (size_t op) {
+         ls_writer writer (discard);
+         state.getLS (dir (op), writer);
+      });
+      measure (shape, "lsr", MAX_OPS, [&] (size_t) {
+         ls_writer writer (discard);
+         state.getLSR ("/", writer);
+      });
+      measure (shape, "cd", MAX_OPS, [&] (size_t op) {
+         state.cd (dir (op));
+      });
+      state.cd (dir (0));
+      measure (shape, "pwd", MAX_OPS, [&] (size_t) {
+         discard << state.getPWD() << '\n';
+      });
+      state.cd ("/");
+      size_t removed = measure (shape, "rm", files, [&] (size_t op) {
+         state.rm (at (op, "n"));
+      });
+      for (size_t op = removed; op < files; ++op) state.rm (at (op, "n"));
+      for (size_t op = 0; op < dirs; ++op) {
+         for (const char* file: {"/a", "/b", "/c", "/d"}) {
+            state.make (at (op, "m") + file, "data");
+         }
+      }
+      removed = measure (shape, "rmr", dirs, [&] (size_t op) {
+         state.rmr (at (op, "m"));
+      });
+      for (size_t op = removed; op < dirs; ++op) state.rmr (at (op, "m"));
+   }
+}
+
+struct benchmark {
+   const char* name;
+   void (*fn)();
+};
+
+const benchmark benchmarks[] {
+   {"lookup", bench_lookup},
+   {"bigdir", bench_bigdir},
+   {"lsr", bench_lsr},
+   {"rmr", bench_rmr},
+   {"alloc", bench_alloc},
+   {"append", bench_append},
+   {"snapshot", bench_snapshot},
+   {"image", bench_image},
+   {"journal", bench_journal},
+   {"dispatch", bench_dispatch},
+   {"disjoint", bench_disjoint},
+   {"reads", bench_reads},
+   {"dedup", bench_dedup},
+   {"names", bench_names},
+   {"ops", bench_ops},
+};
+
+int main (int argc, char** argv) {
+   execname (argv[0]);
+   opterr = 0;
+   for (;;) {
+      int option = getopt (argc, argv, "m");
+      if (option == EOF) break;
+      switch (option) {
+         case 'm':
+            machine_readable = true;
+            break;
+         default:
+            complain() << "-" << static_cast<char> (optopt)
+                       << ": invalid option" << endl;
+            break;
+      }
+   }
+   for (const auto& bench: benchmarks) {
+      bool wanted = optind >= argc;
+      for (int arg = optind; arg < argc; ++arg) {
+         if (string (argv[arg]) == bench.name) wanted = true;
+      }
+      if (wanted) bench.fn();
+   }
+   return exit_status::get();
+}
+
@@ -1,32 +1,104 @@
-// $Id: commands.cpp,v 1.16 2016-01-14 16:10:40-08 - - $
+// $Id: commands.cpp,v 1.17 2016-01-14 16:10:40-08 - - $
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <thread>
 
 #include "commands.h"
 #include "debug.h"
 
-command_hash cmd_hash {
-   {"cat"   , fn_cat   },
-   {"cd"    , fn_cd    },
-   {"echo"  , fn_echo  },
-   {"exit"  , fn_exit  },
-   {"ls"    , fn_ls    },
-   {"lsr"   , fn_lsr   },
-   {"make"  , fn_make  },
-   {"mkdir" , fn_mkdir },
-   {"prompt", fn_prompt},
-   {"pwd"   , fn_pwd   },
-   {"rm"    , fn_rm    },
-   {"rmr"   , fn_rmr  },
+constexpr command_entry command_table[] {
+   {"append"  , fn_append  , tree_access::CHANGE},
+   {"cat"     , fn_cat     , tree_access::READ  },
+   {"cd"      , fn_cd      , tree_access::READ  },
+   {"df"      , fn_df      , tree_access::READ  },
+   {"echo"    , fn_echo    , tree_access::READ  },
+   {"exit"    , fn_exit    , tree_access::READ  },
+   {"load"    , fn_load    , tree_access::WHOLE },
+   {"ls"      , fn_ls      , tree_access::READ  },
+   {"lsr"     , fn_lsr     , tree_access::READ  },
+   {"make"    , fn_make    , tree_access::CHANGE},
+   {"mkdir"   , fn_mkdir   , tree_access::CHANGE},
+   {"mount"   , fn_mount   , tree_access::WHOLE },
+   {"prompt"  , fn_prompt  , tree_access::READ  },
+   {"pwd"     , fn_pwd     , tree_access::READ  },
+   {"rm"      , fn_rm      , tree_access::CHANGE},
+   {"rmr"     , fn_rmr     , tree_access::CHANGE},
+   {"save"    , fn_save    , tree_access::WHOLE },
+   {"snapshot", fn_snapshot, tree_access::WHOLE },
+   {"stat"    , fn_stat    , tree_access::READ  },
 };
 
-command_fn find_command_fn (const string& cmd) {
-   // Note: value_type is pair<const key_type, mapped_type>
-   // So: iterator->first is key_type (string)
-   // So: iterator->second is mapped_type (command_fn)
-   const auto result = cmd_hash.find (cmd);
-   if (result == cmd_hash.end()) {
-      throw command_error (cmd + ": no such function");
+// Perfect hash -
+//    A command's slot depends only on its length and its first and
+//    last chars, mixed with a seed.  The first seed under which no
+//    two commands share a slot is found by the compiler, and the
+//    slots are filled in then, so a lookup is one hash, one load and
+//    one compare, and adding a command to the table is all it takes
+//    to register it.  If no seed works, compilation fails, and
+//    SLOT_BITS needs to grow.
+
+constexpr size_t COMMAND_COUNT = sizeof command_table
+                               / sizeof command_table[0];
+constexpr unsigned SLOT_BITS = 6;
+constexpr size_t SLOT_COUNT = size_t (1) << SLOT_BITS;
+static_assert (COMMAND_COUNT < SLOT_COUNT, "too many commands");
+
+constexpr size_t command_slot (string_view name, uint32_t seed) {
+   uint32_t key = uint32_t (name.size()) * seed
+                ^ uint32_t (uint8_t (name.front())) << 8
+                ^ uint32_t (uint8_t (name.back()));
+   return uint32_t (key * 2654435769u) >> (32 - SLOT_BITS);
+}
+
+constexpr bool seed_is_perfect (uint32_t seed) {
+   bool taken[SLOT_COUNT] {};
+   for (const auto& entry: command_table) {
+      size_t slot = command_slot (entry.name, seed);
+      if (taken[slot]) return false;
+      taken[slot] = true;
+   }
+   return true;
+}
+
+constexpr uint32_t find_seed() {
+   for (uint32_t seed = 1; seed < 100000; ++seed) {
+      if (seed_is_perfect (seed)) return seed;
+   }
+   return 0;
+}
+
+constexpr uint32_t COMMAND_SEED = find_seed();
+static_assert (COMMAND_SEED != 0, "no perfect hash of the commands");
+
+// command_slots -
+//    Each slot holds one more than the index of its command in
+//    command_table, or 0 if it is empty.
+struct command_slots {
+   uint8_t index[SLOT_COUNT] {};
+   constexpr command_slots() {
+      for (size_t entry = 0; entry < COMMAND_COUNT; ++entry) {
+         index[command_slot (command_table[entry].name, COMMAND_SEED)]
+               = uint8_t (entry + 1);
+      }
+   }
+};
+
+constexpr command_slots slots;
+
+const command_entry& find_command (string_view cmd) {
+   if (not cmd.empty()) {
+      size_t entry = slots.index[command_slot (cmd, COMMAND_SEED)];
+      if (entry != 0 and command_table[entry - 1].name == cmd) {
+         return command_table[entry - 1];
+      }
    }
-   return result->second;
+   throw command_error (string (cmd) + ": no such function");
+}
+
+command_fn find_command_fn (string_view cmd) {
+   return find_command (cmd).fn;
 }
 
 command_error::command_error (const string& what):
@@ -39,11 +111,38 @@ int exit_status_message() {
    return exit_status;
 }
 
-void fn_cat (inode_state& state, const wordvec& words){
+// join_words -
+//    The file contents made from words[first..]: each word followed
+//    by one space, as make and append store them.
+static string join_words (const viewvec& words, size_t first) {
+   size_t length = 0;
+   for (auto it = words.begin()+first; it != words.end(); ++it)
+      length += it->size() + 1;
+   string data;
+   data.reserve(length);
+   for (auto it = words.begin()+first; it != words.end(); ++it)
+   {
+      data.append(*it);
+      data.push_back(' ');
+   }
+   return data;
+}
+
+void fn_append (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   string path = "";
+   if (words.size() > 1)
+   {
+      state.append(words[1], join_words(words, 2));
+   }
+}
+
+void fn_cat (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   string_view path = "";
 
    if (words.size() > 1)
    {
@@ -53,11 +152,45 @@ void fn_cat (inode_state& state, const wordvec& words){
    state.cat(path);
 }
 
-void fn_cd (inode_state& state, const wordvec& words){
+// inode_option -
+//    Parses "-i nr" or "-inr" at words[1], for the commands that can
+//    name a node by its inode number.  Returns false if words[1] is
+//    not -i at all.
+static bool inode_option (const viewvec& words, const string& command,
+                          uint64_t& nr) {
+   if (words.size() < 2 or words[1].substr(0, 2) != "-i") return false;
+   string_view number = words[1].substr(2);
+   size_t operands = 2;
+   if (number.empty() and words.size() > 2)
+   {
+      number = words[2];
+      operands = 3;
+   }
+   auto parsed = from_chars(number.data(), number.data() + number.size(), nr);
+   if (number.empty() or parsed.ec != errc()
+       or parsed.ptr != number.data() + number.size())
+   {
+      throw command_error (command + ": -i needs an inode number");
+   }
+   if (words.size() > operands)
+   {
+      throw command_error (command + ": too many operands");
+   }
+   return true;
+}
+
+void fn_cd (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   string path = "";
+   string_view path = "";
+   uint64_t nr = 0;
+
+   if (inode_option(words, "cd", nr))
+   {
+      state.cdInode(nr);
+      return;
+   }
 
    if (words.size() == 1)
    {
@@ -65,7 +198,7 @@ void fn_cd (inode_state& state, const wordvec& words){
    }
    else if (words.size() > 2)
    {
-      cout << "Too many operands! Please give just 1 folderName or 1 pathName." << endl;
+      state.output() << "Too many operands! Please give just 1 folderName or 1 pathName." << endl;
       return;
    }
    else
@@ -77,14 +210,25 @@ void fn_cd (inode_state& state, const wordvec& words){
    state.cd(path);
 }
 
-void fn_echo (inode_state& state, const wordvec& words){
+void fn_df (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() > 1)
+   {
+      throw command_error ("df: too many operands");
+   }
+   state.df();
+}
+
+void fn_echo (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
-   cout << word_range (words.cbegin() + 1, words.cend()) << endl;
+   state.output() << view_range (words.cbegin() + 1, words.cend()) << endl;
 }
 
 
-void fn_exit (inode_state& state, const wordvec& words){
+void fn_exit (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -93,7 +237,7 @@ void fn_exit (inode_state& state, const wordvec& words){
    if (words.size() > 1)
    {
       try {
-         stateCode = std::stoi(words[1]);
+         stateCode = std::stoi(string(words[1]));
       }
       catch (const std::invalid_argument& ex)
       {
@@ -105,11 +249,11 @@ void fn_exit (inode_state& state, const wordvec& words){
    throw ysh_exit();
 }
 
-void fn_ls (inode_state& state, const wordvec& words){
+void fn_ls (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   string path = "";
+   string_view path = "";
 
    if (words.size() > 1)
    {
@@ -118,60 +262,74 @@ void fn_ls (inode_state& state, const wordvec& words){
 
    DEBUGF ('c', path);
 
-   vector<string> lsInfo = state.getLS(path);
-
-   vector<string> lsInfo_split = split(lsInfo[0], "\t");
-   cout << lsInfo_split[0] << ":" << endl;
-
-   for (unsigned int i = 1; i < lsInfo_split.size(); ++i)
-   {
-      cout << lsInfo_split[i] << endl;
-   }
+   ls_writer out (state.output());
+   state.getLS(path, out);
 }
 
-void fn_lsr (inode_state& state, const wordvec& words){
+// lsr [-j N] [path] -
+//    With -j, the listing is built by N worker threads; -j 0 uses one
+//    per hardware thread.  The output is the same either way.
+// A thread per job is started for each lsr, so the count is bounded
+// well short of what would exhaust the process.  -j 0, one job per
+// core, is held to the same bound, and only a count asked for outright
+// is refused for exceeding it.
+constexpr size_t MAX_LSR_JOBS {64};
+
+void fn_lsr (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   string path = "";
+   string_view path = "";
+   size_t jobs = 1;
+   size_t arg = 1;
 
-   if (words.size() > 1)
+   if (words.size() > arg and words[arg].substr(0, 2) == "-j")
    {
-      path = words[1];
+      string_view count = words[arg++].substr(2);
+      if (count.empty() and words.size() > arg)
+      {
+         count = words[arg++];
+      }
+      auto parsed = from_chars(count.data(), count.data() + count.size(), jobs);
+      if (count.empty() or parsed.ec != errc()
+          or parsed.ptr != count.data() + count.size())
+      {
+         throw command_error ("lsr: -j needs a thread count");
+      }
+      if (jobs == 0)
+      {
+         jobs = clamp<size_t>(thread::hardware_concurrency(), 1,
+                              MAX_LSR_JOBS);
+      }
+      else if (jobs > MAX_LSR_JOBS)
+      {
+         throw command_error ("lsr: -j allows at most "
+                              + to_string (MAX_LSR_JOBS) + " threads");
+      }
    }
 
-   DEBUGF ('c', path);
-
-   vector<string> lsInfo = state.getLSR(path);
-
-   for (unsigned int i = 0; i < lsInfo.size(); ++i)
+   if (words.size() > arg)
    {
-      vector<string> lsInfo_split = split(lsInfo[i], "\t");
-      cout << lsInfo_split[0] << ":" << endl;
-      for (unsigned int i = 1; i < lsInfo_split.size(); ++i)
-      {
-         cout << lsInfo_split[i] << endl;
-      }
+      path = words[arg];
    }
+
+   DEBUGF ('c', path << ", jobs = " << jobs);
+
+   ls_writer out (state.output());
+   state.getLSR(path, out, jobs);
 }
 
-void fn_make (inode_state& state, const wordvec& words){
+void fn_make (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
    if (words.size() > 1)
    {
-      wordvec newdata;
-      for (auto it = words.begin()+2; it != words.end(); ++it)
-      {
-         newdata.push_back(*it);
-         newdata.push_back(" ");
-      }
-      state.make(words[1], newdata);
+      state.make(words[1], join_words(words, 2));
    }
 }
 
-void fn_mkdir (inode_state& state, const wordvec& words){
+void fn_mkdir (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    // words could be a full pathname or relative path
@@ -182,7 +340,7 @@ void fn_mkdir (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_prompt (inode_state& state, const wordvec& words){
+void fn_prompt (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -199,14 +357,14 @@ void fn_prompt (inode_state& state, const wordvec& words){
    state.setPrompt(newPrompt);
 }
 
-void fn_pwd (inode_state& state, const wordvec& words){
+void fn_pwd (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   cout << state.getPWD() << endl;
+   state.output() << state.getPWD() << endl;
 }
 
-void fn_rm (inode_state& state, const wordvec& words){
+void fn_rm (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -216,7 +374,7 @@ void fn_rm (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_rmr (inode_state& state, const wordvec& words){
+void fn_rmr (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -226,3 +384,77 @@ void fn_rmr (inode_state& state, const wordvec& words){
    }
 }
 
+void fn_load (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() != 2)
+   {
+      throw command_error ("load: usage: load imagefile");
+   }
+   state.load(string(words[1]));
+}
+
+void fn_mount (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() != 3)
+   {
+      throw command_error ("mount: usage: mount imagefile path");
+   }
+   state.mount(string(words[1]), words[2]);
+}
+
+void fn_save (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() != 2)
+   {
+      throw command_error ("save: usage: save imagefile");
+   }
+   state.save(string(words[1]));
+}
+
+// With a name, takes a snapshot under it; without, lists the
+// snapshots in the order they were taken.
+void fn_snapshot (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() > 2)
+   {
+      throw command_error ("snapshot: too many operands");
+   }
+
+   if (words.size() == 2)
+   {
+      state.snapshot(words[1]);
+      return;
+   }
+
+   for (const auto& name: state.snapshotNames())
+   {
+      state.output() << name << endl;
+   }
+}
+
+void fn_stat (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   uint64_t nr = 0;
+   if (inode_option(words, "stat", nr))
+   {
+      state.statInode(nr);
+      return;
+   }
+
+   if (words.size() > 2)
+   {
+      throw command_error ("stat: too many operands");
+   }
+   state.stat(words.size() == 2 ? words[1] : string_view());
+}
+
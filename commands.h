@@ -1,9 +1,9 @@
-// $Id: commands.h,v 1.11 2016-01-14 14:45:21-08 - - $
+// $Id: commands.h,v 1.12 2016-01-14 14:45:21-08 - - $
 
 #ifndef __COMMANDS_H__
 #define __COMMANDS_H__
 
-#include <unordered_map>
+#include <string_view>
 using namespace std;
 
 #include "file_sys.h"
@@ -11,8 +11,7 @@ using namespace std;
 
 // A couple of convenient usings to avoid verbosity.
 
-using command_fn = void (*)(inode_state& state, const wordvec& words);
-using command_hash = unordered_map<string,command_fn>;
+using command_fn = void (*)(inode_state& state, const viewvec& words);
 
 // command_error -
 //    Extend runtime_error for throwing exceptions related to this 
@@ -25,20 +24,52 @@ class command_error: public runtime_error {
 
 // execution functions -
 
-void fn_cat    (inode_state& state, const wordvec& words);
-void fn_cd     (inode_state& state, const wordvec& words);
-void fn_echo   (inode_state& state, const wordvec& words);
-void fn_exit   (inode_state& state, const wordvec& words);
-void fn_ls     (inode_state& state, const wordvec& words);
-void fn_lsr    (inode_state& state, const wordvec& words);
-void fn_make   (inode_state& state, const wordvec& words);
-void fn_mkdir  (inode_state& state, const wordvec& words);
-void fn_prompt (inode_state& state, const wordvec& words);
-void fn_pwd    (inode_state& state, const wordvec& words);
-void fn_rm     (inode_state& state, const wordvec& words);
-void fn_rmr    (inode_state& state, const wordvec& words);
-
-command_fn find_command_fn (const string& command);
+void fn_append (inode_state& state, const viewvec& words);
+void fn_cat    (inode_state& state, const viewvec& words);
+void fn_cd     (inode_state& state, const viewvec& words);
+void fn_df     (inode_state& state, const viewvec& words);
+void fn_echo   (inode_state& state, const viewvec& words);
+void fn_exit   (inode_state& state, const viewvec& words);
+void fn_load   (inode_state& state, const viewvec& words);
+void fn_ls     (inode_state& state, const viewvec& words);
+void fn_lsr    (inode_state& state, const viewvec& words);
+void fn_make   (inode_state& state, const viewvec& words);
+void fn_mkdir  (inode_state& state, const viewvec& words);
+void fn_mount  (inode_state& state, const viewvec& words);
+void fn_prompt (inode_state& state, const viewvec& words);
+void fn_pwd    (inode_state& state, const viewvec& words);
+void fn_rm     (inode_state& state, const viewvec& words);
+void fn_rmr    (inode_state& state, const viewvec& words);
+void fn_save   (inode_state& state, const viewvec& words);
+void fn_snapshot (inode_state& state, const viewvec& words);
+void fn_stat   (inode_state& state, const viewvec& words);
+
+// tree_access -
+//    How a command uses the tree, and so how a server must hold the
+//    tree's lock around it.  READ only reads the tree (cd and prompt
+//    change only their own session), and CHANGE changes single
+//    directories, locking each one itself; both hold the tree's lock
+//    shared.  WHOLE walks or replaces the whole tree, or moves the
+//    epoch, and holds it exclusively.
+// command_entry -
+//    One command name, its function, and how it uses the tree.  Every
+//    command is an entry in command_table, in commands.cpp, and
+//    nowhere else.
+// find_command -
+//    Looks up a command by name through a perfect hash of the table,
+//    which is built and checked for collisions at compile time.
+//    Throws command_error if there is no such command.
+
+enum class tree_access {READ, CHANGE, WHOLE};
+
+struct command_entry {
+   string_view name;
+   command_fn fn;
+   tree_access access;
+};
+
+const command_entry& find_command (string_view command);
+command_fn find_command_fn (string_view command);
 
 // exit_status_message -
 //    Prints an exit message and returns the exit status, as recorded
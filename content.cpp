@@ -0,0 +1,166 @@
+// $Id: content.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+#include "content.h"
+#include "debug.h"
+
+// release -
+//    The deleter of a listed body, which knows where it is listed.  A
+//    body delisted by own, and so no longer shared, skips the lock.
+struct content_store::release {
+   content_store* store;
+   size_t hash;
+   bool listed {true};
+   void operator() (rope* body) const {
+      if (listed) store->delist (hash, body);
+      body->~rope();
+      arena_allocator<rope> (store->arena).deallocate (body, 1);
+   }
+};
+
+content_store::content_store (node_arena& arena_): arena (arena_) {
+}
+
+// hash_bytes -
+//    Four lanes of multiply and rotate over 32 bytes a step, as in
+//    xxHash, then the tail a word at a time, so that hashing a body
+//    costs little more than copying it.  A match is always checked
+//    byte for byte, so the hash need only spread bodies well.
+static size_t hash_bytes (string_view bytes) {
+   constexpr uint64_t PRIME1 {0x9E3779B185EBCA87ULL};
+   constexpr uint64_t PRIME2 {0xC2B2AE3D27D4EB4FULL};
+   auto rotl = [] (uint64_t word, int bits) {
+      return word << bits | word >> (64 - bits);
+   };
+   auto word = [] (const char* at) {
+      uint64_t value;
+      memcpy (&value, at, sizeof value);
+      return value;
+   };
+   auto round = [&] (uint64_t lane, uint64_t input) {
+      return rotl (lane + input * PRIME2, 31) * PRIME1;
+   };
+   const char* at = bytes.data();
+   const char* end = at + bytes.size();
+   uint64_t hash = bytes.size() * PRIME1;
+   if (bytes.size() >= 32) {
+      uint64_t lane0 {PRIME1 + PRIME2}, lane1 {PRIME2}, lane2 {0},
+               lane3 {0 - PRIME1};
+      for (; end - at >= 32; at += 32) {
+         lane0 = round (lane0, word (at));
+         lane1 = round (lane1, word (at + 8));
+         lane2 = round (lane2, word (at + 16));
+         lane3 = round (lane3, word (at + 24));
+      }
+      for (uint64_t lane: {lane0, lane1, lane2, lane3}) {
+         hash = rotl (hash ^ round (0, lane), 27) * PRIME1 + PRIME2;
+      }
+   }
+   for (; end - at >= 8; at += 8) {
+      hash = rotl (hash ^ round (0, word (at)), 27) * PRIME1 + PRIME2;
+   }
+   for (; at < end; ++at) {
+      hash = rotl (hash ^ uint8_t (*at) * PRIME2, 11) * PRIME1;
+   }
+   hash ^= hash >> 33;
+   hash *= PRIME2;
+   hash ^= hash >> 29;
+   return hash;
+}
+
+// holds -
+//    Whether body holds exactly bytes.
+static bool holds (const rope& body, string_view bytes) {
+   if (body.size() != bytes.size()) return false;
+   bool same = true;
+   body.for_each_chunk ([&] (string_view chunk) {
+      same = same and memcmp (bytes.data(), chunk.data(), chunk.size()) == 0;
+      bytes.remove_prefix (chunk.size());
+   });
+   return same;
+}
+
+void content_store::delist (size_t hash, const rope* body) {
+   shard& bucket = shard_of (hash);
+   lock_guard<mutex> guard (bucket.lock);
+   auto range = bucket.bodies.equal_range (hash);
+   for (auto entry = range.first; entry != range.second; ++entry) {
+      if (entry->second.body == body) {
+         bucket.bodies.erase (entry);
+         return;
+      }
+   }
+}
+
+shared_ptr<rope> content_store::make() {
+   return allocate_shared<rope> (arena_allocator<rope> (arena));
+}
+
+// Two threads interning the same new bytes at once may both miss, and
+// both list a body; either serves later lookups.
+shared_ptr<rope> content_store::intern (string_view bytes) {
+   size_t hash = hash_bytes (bytes);
+   shard& bucket = shard_of (hash);
+   {
+      lock_guard<mutex> guard (bucket.lock);
+      auto range = bucket.bodies.equal_range (hash);
+      for (auto entry = range.first; entry != range.second; ++entry) {
+         shared_ptr<rope> body = entry->second.ref.lock();
+         if (body != nullptr and holds (*body, bytes)) {
+            DEBUGF ('b', "shared " << bytes.size() << " bytes");
+            return body;
+         }
+      }
+   }
+   arena_allocator<rope> allocator (arena);
+   rope* block = allocator.allocate (1);
+   shared_ptr<rope> body (new (block) rope, release {this, hash}, allocator);
+   body->append (bytes);
+   lock_guard<mutex> guard (bucket.lock);
+   bucket.bodies.emplace (hash, listing {body.get(), body});
+   return body;
+}
+
+// Only the store hands out listed bodies, under the shard's lock, so
+// a body found there with one reference cannot gain another.
+bool content_store::own (const shared_ptr<rope>& body) {
+   release* owner = get_deleter<release> (body);
+   if (owner == nullptr) return true;
+   shard& bucket = shard_of (owner->hash);
+   lock_guard<mutex> guard (bucket.lock);
+   if (not owner->listed) return true;
+   if (body.use_count() != 1) return false;
+   auto range = bucket.bodies.equal_range (owner->hash);
+   for (auto entry = range.first; entry != range.second; ++entry) {
+      if (entry->second.body == body.get()) {
+         bucket.bodies.erase (entry);
+         break;
+      }
+   }
+   owner->listed = false;
+   return true;
+}
+
+// A body whose last reference is going waits in its deleter for the
+// lock, so one counted here is still whole.
+content_store::usage content_store::measure() {
+   usage total;
+   for (shard& bucket: shards) {
+      lock_guard<mutex> guard (bucket.lock);
+      for (const auto& entry: bucket.bodies) {
+         size_t references = entry.second.ref.use_count();
+         if (references == 0) continue;
+         size_t bytes = entry.second.body->size();
+         ++total.bodies;
+         total.bytes += bytes;
+         total.references += references;
+         total.saved += bytes * (references - 1);
+      }
+   }
+   return total;
+}
+
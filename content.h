@@ -0,0 +1,75 @@
+// $Id: content.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// content_store -
+//    The bodies of plain files, each distinct content stored once.  A
+//    body written whole is hashed and looked up here, and a file
+//    written with the same bytes as a body already listed shares that
+//    rope instead of copying it.  The store lists its bodies only by
+//    weak reference, and a body leaves the list when the last file
+//    holding it lets go.  A listed body may be shared, so it is never
+//    appended to: a file appending to one first takes it over, if it
+//    holds the only reference, or copies it.  The list is split into
+//    shards by hash, each with its own mutex, so that files written
+//    at once on different threads seldom wait for one another.  The
+//    arena must outlive the store, and the store every body.
+// make -
+//    A new empty body for one file alone, never listed.
+// intern -
+//    A body holding bytes: a listed one that already holds them, or a
+//    new one, listed from then on.
+// own -
+//    Whether body may be appended to in place.  A listed body the
+//    caller holds the only reference to is delisted, and may be; one
+//    still shared may not, and must be copied.
+// measure -
+//    Counts the bodies listed and the references to them.  Every
+//    reference to a body beyond the first is a copy saved, whether a
+//    file's or a snapshot's; a body retired but not yet released
+//    counts until it is.
+
+#ifndef __CONTENT_H__
+#define __CONTENT_H__
+
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+using namespace std;
+
+#include "arena.h"
+#include "rope.h"
+
+class content_store {
+   private:
+      static constexpr size_t SHARDS {16};
+      struct listing {
+         const rope* body;
+         weak_ptr<rope> ref;
+      };
+      struct shard {
+         mutex lock;
+         unordered_multimap<size_t,listing> bodies;
+      };
+      struct release;
+      node_arena& arena;
+      shard shards[SHARDS];
+      shard& shard_of (size_t hash) { return shards[hash % SHARDS]; }
+      void delist (size_t hash, const rope* body);
+   public:
+      struct usage {
+         size_t bodies {0};
+         size_t bytes {0};
+         size_t references {0};
+         size_t saved {0};
+      };
+      explicit content_store (node_arena& arena);
+      content_store (const content_store&) = delete;
+      content_store& operator= (const content_store&) = delete;
+      shared_ptr<rope> make();
+      shared_ptr<rope> intern (string_view bytes);
+      bool own (const shared_ptr<rope>& body);
+      usage measure();
+};
+
+#endif
+
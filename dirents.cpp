@@ -0,0 +1,240 @@
+// $Id: dirents.cpp,v 1.2 2016-01-14 16:16:52-08 - - $
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+#include "debug.h"
+#include "dirents.h"
+
+size_t dirent_table::promote_threshold {64};
+size_t dirent_table::demote_threshold {32};
+
+static size_t name_hash (string_view name) {
+   return hash<string_view>{} (name);
+}
+
+// The low 32 bits of the hash are kept in each slot, and since no
+// index is ever larger than 2^32 slots, the home slot of an entry can
+// always be recovered from its tag without rehashing the name.
+
+static uint64_t make_slot (size_t hash, uint32_t entry) {
+   return (static_cast<uint64_t> (static_cast<uint32_t> (hash)) << 32)
+        | (static_cast<uint64_t> (entry) + 1);
+}
+
+static uint32_t slot_tag (uint64_t slot) {
+   return static_cast<uint32_t> (slot >> 32);
+}
+
+static uint32_t slot_entry (uint64_t slot) {
+   return static_cast<uint32_t> (slot) - 1;
+}
+
+void dirent_table::set_thresholds (size_t promote, size_t demote) {
+   if (promote <= demote) {
+      throw invalid_argument ("dirent_table: promote threshold "
+                              "must exceed demote threshold");
+   }
+   promote_threshold = promote;
+   demote_threshold = demote;
+}
+
+// bisect -
+//    Position of the first entry of a sorted table not less than
+//    name.
+size_t dirent_table::bisect (string_view name) const {
+   auto pos = lower_bound (entries.begin(), entries.end(), name,
+              [] (const value_type& entry, string_view key) {
+                 return entry.first.view() < key;
+              });
+   return pos - entries.begin();
+}
+
+// probe -
+//    Linear probe from the home slot of hash.  Returns the slot that
+//    holds name, or the empty slot where it would be inserted.
+size_t dirent_table::probe (string_view name, size_t hash) const {
+   size_t mask = index.size() - 1;
+   uint32_t tag = static_cast<uint32_t> (hash);
+   for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+      uint64_t slot = index[pos];
+      if (slot == 0) return pos;
+      if (slot_tag (slot) == tag
+          and entries[slot_entry (slot)].first == name) return pos;
+   }
+}
+
+void dirent_table::insert_slot (size_t hash, uint32_t entry) {
+   size_t mask = index.size() - 1;
+   size_t pos = hash & mask;
+   while (index[pos] != 0) pos = (pos + 1) & mask;
+   index[pos] = make_slot (hash, entry);
+}
+
+// erase_slot -
+//    Backward-shift deletion: later members of the probe cluster
+//    are moved up into the hole, so no tombstones are needed.
+void dirent_table::erase_slot (size_t hole) {
+   size_t mask = index.size() - 1;
+   index[hole] = 0;
+   for (size_t pos = (hole + 1) & mask; index[pos] != 0;
+        pos = (pos + 1) & mask) {
+      size_t home = slot_tag (index[pos]) & mask;
+      // The slot at pos may move into the hole only if its home is
+      // not cyclically within (hole, pos].
+      bool stays = hole <= pos ? hole < home and home <= pos
+                               : hole < home or home <= pos;
+      if (stays) continue;
+      index[hole] = index[pos];
+      index[pos] = 0;
+      hole = pos;
+   }
+}
+
+void dirent_table::rebuild_index (size_t capacity) {
+   index.assign (capacity, 0);
+   for (size_t entry = 0; entry < entries.size(); ++entry) {
+      insert_slot (entries[entry].first.hash(), entry);
+   }
+}
+
+// promote -
+//    The sorted vector becomes the entry array of the hash table.
+//    It is still in order, so the sorted view comes for free.
+void dirent_table::promote() {
+   DEBUGF ('d', "promote at " << entries.size() << " entries");
+   size_t capacity = 16;
+   while (capacity < entries.size() * 2) capacity <<= 1;
+   rebuild_index (capacity);
+   order.resize (entries.size());
+   iota (order.begin(), order.end(), 0);
+   order_valid = true;
+}
+
+void dirent_table::demote() {
+   DEBUGF ('d', "demote at " << entries.size() << " entries");
+   sort (entries.begin(), entries.end(),
+         [] (const value_type& a, const value_type& b) {
+            return a.first < b.first;
+         });
+   vector<uint64_t>().swap (index);
+   vector<uint32_t>().swap (order);
+   order_valid = false;
+}
+
+// sorted_order -
+//    Readers sharing a tree may want the order of one table at the
+//    same time, so the first of them sorts it under the table's
+//    order_lock and the rest wait for it; readers of other tables
+//    do not.  Every other change to the order is made by a writer,
+//    which has the table to itself.
+const vector<uint32_t>& dirent_table::sorted_order() const {
+   if (order_valid.load (memory_order_acquire)) return order;
+   lock_guard<mutex> guard (order_lock);
+   if (not order_valid.load (memory_order_relaxed)) {
+      // Names are gathered first, so that comparing two reads their
+      // bytes without going through the entries to find them.
+      vector<pair<string_view,uint32_t>> names;
+      names.reserve (entries.size());
+      for (uint32_t pos = 0; pos < entries.size(); ++pos) {
+         names.emplace_back (entries[pos].first.view(), pos);
+      }
+      sort (names.begin(), names.end());
+      order.resize (entries.size());
+      for (size_t pos = 0; pos < names.size(); ++pos) {
+         order[pos] = names[pos].second;
+      }
+      order_valid.store (true, memory_order_release);
+   }
+   return order;
+}
+
+// locate -
+//    Where name is: its entry position in a sorted table, or its
+//    slot in a hashed one.  npos if it is absent.
+size_t dirent_table::locate (string_view name) const {
+   if (not hashed()) {
+      size_t pos = bisect (name);
+      if (pos == entries.size() or entries[pos].first != name) {
+         return npos;
+      }
+      return pos;
+   }
+   size_t pos = probe (name, name_hash (name));
+   return index[pos] == 0 ? npos : pos;
+}
+
+dirent_table::value_type& dirent_table::at (size_t where) {
+   return hashed() ? entries[slot_entry (index[where])] : entries[where];
+}
+
+inode_ptr* dirent_table::find (string_view name) {
+   size_t where = locate (name);
+   return where == npos ? nullptr : &at (where).second;
+}
+
+pair<dirent_table::value_type*,bool>
+dirent_table::emplace (string_view name) {
+   if (not hashed()) {
+      size_t pos = bisect (name);
+      if (pos < entries.size() and entries[pos].first == name) {
+         return {&entries[pos], false};
+      }
+      entries.emplace (entries.begin() + pos, name_ref (name), nullptr);
+      if (entries.size() > promote_threshold) promote();
+      return {&entries[pos], true};
+   }
+   // Keep the load factor at or below one half.
+   if ((entries.size() + 1) * 2 > index.size()) {
+      rebuild_index (index.size() * 2);
+   }
+   size_t hash = name_hash (name);
+   size_t pos = probe (name, hash);
+   if (index[pos] != 0) return {&entries[slot_entry (index[pos])], false};
+   uint32_t entry = entries.size();
+   entries.emplace_back (name_ref (name, hash), nullptr);
+   index[pos] = make_slot (hash, entry);
+   order_valid = false;
+   return {&entries.back(), true};
+}
+
+inode_ptr dirent_table::erase_at (size_t where) {
+   inode_ptr node;
+   if (not hashed()) {
+      node = move (entries[where].second);
+      entries.erase (entries.begin() + where);
+      return node;
+   }
+   uint32_t entry = slot_entry (index[where]);
+   node = move (entries[entry].second);
+   erase_slot (where);
+   // Fill the gap with the last entry and repoint its slot.
+   uint32_t last = entries.size() - 1;
+   if (entry != last) {
+      entries[entry] = move (entries[last]);
+      size_t mask = index.size() - 1;
+      size_t moved = entries[entry].first.hash() & mask;
+      while (slot_entry (index[moved]) != last) {
+         moved = (moved + 1) & mask;
+      }
+      index[moved] = make_slot (slot_tag (index[moved]), entry);
+   }
+   entries.pop_back();
+   order_valid = false;
+   if (entries.size() < demote_threshold) demote();
+   return node;
+}
+
+void dirent_table::release (vector<inode_ptr>& nodes) {
+   for (auto& entry: entries) nodes.push_back (move (entry.second));
+   vector<value_type>().swap (entries);
+   vector<uint64_t>().swap (index);
+   vector<uint32_t>().swap (order);
+   order_valid = false;
+}
+
@@ -0,0 +1,118 @@
+// $Id: dirents.h,v 1.2 2016-01-14 16:16:52-08 - - $
+
+// dirent_table -
+//    The name-to-inode mapping held by a directory.  Small tables are
+//    a flat vector kept sorted by name and searched by bisection.
+//    Once a table grows past promote_threshold entries it switches to
+//    an unsorted vector with an open-addressing hash index over it,
+//    and drops back to the sorted vector when it shrinks below
+//    demote_threshold.  Listings still need lexicographic order, so a
+//    large table sorts an index of its entries on the first ordered
+//    walk and keeps it until the next insert or erase, sorting it
+//    under a lock of the table's own.  Names are interned (see
+//    names.h), so an entry is a pointer to its name and the node, and
+//    the hash each index needs was computed once, when the name was
+//    first interned.
+// find -
+//    Returns a pointer to the inode_ptr stored under name, or nullptr.
+// emplace -
+//    Looks name up once.  If it is absent, adds an entry with a null
+//    inode_ptr for the caller to fill in, or to erase if it cannot.
+//    Returns the entry and whether it was added.
+// erase -
+//    Removes name and returns the inode_ptr it held, or nullptr if
+//    there was no such entry.  The second form first passes the node
+//    to check, which may throw to veto the removal, without a second
+//    lookup.
+// for_each_sorted -
+//    Calls fn (name, node) for every entry in lexicographic order.
+// release -
+//    Moves every inode_ptr out into nodes and empties the table.
+// sorted_at -
+//    The entry at position i of that order, for walks that need to
+//    stop and resume part way through a table.
+// set_thresholds -
+//    Sets the switching points for every table.  They are fixed for
+//    the life of the process: main sets them once, from -d, before the
+//    first table exists and before any thread starts, and from then
+//    on they are only read.  promote must be larger than demote, so
+//    that a table does not flip back and forth at one size; throws
+//    invalid_argument if it is not.
+
+#ifndef __DIRENTS_H__
+#define __DIRENTS_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "names.h"
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+class dirent_table {
+   public:
+      using value_type = pair<name_ref,inode_ptr>;
+   private:
+      static size_t promote_threshold;
+      static size_t demote_threshold;
+      vector<value_type> entries;
+      // Each slot holds the entry index plus one in its low half (0
+      // marks an empty slot) and the high bits of the name's hash in
+      // its upper half, so most mismatches skip the string compare.
+      vector<uint64_t> index;
+      mutable vector<uint32_t> order;
+      mutable atomic<bool> order_valid {false};
+      mutable mutex order_lock;
+      bool hashed() const { return not index.empty(); }
+      size_t bisect (string_view name) const;
+      size_t probe (string_view name, size_t hash) const;
+      void insert_slot (size_t hash, uint32_t entry);
+      void erase_slot (size_t slot);
+      void rebuild_index (size_t capacity);
+      void promote();
+      void demote();
+      const vector<uint32_t>& sorted_order() const;
+      static constexpr size_t npos {static_cast<size_t> (-1)};
+      size_t locate (string_view name) const;
+      value_type& at (size_t where);
+      inode_ptr erase_at (size_t where);
+   public:
+      static void set_thresholds (size_t promote, size_t demote);
+      size_t size() const { return entries.size(); }
+      inode_ptr* find (string_view name);
+      pair<value_type*,bool> emplace (string_view name);
+      void release (vector<inode_ptr>& nodes);
+      inode_ptr erase (string_view name) {
+         return erase (name, [] (const inode_ptr&) {});
+      }
+      template <typename function>
+      inode_ptr erase (string_view name, function check) {
+         size_t where = locate (name);
+         if (where == npos) return nullptr;
+         check (at (where).second);
+         return erase_at (where);
+      }
+      const value_type& sorted_at (size_t i) const {
+         return hashed() ? entries[sorted_order()[i]] : entries[i];
+      }
+      template <typename function>
+      void for_each_sorted (function fn) const {
+         if (not hashed()) {
+            for (const auto& entry: entries) fn (entry.first, entry.second);
+         }else {
+            for (uint32_t i: sorted_order()) {
+               fn (entries[i].first, entries[i].second);
+            }
+         }
+      }
+};
+
+#endif
+
@@ -1,16 +1,25 @@
 // $Id: file_sys.cpp,v 1.5 2016-01-14 16:16:52-08 - - $
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <unordered_map>
-#include <queue>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <filesystem>
+#include <mutex>
+#include <system_error>
 
 using namespace std;
 
 #include "debug.h"
 #include "file_sys.h"
+#include "image.h"
+#include "workpool.h"
 
-int inode::next_inode_nr {1};
 
 struct file_type_hash {
    size_t operator() (file_type type) const {
@@ -30,217 +39,1320 @@ ostream& operator<< (ostream& out, file_type type) {
  *
  =====================================================================================================================*/
 
-inode_state::inode_state() {
-   // create root inode and set cwd == root.
-   root = make_shared<inode>(file_type::DIRECTORY_TYPE);
+ls_writer::ls_writer(ostream& out_): out(&out_) {
+	buffer.reserve(CAPACITY);
+}
+
+ls_writer::~ls_writer() {
+	flush();
+}
+
+void ls_writer::flush() {
+	if (out != nullptr)
+	{
+		out->write(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+}
+
+void ls_writer::spill() {
+	if (buffer.size() >= CAPACITY)
+	{
+		flush();
+	}
+}
+
+void ls_writer::begin(string_view dirname) {
+	buffer += dirname;
+	buffer += ":\n";
+	spill();
+}
+
+void ls_writer::block(string_view lines) {
+	buffer += lines;
+	spill();
+}
+
+// Formats " inode_nr size name" straight into the buffer; the numbers
+// go through to_chars, so no temporary strings are built.
+void ls_writer::entry(uint64_t inode_nr, size_t size, string_view name, bool append_slash) {
+	char digits[24];
+	buffer += ' ';
+	buffer.append(digits, to_chars(digits, digits + sizeof digits, inode_nr).ptr);
+	buffer += ' ';
+	buffer.append(digits, to_chars(digits, digits + sizeof digits, size).ptr);
+	buffer += ' ';
+	buffer += name;
+	if (append_slash)
+	{
+		buffer += '/';
+	}
+	buffer += '\n';
+	spill();
+}
+
+/*======================================================================================================================
+ *
+ =====================================================================================================================*/
+
+dentry_cache::dentry_cache(atomic<size_t>& generation_, size_t capacity):
+                           generation(generation_) {
+	// round up to a power of two so a slot is picked with a mask
+	size_t size = 1;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+	slots.resize(size);
+}
+
+// FNV-1a over the base inode number and the path bytes.
+dentry_cache::entry& dentry_cache::slot(uint64_t base, string_view path) {
+	size_t hash = 14695981039346656037ULL;
+	hash = (hash ^ static_cast<size_t>(base)) * 1099511628211ULL;
+	for (unsigned char c : path)
+	{
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+	return slots[hash & (slots.size() - 1)];
+}
+
+inode_ptr dentry_cache::find(uint64_t base, string_view path) {
+	size_t stamp;
+	return find(base, path, stamp);
+}
+
+inode_ptr dentry_cache::find(uint64_t base, string_view path,
+                             size_t& stamp) {
+	entry& e = slot(base, path);
+	stamp = e.generation;
+	if (e.generation == generation and e.base == base and e.path == path)
+	{
+		inode_ptr node = e.node.lock();
+		if (node != nullptr)
+		{
+			++hit_count;
+			return node;
+		}
+	}
+	++miss_count;
+	return nullptr;
+}
+
+void dentry_cache::insert(uint64_t base, string_view path, inode_ptr node) {
+	entry& e = slot(base, path);
+	e.generation = generation;
+	e.base = base;
+	e.path = path;
+	e.node = node;
+}
+
+void dentry_cache::erase(uint64_t base, string_view path) {
+	entry& e = slot(base, path);
+	if (e.base == base and e.path == path)
+	{
+		e = entry();
+	}
+}
+
+/*======================================================================================================================
+ *
+ =====================================================================================================================*/
+
+// Number 0 is never given out, so the root is 1, as it always was.
+inode_table::inode_table(): slots(1) {
+}
+
+void inode_table::place(const inode_ptr& node, uint64_t nr) {
+   slots[nr] = {node.get(), node};
+   node->inode_nr = nr;
+   node->table = this;
+}
+
+void inode_table::enter(const inode_ptr& node) {
+   lock_guard<mutex> guard(lock);
+   // A freed number may since have been claimed by a load.
+   while (not freed.empty()) {
+      uint64_t nr = freed.back();
+      freed.pop_back();
+      if (slots[nr].node == nullptr) {
+         place(node, nr);
+         return;
+      }
+   }
+   slots.emplace_back();
+   place(node, slots.size() - 1);
+}
+
+void inode_table::claim(const inode_ptr& node, uint64_t nr) {
+   lock_guard<mutex> guard(lock);
+   if (node->table == this and slots[node->inode_nr].node == node.get()) {
+      slots[node->inode_nr] = {};
+      freed.push_back(node->inode_nr);
+   }
+   while (slots.size() <= nr) {
+      freed.push_back(slots.size());
+      slots.emplace_back();
+   }
+   place(node, nr);
+}
+
+void inode_table::release(const inode* node) {
+   lock_guard<mutex> guard(lock);
+   slot& held = slots[node->inode_nr];
+   if (held.node != node) return;
+   held = {};
+   freed.push_back(node->inode_nr);
+}
+
+inode_ptr inode_table::find(uint64_t nr) {
+   lock_guard<mutex> guard(lock);
+   if (nr >= slots.size()) return nullptr;
+   return slots[nr].ref.lock();
+}
+
+void inode_table::reserve(uint64_t limit) {
+   lock_guard<mutex> guard(lock);
+   if (limit <= slots.size()) return;
+   slots.reserve(limit);
+   freed.reserve(freed.size() + limit - slots.size());
+   while (slots.size() < limit) {
+      freed.push_back(slots.size());
+      slots.emplace_back();
+   }
+}
+
+uint64_t inode_table::limit() {
+   lock_guard<mutex> guard(lock);
+   return slots.size();
+}
+
+tree_state::tree_state() {
+   // create root inode.
+   root = inode::make(file_type::DIRECTORY_TYPE, *this, epoch);
 	root->contents->setSelfNode(root);
-	root->contents->setParentNode(root);
-   cwd = root;
-   DEBUGF ('i', "root = " << root << ", cwd = " << cwd
+	root->parent = root;
+}
+
+inode_state::inode_state(): inode_state(make_shared<tree_state>()) {
+}
+
+inode_state::inode_state(shared_ptr<tree_state> tree_):
+                         tree(move(tree_)), dcache(tree->generation) {
+   // set cwd == root.
+   cwd = tree->root;
+   seen_replaced = tree->replaced;
+   DEBUGF ('i', "root = " << tree->root << ", cwd = " << cwd
           << ", prompt = \"" << prompt() << "\"");
 }
 
+void inode_state::followTree()
+{
+	if (seen_replaced != tree->replaced)
+	{
+		seen_replaced = tree->replaced;
+		cwd = tree->root;
+		cwd_view = LIVE_VIEW;
+		cwd_path_valid = false;
+	}
+}
+
+// The canonical path of cwd is rebuilt by following parent links up
+// to the root, then cached until cwd changes or one of its ancestors
+// is removed.
 string inode_state::getPWD() {
 
-	string pathName = "";
-	inode_ptr thisNode = cwd;
-	inode_ptr currentNode = cwd;
-	inode_ptr parentNode = currentNode->contents->getNodeByName("..");
+	followTree();
+	if (cwd_path_valid)
+	{
+		return cwd_path;
+	}
+
+	cwd_path = pathOf(cwd, cwd_view);
+	cwd_path_valid = true;
+
+	return cwd_path;
+}
+
+string inode_state::pathOf(const inode_ptr& node, view_id view) {
+	vector<const inode*> ancestors;
+	size_t length = 0;
+	inode_ptr currentNode = node;
+	inode_ptr parentNode = currentNode->getParent();
+
+	while (parentNode != nullptr and parentNode != currentNode)
+	{
+		ancestors.push_back(currentNode.get());
+		length += currentNode->name.size() + 1;
+		currentNode = parentNode;
+		parentNode = currentNode->getParent();
+	}
+
+	string pathName;
+	pathName.reserve(length + 1);
+	for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it)
+	{
+		pathName += "/";
+		pathName += (*it)->name.view();
+	}
+
+	if (view != LIVE_VIEW)
+	{
+		pathName.insert(0, "/.snapshot/" + tree->snapshot_names[view - FIRST_EPOCH]);
+	}
+
+	if (pathName.empty())
+	{
+		pathName = "/";
+	}
+
+	return pathName;
+}
+
+// Drop the cached cwd path if the removed node is cwd or one of its
+// ancestors.
+void inode_state::invalidatePWD(inode_ptr removed)
+{
+	if (isWithin(cwd, removed))
+	{
+		cwd_path_valid = false;
+	}
+}
+
+// True if subtree is node or one of its ancestors.
+bool inode_state::isWithin(inode_ptr node, inode_ptr subtree)
+{
+	if (subtree == nullptr)
+	{
+		return false;
+	}
+
+	inode_ptr currentNode = node;
+	inode_ptr parentNode = currentNode->getParent();
+
+	for (;;)
+	{
+		if (currentNode == subtree)
+		{
+			return true;
+		}
+
+		if (parentNode == nullptr or parentNode == currentNode)
+		{
+			return false;
+		}
+
+		currentNode = parentNode;
+		parentNode = currentNode->getParent();
+	}
+}
+
+// Every unlink marks the node it unlinks, so an ancestor marked is
+// enough to know that node can no longer be reached from the root,
+// and no directory need be locked to find out.  An ancestor may also
+// have been freed already, leaving the walk at some other top.
+bool inode_state::isLinked(inode_ptr node)
+{
+	inode_ptr currentNode = node;
+	for (;;)
+	{
+		if (currentNode->unlinked)
+		{
+			return false;
+		}
+
+		inode_ptr parentNode = currentNode->getParent();
+		if (parentNode == nullptr or parentNode == currentNode)
+		{
+			return currentNode == tree->root;
+		}
+		currentNode = parentNode;
+	}
+}
+
+// If an absolute path leads into a snapshot, strips the
+// /.snapshot/name prefix from it and returns the snapshot's view;
+// otherwise leaves it alone and returns LIVE_VIEW.
+view_id inode_state::snapshotView(string_view& path) {
+
+	constexpr string_view snapshotDir = ".snapshot";
+
+	size_t start = path.find_first_not_of('/');
+	if (start == string_view::npos)
+	{
+		return LIVE_VIEW;
+	}
+
+	string_view rest = path.substr(start);
+	if (rest.substr(0, snapshotDir.size()) != snapshotDir
+	    or (rest.size() > snapshotDir.size() and rest[snapshotDir.size()] != '/'))
+	{
+		return LIVE_VIEW;
+	}
+
+	rest.remove_prefix(snapshotDir.size());
+	start = rest.find_first_not_of('/');
+	if (start == string_view::npos)
+	{
+		throw file_error (string(path)+": name a snapshot");
+	}
+
+	rest.remove_prefix(start);
+	size_t end = rest.find('/');
+	string_view name = rest.substr(0, end);
+	auto found = tree->snapshots.find(name);
+	if (found == tree->snapshots.end())
+	{
+		throw file_error (string(name)+": no such snapshot");
+	}
+
+	path = end == string_view::npos ? string_view() : rest.substr(end);
+	return found->second;
+}
+
+// dir_lock -
+//    Only a directory on the heap has a lock to take.
+dir_lock::dir_lock(const inode& node, bool exclusive_) {
+	directory* dir = dynamic_cast<directory*>(node.contents);
+	if (dir == nullptr)
+	{
+		return;
+	}
+
+	held = &dir->lock;
+	exclusive = exclusive_;
+	if (exclusive)
+	{
+		held->lock();
+	}
+	else
+	{
+		held->lock_shared();
+	}
+}
+
+dir_lock::dir_lock(dir_lock&& that) noexcept:
+                   held(that.held), exclusive(that.exclusive) {
+	that.held = nullptr;
+}
+
+dir_lock& dir_lock::operator=(dir_lock&& that) noexcept {
+	if (this != &that)
+	{
+		release();
+		held = that.held;
+		exclusive = that.exclusive;
+		that.held = nullptr;
+	}
+	return *this;
+}
+
+void dir_lock::release() {
+	if (held == nullptr)
+	{
+		return;
+	}
+
+	if (exclusive)
+	{
+		held->unlock();
+	}
+	else
+	{
+		held->unlock_shared();
+	}
+	held = nullptr;
+}
+
+// With given path, it will find the corresponding NODE containing FOLDER type contents ONLY
+// if client want to find a file inside a folder, this is how to use this function to get the parent folder of the file:
+// "/fd1/fd2/fl1" --> input to getTargetNode should be: "/fd/f2"
+// if path starts with "/", it will start searching from root.
+// otherwise, it will start the search from cwd.
+// empty path will return cwd immediately.
+inode_ptr inode_state::getTargetNode(string_view path, view_id& view) {
+	inode_ptr found = findLive(path);
+	if (found != nullptr)
+	{
+		view = LIVE_VIEW;
+		return found;
+	}
+
+	dir_lock held;
+	return getTargetNode(path, view, held, false);
+}
+
+// The walk mirrors getNodeByName: ".." of a node whose parent is
+// gone, or of the root, is the node itself.  A snapshot has no entry
+// in the root's index, so its paths fall through with the misses.
+inode* inode_state::walkLive(string_view path, inode_ptr& anchor) {
+	followTree();
+	if (not tree->lockfree_reads or cwd_view != LIVE_VIEW)
+	{
+		return nullptr;
+	}
+
+	inode* node = not path.empty() and path[0] == '/' ? tree->root.get()
+	                                                  : cwd.get();
+	for (string_view fdName : tokenizer(path, path_delimiters))
+	{
+		directory* dir = dynamic_cast<directory*>(node->contents);
+		if (dir == nullptr)
+		{
+			return nullptr;
+		}
+
+		if (fdName == ".")
+		{
+			continue;
+		}
+
+		if (fdName == "..")
+		{
+			inode_ptr up = node->parent.lock();
+			if (up != nullptr)
+			{
+				anchor = move(up);
+				node = anchor.get();
+			}
+			continue;
+		}
+
+		node = dir->index.find(fdName);
+		if (node == nullptr)
+		{
+			return nullptr;
+		}
+	}
+	return node;
+}
+
+inode_ptr inode_state::findLive(string_view path) {
+	followTree();
+	if (not tree->lockfree_reads or cwd_view != LIVE_VIEW)
+	{
+		return nullptr;
+	}
+
+	uint64_t base = not path.empty() and path[0] == '/' ? 0 : cwd->inode_nr;
+	inode_ptr found = dcache.find(base, path);
+	if (found != nullptr)
+	{
+		return found;
+	}
+
+	{
+		rcu::reader reading;
+		inode_ptr anchor;
+		inode* node = walkLive(path, anchor);
+		directory* dir = node == nullptr ? nullptr
+		                                 : dynamic_cast<directory*>(node->contents);
+		if (dir == nullptr)
+		{
+			return nullptr;
+		}
+		found = dir->selfNode.lock();
+	}
+
+	if (found != nullptr)
+	{
+		dcache.insert(base, path, found);
+	}
+	return found;
+}
+
+inode_ptr inode_state::getTargetNode(string_view path, view_id& view,
+                                     dir_lock& held, bool exclusive) {
+
+	DEBUGF ('i', "path = " << path);
+	DEBUGF ('i', "path size = " << path.length());
+
+	followTree();
+	const string_view fullPath = path;
+	inode_ptr targetNode = cwd;
+	view = cwd_view;
+
+	// see if any path is specified
+	// if no path is specified, we should return cwd
+	if (path.length() > 0)
+	{
+		// absolute paths are cached independently of cwd, so they all
+		// share base 0, which is never a valid inode number.
+		uint64_t base = 0;
+
+		// if this is true, we have to search from root node
+		if (path[0] == '/')
+		{
+			targetNode = tree->root;
+			view = snapshotView(path);
+		}
+		else
+		{
+			base = cwd->inode_nr;
+		}
+
+		// only the live tree is cached: a snapshot path would need the
+		// view in the key as well, and snapshots are rarely hot.
+		bool cached = view == LIVE_VIEW;
+		if (cached)
+		{
+			size_t stamp;
+			inode_ptr cachedNode = dcache.find(base, path, stamp);
+			if (cachedNode != nullptr)
+			{
+				// the node may have been unlinked, or the path
+				// changed, between the lookup and the lock; if so,
+				// the entry goes and the path is walked after all
+				held = dir_lock(*cachedNode, exclusive);
+				if (dcache.current(stamp) and isLinked(cachedNode))
+				{
+					return cachedNode;
+				}
+				held.release();
+				dcache.erase(base, path);
+			}
+		}
+
+		// walk the path one '/'-separated component at a time, the
+		// last one taking the lock asked for
+		bool last = path_delimiters.find_first_not_of(path, 0) == string_view::npos;
+		held = dir_lock(*targetNode, exclusive and last);
+		for (string_view fdName : tokenizer(path, path_delimiters))
+		{
+			DEBUGF ('i', "path token = " << fdName);
+
+			inode_ptr nextNode = targetNode->contents->getNodeByName(fdName, view);
+
+			if (nextNode == nullptr)
+			{
+				held.release();
+				throw file_error (string(fullPath)+" does not exist!");
+			}
+
+			// a step up, or in place, lets go first: only a parent
+			// is ever locked before its child
+			size_t rest = fdName.data() + fdName.size() - path.data();
+			last = path_delimiters.find_first_not_of(path, rest) == string_view::npos;
+			if (nextNode == targetNode or fdName == "..")
+			{
+				held.release();
+				held = dir_lock(*nextNode, exclusive and last);
+			}
+			else
+			{
+				dir_lock next(*nextNode, exclusive and last);
+				held = move(next);
+			}
+			targetNode = nextNode;
+		}
+
+		if (cached)
+		{
+			dcache.insert(base, path, targetNode);
+		}
+		return targetNode;
+	}
+
+	held = dir_lock(*targetNode, exclusive);
+	return targetNode;
+}
+
+// Splits path at its last '/' into the directory holding the final
+// component, which is returned, and the name of that component.
+// A path with no '/' names an entry of cwd.
+inode_ptr inode_state::getParentNode(string_view path, string_view& name,
+                                     view_id& view, dir_lock& held,
+                                     bool exclusive) {
+
+	size_t found = path.find_last_of('/');
+	if (found == string_view::npos)
+	{
+		followTree();
+		name = path;
+		view = cwd_view;
+		held = dir_lock(*cwd, exclusive);
+		return cwd;
+	}
+
+	// the parent of a name just below the root is the root, not cwd
+	name = path.substr(found + 1);
+	return getTargetNode(path.substr(0, max<size_t>(found, 1)), view, held, exclusive);
+}
+
+// getParentNode for a change, which holds the directory exclusively:
+// snapshots are read-only, and their names take the place of an
+// entry of the root.
+inode_ptr inode_state::getWritableParent(string_view path, string_view& name,
+                                         dir_lock& held) {
+
+	view_id view;
+	inode_ptr targetFolder = getParentNode(path, name, view, held, true);
+
+	if (view != LIVE_VIEW)
+	{
+		held.release();
+		throw file_error (string(path)+": read-only snapshot");
+	}
+
+	if (targetFolder == tree->root and name == ".snapshot")
+	{
+		held.release();
+		throw file_error (string(path)+": reserved for snapshots");
+	}
+
+	return targetFolder;
+}
+
+void inode_state::getLS(string_view path, ls_sink& sink) {
+	view_id view;
+	this->getTargetNode(path, view)->getLS(path, sink, view);
+}
+
+void inode_state::getLSR(string_view path, ls_sink& sink, size_t jobs){
+	view_id view;
+	this->getTargetNode(path, view)->getLSR_inode(path, sink, jobs, view);
+}
+
+const string& inode_state::prompt() { return prompt_; }
+
+void inode_state::setPrompt(string newPrompt)
+{
+	prompt_ = newPrompt;
+
+}
+
+void inode_state::mkdir(string_view path)
+{
+	string_view folderName;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getWritableParent(path, folderName, held);
+
+	targetFolder->mkDir(folderName, *tree, tree->epoch);
+	dcache.invalidate();
+	logChange(JOURNAL_MKDIR, path, {}, targetFolder);
+}
+
+void inode_state::make(string_view path, string_view newdata)
+{
+	string_view fileName;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getWritableParent(path, fileName, held);
+
+	targetFolder->mkFile(fileName, newdata, *tree, tree->epoch);
+	logChange(JOURNAL_MAKE, path, newdata, targetFolder);
+}
+
+void inode_state::append(string_view path, string_view moredata)
+{
+	string_view fileName;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getWritableParent(path, fileName, held);
+
+	targetFolder->appendFile(fileName, moredata, *tree, tree->epoch);
+	logChange(JOURNAL_APPEND, path, moredata, targetFolder);
+}
+
+// A file in the live tree is read without any lock; anything else,
+// errors included, is left to the locked walk.
+void inode_state::cat(string_view path)
+{
+	{
+		rcu::reader reading;
+		size_t found = path.find_last_of('/');
+		string_view dirPath = found == string_view::npos ? string_view()
+		                      : path.substr(0, max<size_t>(found, 1));
+		inode_ptr anchor;
+		inode* folder = walkLive(dirPath, anchor);
+		directory* dir = folder == nullptr ? nullptr
+		                                   : dynamic_cast<directory*>(folder->contents);
+		inode* node = dir == nullptr ? nullptr
+		              : dir->index.find(path.substr(found + 1));
+		plain_file* file = node == nullptr ? nullptr
+		                   : dynamic_cast<plain_file*>(node->contents);
+		if (file != nullptr)
+		{
+			file->readLive().for_each_chunk([this](string_view chunk)
+			{
+				out->write(chunk.data(), chunk.size());
+			});
+			*out << '\n';
+			return;
+		}
+	}
+
+	string_view fileName;
+	view_id view;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getParentNode(path, fileName, view, held);
+
+	targetFolder->catenate(fileName, view, *out);
+}
+
+void inode_state::rm(string_view path)
+{
+	string_view fileName;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getWritableParent(path, fileName, held);
+
+	inode_ptr removed = targetFolder->remove(fileName, tree->epoch);
+	invalidatePWD(removed);
+	dcache.invalidate();
+	logChange(JOURNAL_RM, path, {}, targetFolder, removed);
+
+	// a walk without locks may still be on its way through it
+	held.release();
+	rcu::synchronize();
+}
+
+void inode_state::rmr(string_view path)
+{
+	string_view fileName;
+	inode_ptr targetFolder;
+	dir_lock held;
+	targetFolder = getWritableParent(path, fileName, held);
+
+	inode_ptr removed = targetFolder->rmr_inode(fileName, tree->epoch);
+	bool holdsCwd = isWithin(cwd, removed);
+	if (holdsCwd)
+	{
+		cwd_path_valid = false;
+	}
+	dcache.invalidate();
+	logChange(JOURNAL_RMR, path, {}, targetFolder, removed);
+	held.release();
+	rcu::synchronize();
+
+	// The reclaimer may only have the subtree if nothing here can still
+	// reach into it: the dentry cache generation has moved on, and cwd
+	// is elsewhere.  Otherwise it is freed right here, when removed
+	// goes out of scope.  If a snapshot still sees it, the graveyard
+	// keeps it and either way only drops a reference.
+	if (tree->background_reclaim and not holdsCwd)
+	{
+		tree->reclaim.defer(move(removed));
+	}
+}
+
+void inode_state::cd(string_view path)
+{
+	view_id view;
+	cwd = getTargetNode(path, view);
+	cwd_view = view;
+	cwd_path_valid = false;
+}
+
+// A node that is only kept alive, by a snapshot or by another
+// session's cwd, has no path to show, so it is not found either.
+inode_ptr inode_state::getNodeByNumber(uint64_t nr)
+{
+	followTree();
+	inode_ptr node = tree->inodes.find(nr);
+	if (node == nullptr or not isLinked(node))
+	{
+		throw file_error ("inode "+to_string(nr)+": no such inode");
+	}
+	return node;
+}
+
+void inode_state::cdInode(uint64_t nr)
+{
+	inode_ptr node = getNodeByNumber(nr);
+	if (node->getContentType() != file_type::DIRECTORY_TYPE)
+	{
+		throw file_error ("inode "+to_string(nr)+": is a plain file");
+	}
+	cwd = move(node);
+	cwd_view = LIVE_VIEW;
+	cwd_path_valid = false;
+}
+
+void inode_state::printStat(const inode_ptr& node, view_id view)
+{
+	bool isDir = node->getContentType() == file_type::DIRECTORY_TYPE;
+	output() << pathOf(node, view) << ": inode " << node->get_inode_nr()
+	         << ", " << (isDir ? "directory" : "plain file")
+	         << ", size " << node->getContentSize(view) << endl;
+}
+
+void inode_state::stat(string_view path)
+{
+	view_id view;
+	inode_ptr node = getTargetNode(path, view);
+	printStat(node, view);
+}
+
+void inode_state::statInode(uint64_t nr)
+{
+	printStat(getNodeByNumber(nr), LIVE_VIEW);
+}
+
+void inode_state::df()
+{
+	followTree();
+	// what replaced bodies are retired still holds them
+	rcu::barrier();
+	content_store::usage used = tree->bodies.measure();
+	output() << "bodies: " << used.bodies << " distinct, "
+	         << used.bytes << " bytes" << endl
+	         << "references: " << used.references << ", "
+	         << used.bytes + used.saved << " bytes" << endl
+	         << "saved: " << used.saved << " bytes" << endl;
+}
+
+// Taking a snapshot only names the current epoch and moves on to the
+// next; the tree is left as it is.
+void inode_state::snapshot(string_view name)
+{
+	if (name.empty() or name == "." or name == ".."
+	    or name.find('/') != string_view::npos)
+	{
+		throw file_error (string(name)+": invalid snapshot name");
+	}
+
+	if (not tree->snapshots.emplace(name, tree->epoch).second)
+	{
+		throw file_error ("snapshot "+string(name)+" already exists");
+	}
+
+	tree->snapshot_names.emplace_back(name);
+	DEBUGF ('i', "snapshot " << name << " = epoch " << tree->epoch);
+	++tree->epoch;
+	logChange(JOURNAL_SNAPSHOT, name, {}, tree->root);
+}
+
+// The walk is a postorder one over an explicit stack, so that each
+// directory is written once the offsets of all its entries are known.
+// A mounted image, at the root or below it, is found by a first walk
+// over the directories alone, before any file is opened, so that a
+// save refused leaves the image it would have replaced untouched.
+void inode_state::save(const string& filename)
+{
+	struct frame {
+		inode_ptr dir;
+		size_t next;
+		vector<uint64_t> offsets;
+	};
+
+	vector<inode_ptr> unchecked {tree->root};
+	while (not unchecked.empty())
+	{
+		inode_ptr node = move(unchecked.back());
+		unchecked.pop_back();
+		directory* dir = dynamic_cast<directory*>(node->contents);
+		if (dir == nullptr)
+		{
+			throw file_error (filename+": cannot save a mounted image");
+		}
+		dir->dirents.for_each_sorted([&](string_view, const inode_ptr& child)
+		{
+			if (child->getContentType() == file_type::DIRECTORY_TYPE)
+			{
+				unchecked.push_back(child);
+			}
+		});
+	}
+
+	image_writer out(filename);
+	uint64_t nodes = 0;
 
-	do{
-		if (parentNode != currentNode)
+	auto writeFile = [&](const inode_ptr& node)
+	{
+		uint64_t offset = out.offset();
+		rope_view data = node->contents->readfile(LIVE_VIEW);
+		out.put(image_node {IMAGE_FILE, 0, node->inode_nr, data.size()});
+		data.for_each_chunk([&](string_view chunk)
+		{
+			out.put(chunk.data(), chunk.size());
+		});
+		out.align();
+		++nodes;
+		return offset;
+	};
+
+	auto writeDir = [&](const frame& done)
+	{
+		const directory& dir = static_cast<directory&>(*done.dir->contents);
+		uint64_t offset = out.offset();
+		out.put(image_node {IMAGE_DIR, 0, done.dir->inode_nr, done.offsets.size()});
+		uint32_t name = 0;
+		for (size_t i = 0; i < done.offsets.size(); ++i)
+		{
+			uint32_t length = dir.dirents.sorted_at(i).first.size();
+			out.put(image_dirent {done.offsets[i], name, length});
+			name += length;
+		}
+		for (size_t i = 0; i < done.offsets.size(); ++i)
 		{
-			pathName.insert(0, parentNode->contents->getNameOfNode(cwd));
-			currentNode = parentNode;
-			cwd = currentNode;
-			parentNode = currentNode->contents->getNodeByName("..");
+			const name_ref& entryName = dir.dirents.sorted_at(i).first;
+			out.put(entryName.data(), entryName.size());
 		}
+		out.align();
+		++nodes;
+		return offset;
+	};
 
-		pathName.insert(0, "/");
+	uint64_t rootOffset = 0;
+	vector<frame> stack;
+	stack.push_back({tree->root, 0, {}});
 
-	} while (parentNode != currentNode);
+	while (not stack.empty())
+	{
+		frame& top = stack.back();
+		directory& dir = static_cast<directory&>(*top.dir->contents);
 
-	cwd = thisNode;
+		if (top.next == dir.dirents.size())
+		{
+			uint64_t offset = writeDir(top);
+			stack.pop_back();
+			if (stack.empty())
+			{
+				rootOffset = offset;
+			}
+			else
+			{
+				stack.back().offsets.push_back(offset);
+			}
+			continue;
+		}
 
-	return pathName;
-}
+		const inode_ptr& node = dir.dirents.sorted_at(top.next++).second;
+		if (node->getContentType() == file_type::DIRECTORY_TYPE)
+		{
+			stack.push_back({node, 0, {}});
+		}
+		else
+		{
+			top.offsets.push_back(writeFile(node));
+		}
+	}
 
-// With given path, it will find the corresponding NODE containing FOLDER type contents ONLY
-// if client want to find a file inside a folder, this is how to use this function to get the parent folder of the file:
-// "/fd1/fd2/fl1" --> input to getTargetNode should be: "/fd/f2"
-// if path starts with "/", it will start searching from root.
-// otherwise, it will start the search from cwd.
-// empty path will return cwd immediately.
-inode_ptr inode_state::getTargetNode(const string& path) {
+	image_trailer trailer {IMAGE_END, 0, tree->inodes.limit(), nodes, rootOffset, {}};
+	memcpy(trailer.magic, IMAGE_MAGIC, sizeof trailer.magic);
+	out.put(trailer);
+	out.close();
 
-	DEBUGF ('i', "path = " << path);
-	DEBUGF ('i', "path size = " << path.length());
+	if (tree->log != nullptr)
+	{
+		tree->log->checkpoint(BASE_LOAD, filename);
+	}
+}
 
-	inode_ptr targetNode = cwd;
+// Nodes are rebuilt in the order they were written.  Each finished
+// subtree waits on a stack until the record of its directory, which
+// takes as many of them as it has entries.  They take back their saved
+// numbers only once the image has proved sound and replaced the tree,
+// since the numbers may still be held by the nodes of the old one.
+void inode_state::load(const string& filename)
+{
+	image_reader in(filename);
+	vector<pair<uint64_t, inode_ptr>> numbered;
+	vector<inode_ptr> built;
+	uint64_t nodes = 0;
+	image_node record;
 
-	// see if any path is specified
-	// if no path is specified, we should return cwd
-	if (path.length() > 0)
+	for (;;)
 	{
-		// if this is true, we have to search from root node
-		if (path[0] == '/')
+		record = in.get<image_node>();
+		if (record.kind == IMAGE_END)
 		{
-			targetNode = root;
+			break;
 		}
 
-		// tokenize path by delimiter '/'
-		wordvec pathTokens = split(path, "/");
-
-		for (unsigned int i = 0; i < pathTokens.size(); ++i)
+		if (record.kind != IMAGE_FILE and record.kind != IMAGE_DIR)
 		{
-			DEBUGF ('i', "path token = " << pathTokens[i]);
+			in.corrupt("bad record at offset " + to_string(in.offset()));
+		}
 
-			string fdName = pathTokens[i];
+		file_type type = record.kind == IMAGE_DIR ? file_type::DIRECTORY_TYPE
+		                                          : file_type::PLAIN_TYPE;
+		inode_ptr node = inode::make(type, *tree, tree->epoch);
+		numbered.emplace_back(record.inode_nr, node);
+		++nodes;
 
-			inode_ptr nextNode = targetNode->contents->getNodeByName(fdName);
+		if (type == file_type::PLAIN_TYPE)
+		{
+			node->contents->writefile(in.get(record.size), tree->epoch);
+		}
+		else
+		{
+			if (record.size > built.size())
+			{
+				in.corrupt("directory has more entries than precede it");
+			}
 
-			if (nextNode != nullptr)
+			node->contents->setSelfNode(node);
+			vector<image_dirent> entries(record.size);
+			uint64_t namesSize = 0;
+			for (auto& entry : entries)
 			{
-				targetNode = nextNode;
+				entry = in.get<image_dirent>();
+				namesSize += entry.name_length;
 			}
-			else
+
+			string_view names = in.get(namesSize);
+			directory& dir = static_cast<directory&>(*node->contents);
+			size_t first = built.size() - entries.size();
+			for (size_t i = 0; i < entries.size(); ++i)
 			{
-				throw file_error (path+" does not exist!");
+				if (uint64_t(entries[i].name) + entries[i].name_length > names.size())
+				{
+					in.corrupt("entry name out of range");
+				}
+				dir.link(names.substr(entries[i].name, entries[i].name_length),
+				         move(built[first + i]));
 			}
+			built.resize(first);
 		}
-	}
-
-	return targetNode;
-}
 
-vector<string> inode_state::getLS(const string& path) {
-	vector<string> result;
-	this->getTargetNode(path)->getLS(path, result);
-	return result;
-}
+		in.align();
+		built.push_back(move(node));
+	}
 
-vector<string> inode_state::getLSR(const string& path){
-	vector<string> result;
-	this->getTargetNode(path)->getLSR_inode(path, result);
-	return result;
-}
+	in.get<uint64_t>();
+	string_view magic = in.get(sizeof IMAGE_MAGIC);
+	if (magic != string_view(IMAGE_MAGIC, sizeof IMAGE_MAGIC) or nodes != record.size
+	    or built.size() != 1 or built[0]->getContentType() != file_type::DIRECTORY_TYPE)
+	{
+		in.corrupt("bad trailer");
+	}
 
-const string& inode_state::prompt() { return prompt_; }
+	// The table is sized to the saved limit before anything is
+	// claimed, so a limit far beyond the nodes there are is refused
+	// rather than allocated.  A tree that shrank keeps its highest
+	// numbers, so some room is allowed beyond a few slots per node.
+	constexpr uint64_t SLOTS_PER_NODE {8};
+	constexpr uint64_t SPARE_SLOTS {1 << 20};
+	uint64_t limit = record.inode_nr;
+	if (limit > nodes * SLOTS_PER_NODE + SPARE_SLOTS)
+	{
+		in.corrupt("inode limit " + to_string(limit) + " out of range for "
+		           + to_string(nodes) + " nodes");
+	}
+	sort(numbered.begin(), numbered.end());
+	for (size_t i = 0; i < numbered.size(); ++i)
+	{
+		uint64_t nr = numbered[i].first;
+		if (nr == 0 or nr >= limit or (i > 0 and nr == numbered[i - 1].first))
+		{
+			in.corrupt("bad inode number " + to_string(nr));
+		}
+	}
+	try
+	{
+		tree->inodes.reserve(limit);
+	}
+	catch (bad_alloc&)
+	{
+		in.corrupt("inode numbers out of range");
+	}
+	catch (length_error&)
+	{
+		in.corrupt("inode numbers out of range");
+	}
 
-void inode_state::setPrompt(string newPrompt)
-{
-	prompt_ = newPrompt;
+	replaceTree(move(built[0]));
+	for (auto& [nr, node] : numbered)
+	{
+		tree->inodes.claim(node, nr);
+	}
+	DEBUGF ('m', filename << ": " << nodes << " nodes");
 
+	if (tree->log != nullptr)
+	{
+		tree->log->checkpoint(BASE_LOAD, filename);
+	}
 }
 
-void inode_state::mkdir(const string& path)
+void inode_state::mount(const string& filename, string_view path)
 {
-	size_t found = path.find("/");
-	inode_ptr targetFolder;
-	string folderName = "";
-	if (found == string::npos)
+	auto image = make_shared<const mapped_image>(filename);
+	inode_ptr top = mapped_directory::make(image, image->root(), nullptr);
+	if (top->getContentType() != file_type::DIRECTORY_TYPE)
 	{
-		targetFolder = cwd;
-		folderName = path;
+		image->corrupt("root is not a directory");
 	}
-	else
+
+	if (path == "/")
 	{
-		size_t found2 = path.find_last_of("/");
-		string path_dirOnly = path.substr(0, found2);
-		folderName = path.substr(found2 + 1);
-		targetFolder = getTargetNode(path_dirOnly);
+		replaceTree(move(top));
+		if (tree->log != nullptr)
+		{
+			tree->log->checkpoint(BASE_MOUNT, filename);
+		}
+		return;
 	}
 
-	targetFolder->mkDir(folderName);
-}
-
-void inode_state::make(const string& path, const wordvec& newdata)
-{
-	size_t found = path.find("/");
+	string_view name;
 	inode_ptr targetFolder;
-	string fileName = "";
-	if (found == string::npos)
+	dir_lock held;
+	targetFolder = getWritableParent(path, name, held);
+	directory* dir = dynamic_cast<directory*>(targetFolder->contents);
+	if (dir == nullptr)
 	{
-		targetFolder = cwd;
-		fileName = path;
+		throw file_error (targetFolder->getContentType() == file_type::PLAIN_TYPE
+		                  ? "is a plain file" : "read-only image");
 	}
-	else
+	top->birth = tree->epoch;
+	dir->link(name, move(top));
+	dcache.invalidate();
+	if (tree->log != nullptr)
 	{
-		size_t found2 = path.find_last_of("/");
-		string path_dirOnly = path.substr(0, found2);
-		fileName = path.substr(found2 + 1);
-		targetFolder = getTargetNode(path_dirOnly);
+		logChange(JOURNAL_MOUNT, path, filesystem::absolute(filename).string(),
+		          targetFolder);
 	}
-
-	targetFolder->mkFile(fileName, newdata);
 }
 
-void inode_state::cat(const string& path)
+// Recovery goes through the same calls as the commands did, with
+// the journal not yet attached, so nothing is recorded twice.
+bool inode_state::openJournal(const string& filename, group_commit policy)
 {
-	size_t found = path.find("/");
-	inode_ptr targetFolder;
-	string fileName = "";
-	if (found == string::npos)
-	{
-		targetFolder = cwd;
-		fileName = path;
-	}
-	else
+	journal_reader in(filename);
+	if (in.exists())
 	{
-		size_t found2 = path.find_last_of("/");
-		string path_dirOnly = path.substr(0, found2);
-		fileName = path.substr(found2 + 1);
-		targetFolder = getTargetNode(path_dirOnly);
+		// records replayed over any image but the one they followed,
+		// such as one saved over it since, would be applied twice
+		if (in.base() != BASE_EMPTY
+		    and not (identify_image(in.image()) == in.identity()))
+		{
+			throw file_error (filename + ": " + in.image()
+			                  + " is not the image this journal follows");
+		}
+		if (in.base() == BASE_LOAD)
+		{
+			load(in.image());
+		}
+		else if (in.base() == BASE_MOUNT)
+		{
+			mount(in.image(), "/");
+		}
+
+		journal_entry entry;
+		size_t count = 0;
+		while (in.next(entry))
+		{
+			++count;
+			try
+			{
+				replay(entry);
+			}
+			catch (file_error& error)
+			{
+				complain() << filename << ": record " << count << ": "
+				           << error.what() << endl;
+			}
+		}
+
+		if (in.torn_bytes() > 0)
+		{
+			complain() << filename << ": dropped " << in.torn_bytes()
+			           << " bytes of a torn record" << endl;
+		}
+		DEBUGF ('J', filename << ": replayed " << count << " records");
 	}
 
-	targetFolder->catenate(fileName);
+	tree->log = make_unique<journal>(filename, policy, in.valid_length());
+	return in.exists();
 }
 
-void inode_state::rm(const string& path)
+void inode_state::replay(const journal_entry& entry)
 {
-	size_t found = path.find("/");
-	inode_ptr targetFolder;
-	string fileName = "";
-	if (found == string::npos)
-	{
-		targetFolder = cwd;
-		fileName = path;
-	}
-	else
+	switch (entry.op)
 	{
-		size_t found2 = path.find_last_of("/");
-		string path_dirOnly = path.substr(0, found2);
-		fileName = path.substr(found2 + 1);
-		targetFolder = getTargetNode(path_dirOnly);
+		case JOURNAL_MKDIR:
+			mkdir(entry.path);
+			break;
+		case JOURNAL_MAKE:
+			make(entry.path, entry.data);
+			break;
+		case JOURNAL_APPEND:
+			append(entry.path, entry.data);
+			break;
+		case JOURNAL_RM:
+			rm(entry.path);
+			break;
+		case JOURNAL_RMR:
+			rmr(entry.path);
+			break;
+		case JOURNAL_SNAPSHOT:
+			snapshot(entry.path);
+			break;
+		case JOURNAL_MOUNT:
+			mount(string(entry.data), entry.path);
+			break;
 	}
-
-	targetFolder->remove(fileName);
 }
 
-void inode_state::rmr(const string& path)
+void inode_state::logChange(journal_op op, string_view path, string_view data,
+                            const inode_ptr& where, const inode_ptr& removed)
 {
-	size_t found = path.find("/");
-	inode_ptr targetFolder;
-	string fileName = "";
-	if (found == string::npos)
+	if (tree->log == nullptr)
 	{
-		targetFolder = cwd;
-		fileName = path;
+		if (removed != nullptr)
+		{
+			removed->unlinked = true;
+		}
+		return;
 	}
-	else
+
+	// only the order of the records needs log_order; the batch they
+	// complete is written and synced after it is let go, so that
+	// changes made meanwhile go to disk with the same sync
+	bool due = false;
 	{
-		size_t found2 = path.find_last_of("/");
-		string path_dirOnly = path.substr(0, found2);
-		fileName = path.substr(found2 + 1);
-		targetFolder = getTargetNode(path_dirOnly);
-	}
+		lock_guard<mutex> guard(tree->log_order);
+		if (removed != nullptr)
+		{
+			removed->unlinked = true;
+		}
+
+		if (op != JOURNAL_SNAPSHOT and not isLinked(where))
+		{
+			return;
+		}
 
-	targetFolder->rmr_inode(fileName);
+		string absolute;
+		if (op != JOURNAL_SNAPSHOT and (path.empty() or path[0] != '/'))
+		{
+			absolute = getPWD();
+			if (absolute != "/")
+			{
+				absolute += '/';
+			}
+			absolute += path;
+			path = absolute;
+		}
+		due = tree->log->append(op, path, data);
+	}
+	if (due)
+	{
+		tree->log->flush();
+	}
 }
 
-void inode_state::cd(const string& path)
+// Makes newRoot the whole tree, with cwd at its root.  Snapshots of
+// the old tree go with it.
+void inode_state::replaceTree(inode_ptr newRoot)
 {
-	cwd = getTargetNode(path);
+	inode_ptr old = move(tree->root);
+	old->unlinked = true;
+	tree->root = move(newRoot);
+	tree->root->parent = tree->root;
+	++tree->replaced;
+	followTree();
+	tree->snapshots.clear();
+	tree->snapshot_names.clear();
+	dcache.invalidate();
+	rcu::synchronize();
+
+	if (tree->background_reclaim)
+	{
+		tree->reclaim.defer(move(old));
+	}
 }
 
 /*======================================================================================================================
@@ -248,8 +1360,10 @@ void inode_state::cd(const string& path)
  =====================================================================================================================*/
 
 ostream& operator<< (ostream& out, const inode_state& state) {
-   out << "inode_state: root = " << state.root
-       << ", cwd = " << state.cwd;
+   out << "inode_state: root = " << state.tree->root
+       << ", cwd = " << state.cwd
+       << ", dcache hits = " << state.dcache.hits()
+       << ", misses = " << state.dcache.misses();
    return out;
 }
 
@@ -258,31 +1372,69 @@ ostream& operator<< (ostream& out, const inode_state& state) {
  =====================================================================================================================*/
 
 
-inode::inode(file_type type): inode_nr (next_inode_nr++) {
+inode::inode(file_type type, base_file* contents_, view_id birth_,
+             uint64_t inode_nr_):
+             inode_nr (inode_nr_), birth (birth_), contents (contents_) {
+	contentType = type;
+}
+
+inode::~inode() {
+   if (table != nullptr) table->release(this);
+}
+
+// inode_block -
+//    An inode and its contents in one allocation.  The contents come
+//    first so that they are constructed before the inode points at
+//    them; the inode_ptr handed out aliases the node member, sharing
+//    the block's control block.
+template <typename contents_t>
+struct inode_block {
+	contents_t body;
+	inode node;
+	template <typename... args_t>
+	inode_block(file_type type, view_id birth, args_t&&... args):
+	            body(forward<args_t>(args)...), node(type, &body, birth, 0) {}
+};
+
+template <typename contents_t, typename allocator_t, typename... args_t>
+static inode_ptr make_inode_block(const allocator_t& allocator, file_type type,
+                                  view_id birth, args_t&&... args) {
+	auto block = allocate_shared<inode_block<contents_t>>(
+	             allocator, type, birth, forward<args_t>(args)...);
+	return inode_ptr(block, &block->node);
+}
+
+inode_ptr inode::make(file_type type, tree_state& tree, view_id epoch) {
+   arena_allocator<char> allocator(tree.arena);
+   inode_ptr node;
    switch (type) {
       case file_type::PLAIN_TYPE:
-           contents = make_shared<plain_file>();
+           node = make_inode_block<plain_file>(allocator, type, epoch,
+                                               epoch, tree.bodies);
            break;
       case file_type::DIRECTORY_TYPE:
-           contents = make_shared<directory>();
+           node = make_inode_block<directory>(allocator, type, epoch);
            break;
+      default:
+           throw file_error ("invalid file type");
    }
-	contentType = type;
-   DEBUGF ('i', "inode " << inode_nr << ", type = " << type);
+   tree.inodes.enter(node);
+   DEBUGF ('i', "inode " << node->inode_nr << ", type = " << type);
+   return node;
 }
 
-int inode::get_inode_nr() const {
+uint64_t inode::get_inode_nr() const {
    DEBUGF ('i', "inode = " << inode_nr);
    return inode_nr;
 }
 
-size_t inode::getContentSize() {
-	return contents->size();
+size_t inode::getContentSize(view_id view) {
+	dir_lock guard(*this, false);
+	return contents->size(view);
 }
 
-void inode::getLS(string path, vector<string>& result) {
+void inode::getLS(string_view path, ls_sink& sink, view_id view) {
 
-	vector<string> lsInfo;
 	string currentFolder = "";
 
 	if(path.empty())
@@ -294,12 +1446,11 @@ void inode::getLS(string path, vector<string>& result) {
 		currentFolder = path;
 	}
 
-	contents->getLS(currentFolder, result);
+	contents->getLS(currentFolder, sink, view);
 }
 
-void inode::getLSR_inode(string path, vector<string>& result)
+void inode::getLSR_inode(string_view path, ls_sink& sink, size_t jobs, view_id view)
 {
-	vector<string> lsInfo;
 	string currentFolder = "";
 
 	if(path.empty())
@@ -311,46 +1462,46 @@ void inode::getLSR_inode(string path, vector<string>& result)
 		currentFolder = path;
 	}
 
-	contents->getLSR_dir(currentFolder, result);
+	contents->getLSR_dir(currentFolder, sink, jobs, view);
 }
 
-void inode::mkDir(const string& folderName) {
+void inode::mkDir(string_view folderName, tree_state& tree, view_id epoch) {
 
-	inode_ptr newNode = this->contents->mkdir(folderName);
-
-	if(newNode != nullptr)
-	{
-		newNode->contents->setParentNode(this->contents->getNodeByName("."));
-		newNode->contents->setSelfNode(newNode);
-	}
+	this->contents->mkdir(folderName, tree, epoch);
 }
 
-void inode::mkFile(const string& fileName, const wordvec& newdata)
+void inode::mkFile(string_view fileName, string_view newdata, tree_state& tree, view_id epoch)
 {
-	inode_ptr newFile = this->contents->mkfile(fileName);
-	newFile->contents->writefile(newdata);
+	inode_ptr newFile = this->contents->mkfile(fileName, tree, epoch);
+	newFile->contents->writefile(newdata, epoch);
 }
 
+// appendFile -
+//    Like mkFile, creates the file if it does not exist.
+void inode::appendFile(string_view fileName, string_view moredata, tree_state& tree, view_id epoch)
+{
+	inode_ptr targetFile = this->contents->mkfile(fileName, tree, epoch);
+	targetFile->contents->appendfile(moredata, epoch);
+}
 
-void inode::catenate(const string& fileName)
+void inode::catenate(string_view fileName, view_id view, ostream& out)
 {
-	inode_ptr targetFile = this->contents->fn_catenate(fileName);
-	wordvec data = targetFile->contents->readfile();
-	for (auto it = data.begin(); it != data.end(); ++it)
+	inode_ptr targetFile = this->contents->fn_catenate(fileName, view);
+	targetFile->contents->readfile(view).for_each_chunk([&out](string_view chunk)
 	{
-		cout << *it;
-	}
-	cout << '\n';
+		out.write(chunk.data(), chunk.size());
+	});
+	out << '\n';
 }
 
-void inode::remove(const string& fileName)
+inode_ptr inode::remove(string_view fileName, view_id epoch)
 {
-	this->contents->remove(fileName);
+	return this->contents->remove(fileName, epoch);
 }
 
-void inode::rmr_inode(const string &fileName)
+inode_ptr inode::rmr_inode(string_view fileName, view_id epoch)
 {
-	this->contents->rmr_dir(fileName);
+	return this->contents->rmr_dir(fileName, epoch);
 }
 
 /*======================================================================================================================
@@ -362,9 +1513,22 @@ file_error::file_error (const string& what):
             runtime_error (what) {
 }
 
-size_t plain_file::size() const {
+plain_file::plain_file (view_id epoch, content_store& store_):
+                        store (store_), written (epoch) {
+}
+
+rope_view plain_file::readLive() const {
+	const rope* body = published.load(memory_order_acquire);
+	if (body == nullptr)
+	{
+		return rope_view(string_view());
+	}
+	return rope_view(*body, body->size());
+}
+
+size_t plain_file::size(view_id view) const {
    size_t size {0};
-	size = data.size();
+	size = readfile(view).size();
    DEBUGF ('i', "size = " << size);
    return size;
 }
@@ -374,21 +1538,102 @@ size_t plain_file::size() const {
  =====================================================================================================================*/
 
 
-const wordvec& plain_file::readfile() const {
-   DEBUGF ('i', data);
-   return data;
+// The contents a view sees are in the oldest history entry still
+// current after it, or failing that, in data.
+rope_view plain_file::readfile(view_id view) const {
+	auto past = upper_bound(history.begin(), history.end(), view,
+	                        [](view_id v, const past_body& b) { return v < b.until; });
+	if (past == history.end())
+	{
+		DEBUGF ('i', liveSize() << " bytes");
+		return data == nullptr ? rope_view(string_view())
+		                       : rope_view(*data, data->size());
+	}
+
+	size_t length = past->length;
+	for (; past != history.end(); ++past)
+	{
+		if (past->body != nullptr)
+		{
+			return rope_view(*past->body, length);
+		}
+	}
+	return data == nullptr ? rope_view(string_view())
+	                       : rope_view(*data, length);
+}
+
+// Before a change in a later epoch than the last one, the contents
+// as they stand are recorded for the snapshots taken in between.  A
+// replacement then hands data itself to the newest entry, if that
+// entry still refers to it.
+void plain_file::preserve(view_id epoch, bool replacing) {
+	if (written < epoch)
+	{
+		history.push_back({epoch, nullptr, liveSize()});
+		written = epoch;
+	}
+
+	if (replacing and not history.empty() and history.back().body == nullptr)
+	{
+		history.back().body = data;
+	}
+}
+
+// The new contents go into another rope, since readLive may be
+// reading the old one; that is only dropped once no reader can be.
+void plain_file::writefile (string_view newdata, view_id epoch) {
+   DEBUGF ('i', newdata);
+	preserve(epoch, true);
+	shared_ptr<rope> old = move(data);
+	if (not newdata.empty())
+	{
+		data = store.intern(newdata);
+	}
+	if (data == old)
+	{
+		return;
+	}
+
+	published.store(data.get(), memory_order_release);
+	if (old != nullptr)
+	{
+		rcu::retire([old] {});
+	}
 }
 
-void plain_file::writefile (const wordvec& words) {
-   DEBUGF ('i', words);
-	this->data = words;
+// A rope shared with other files is copied, and the copy published
+// once it holds the new bytes as well.
+void plain_file::appendfile (string_view moredata, view_id epoch) {
+   DEBUGF ('i', moredata);
+	preserve(epoch, false);
+	if (data != nullptr and store.own(data))
+	{
+		data->append(moredata);
+		return;
+	}
+
+	shared_ptr<rope> old = move(data);
+	data = store.make();
+	if (old != nullptr)
+	{
+		old->for_each_chunk([this](string_view chunk)
+		{
+			data->append(chunk);
+		});
+	}
+	data->append(moredata);
+	published.store(data.get(), memory_order_release);
+	if (old != nullptr)
+	{
+		rcu::retire([old] {});
+	}
 }
 
-void plain_file::remove (const string&) {
+inode_ptr plain_file::remove (string_view, view_id) {
    throw file_error ("is a plain file");
 }
 
-void plain_file::rmr_dir(const string&){
+inode_ptr plain_file::rmr_dir(string_view, view_id){
 	throw file_error ("is a plain file");
 }
 
@@ -397,27 +1642,24 @@ void plain_file::rmr_dir(const string&){
  =====================================================================================================================*/
 
 
-inode_ptr plain_file::mkdir (const string&) {
+inode_ptr plain_file::mkdir (string_view, tree_state&, view_id) {
    throw file_error ("is a plain file");
 }
 
-inode_ptr plain_file::mkfile (const string&) {
+inode_ptr plain_file::mkfile (string_view, tree_state&, view_id) {
    throw file_error ("is a plain file");
 }
 
-string plain_file::getNameOfNode(inode_ptr) {
-	throw file_error ("is a plain file");
-}
-inode_ptr plain_file::getNodeByName(const string&) {
+inode_ptr plain_file::getNodeByName(string_view, view_id) {
 	throw file_error ("is a plain file");
 }
 
-void plain_file::getLS(const string&, vector<string>&) {
+void plain_file::getLS(const string&, ls_sink&, view_id) {
 	// it is a no-op for plain file
 	throw file_error ("is a plain file");
 }
 
-void plain_file::getLSR_dir(const string&, vector<string>&){
+void plain_file::getLSR_dir(const string&, ls_sink&, size_t, view_id){
 	// it is a no-op for plain file
 	throw file_error ("is a plain file");
 }
@@ -425,11 +1667,7 @@ void plain_file::getLSR_dir(const string&, vector<string>&){
 void plain_file::setSelfNode(inode_ptr) {
 }
 
-void plain_file::setParentNode(inode_ptr) {
-
-}
-
-inode_ptr plain_file::fn_catenate(const string&) {
+inode_ptr plain_file::fn_catenate(string_view, view_id) {
 	throw file_error ("is a plain file");
 }
 
@@ -438,13 +1676,170 @@ inode_ptr plain_file::fn_catenate(const string&) {
  =====================================================================================================================*/
 
 
+// A tombstone only needs an address no node can have.
+inode* const lookup_index::TOMBSTONE = reinterpret_cast<inode*>(alignof(inode));
+
+lookup_index::table::table(size_t capacity):
+                    mask(capacity - 1), slots(new atomic<inode*>[capacity]) {
+	for (size_t i = 0; i < capacity; ++i)
+	{
+		slots[i].store(nullptr, memory_order_relaxed);
+	}
+}
+
+// Nothing can be probing the table by now: the directory is only
+// freed once no reader can reach it.
+lookup_index::~lookup_index() {
+	delete current.load(memory_order_relaxed);
+}
+
+inode* lookup_index::find(string_view name) const {
+	const table* probed = current.load(memory_order_acquire);
+	if (probed == nullptr)
+	{
+		return nullptr;
+	}
+
+	for (size_t i = hash<string_view>{}(name) & probed->mask;;
+	     i = (i + 1) & probed->mask)
+	{
+		inode* node = probed->slots[i].load(memory_order_acquire);
+		if (node == nullptr)
+		{
+			return nullptr;
+		}
+		if (node != TOMBSTONE and node->name == name)
+		{
+			return node;
+		}
+	}
+}
+
+// The new table is sized so that between a third and a half of it is
+// in use by the time it is replaced in turn.
+void lookup_index::rebuild() {
+	size_t capacity = 8;
+	while (capacity < 3 * (live + 1))
+	{
+		capacity *= 2;
+	}
+
+	table* old = current.load(memory_order_relaxed);
+	table* fresh = new table(capacity);
+	if (old != nullptr)
+	{
+		for (size_t i = 0; i <= old->mask; ++i)
+		{
+			inode* node = old->slots[i].load(memory_order_relaxed);
+			if (node == nullptr or node == TOMBSTONE)
+			{
+				continue;
+			}
+			size_t j = node->name.hash() & fresh->mask;
+			while (fresh->slots[j].load(memory_order_relaxed) != nullptr)
+			{
+				j = (j + 1) & fresh->mask;
+			}
+			fresh->slots[j].store(node, memory_order_relaxed);
+		}
+	}
+
+	current.store(fresh, memory_order_release);
+	used = live;
+	if (old != nullptr)
+	{
+		rcu::retire([old] { delete old; });
+	}
+}
+
+void lookup_index::insert(inode* node) {
+	table* slots = current.load(memory_order_relaxed);
+	if (slots == nullptr or 2 * (used + 1) > slots->mask + 1)
+	{
+		rebuild();
+		slots = current.load(memory_order_relaxed);
+	}
+
+	size_t i = node->name.hash() & slots->mask;
+	while (slots->slots[i].load(memory_order_relaxed) != nullptr)
+	{
+		i = (i + 1) & slots->mask;
+	}
+	slots->slots[i].store(node, memory_order_release);
+	++live;
+	++used;
+}
+
+void lookup_index::erase(const inode* node) {
+	table* slots = current.load(memory_order_relaxed);
+	if (slots == nullptr)
+	{
+		return;
+	}
+
+	for (size_t i = node->name.hash() & slots->mask;;
+	     i = (i + 1) & slots->mask)
+	{
+		inode* entry = slots->slots[i].load(memory_order_relaxed);
+		if (entry == nullptr)
+		{
+			return;
+		}
+		if (entry == node)
+		{
+			slots->slots[i].store(TOMBSTONE, memory_order_release);
+			--live;
+			return;
+		}
+	}
+}
+
 directory::directory() {
-   dirents.clear();
 }
 
-size_t directory::size() const {
+// Rather than letting each child's destructor free its own children in
+// turn, every uniquely held subdirectory is emptied into one work list
+// before it is released, so that no destructor below this one has
+// anything left to recurse into.
+directory::~directory() {
+	vector<inode_ptr> doomed;
+	releaseAll(doomed);
+
+	while (not doomed.empty())
+	{
+		inode_ptr node = move(doomed.back());
+		doomed.pop_back();
+
+		// a session may still be reading one it looked up just
+		// before the subtree was unlinked
+		directory* dir = dynamic_cast<directory*>(node->contents);
+		if (node.use_count() == 1 and dir != nullptr)
+		{
+			unique_lock<shared_mutex> guard(dir->lock);
+			dir->releaseAll(doomed);
+		}
+	}
+}
+
+void directory::releaseAll(vector<inode_ptr>& nodes) {
+	dirents.release(nodes);
+	for (auto& grave : graveyard)
+	{
+		nodes.push_back(move(grave.node));
+	}
+	graveyard.clear();
+}
+
+size_t directory::size(view_id view) const {
    size_t size {0};
-	size = dirents.size();
+	if (view == LIVE_VIEW)
+	{
+		size = dirents.size();
+	}
+	else
+	{
+		for_each_visible(view, [&](string_view, const inode_ptr&) { ++size; });
+	}
 	size += 2;
    DEBUGF ('i', "size = " << size);
    return size;
@@ -454,96 +1849,178 @@ void directory::setSelfNode(inode_ptr current) {
 
 	selfNode = current;
 }
-void directory::setParentNode(inode_ptr parent) {
 
-	parentNode = parent;
+rope_view directory::readfile(view_id) const {
+   throw file_error ("is a directory");
 }
 
-const wordvec& directory::readfile() const {
+void directory::writefile (string_view, view_id) {
    throw file_error ("is a directory");
 }
 
-void directory::writefile (const wordvec&) {
+void directory::appendfile (string_view, view_id) {
    throw file_error ("is a directory");
 }
 
-void directory::remove (const string& filename) {
-   DEBUGF ('i', filename);
+// An entry linked before the current epoch is in at least one
+// snapshot, so it goes to the graveyard rather than away.
+void directory::bury(inode_ptr node, view_id epoch) {
+	if (node->birth >= epoch)
+	{
+		return;
+	}
+
+	auto place = upper_bound(graveyard.begin(), graveyard.end(), node->name.view(),
+	                         [](string_view name, const buried& grave)
+	                         { return name < grave.node->name.view(); });
+	graveyard.insert(place, {move(node), epoch});
+}
+
+// The entry under name as the view sees it: the live one if it was
+// already linked then, or else the one in the graveyard whose life
+// spans the view.
+inode_ptr directory::find(string_view name, view_id view) {
+	inode_ptr* live = dirents.find(name);
+	if (view == LIVE_VIEW or (live != nullptr and (*live)->birth <= view))
+	{
+		return live != nullptr ? *live : nullptr;
+	}
+
+	auto grave = lower_bound(graveyard.begin(), graveyard.end(), name,
+	                         [](const buried& grave, string_view key)
+	                         { return grave.node->name.view() < key; });
+	for (; grave != graveyard.end() and grave->node->name == name; ++grave)
+	{
+		if (grave->node->birth <= view and view < grave->death)
+		{
+			return grave->node;
+		}
+	}
+	return nullptr;
+}
+
+// Calls fn (name, node) on every entry the view sees, in order.  A
+// snapshot merges the graveyard into the walk of the live entries;
+// the two never both hold a visible entry under one name.
+template <typename function>
+void directory::for_each_visible(view_id view, function fn) const {
+	if (view == LIVE_VIEW)
+	{
+		dirents.for_each_sorted(fn);
+		return;
+	}
 
-	bool is_file_already_present = false;
+	auto grave = graveyard.begin();
+	auto buryUpTo = [&](const string_view* name)
+	{
+		for (; grave != graveyard.end()
+		       and (name == nullptr or grave->node->name.view() < *name); ++grave)
+		{
+			if (grave->node->birth <= view and view < grave->death)
+			{
+				fn(grave->node->name, grave->node);
+			}
+		}
+	};
+
+	dirents.for_each_sorted([&](string_view name, const inode_ptr& node)
+	{
+		buryUpTo(&name);
+		if (node->birth <= view)
+		{
+			fn(name, node);
+		}
+	});
+	buryUpTo(nullptr);
+}
 
-	// check if name already exists
-	is_file_already_present = dirents.find(filename) != dirents.end() ? true : false;
+inode_ptr directory::remove (string_view filename, view_id epoch) {
+   DEBUGF ('i', filename);
 
-	if (is_file_already_present)
+	// the emptiness check runs on the entry found by the same lookup
+	// that erases it, and marks it unlinked while nothing can be
+	// added to it
+	inode_ptr existingFile = dirents.erase(filename, [&](const inode_ptr& node)
 	{
-		inode_ptr existingFile = dirents[filename];
-		if (existingFile->getContentType() == file_type::DIRECTORY_TYPE)
+		if (node->getContentType() == file_type::DIRECTORY_TYPE)
 		{
-			size_t size_existingItem = existingFile->getContentSize();
+			dir_lock guard(*node, true);
+			size_t size_existingItem = node->contents->size(LIVE_VIEW);
 			if (size_existingItem > 2)
 			{
-				throw file_error (filename+" is not an empty directory");
+				throw file_error (string(filename)+" is not an empty directory");
 			}
+			node->unlinked = true;
 		}
-		dirents.erase(filename);
+	});
 
-	}
-	else
+	if (existingFile == nullptr)
 	{
-		throw file_error (filename+" is not a valid file/directory");
+		throw file_error (string(filename)+" is not a valid file/directory");
 	}
+
+	index.erase(existingFile.get());
+	bury(existingFile, epoch);
+	return existingFile;
 }
 
-void directory::rmr_dir(const string &filename)
+inode_ptr directory::rmr_dir(string_view filename, view_id epoch)
 {
 	DEBUGF ('i', filename);
 
-	bool is_file_already_present = false;
-
-	// check if name already exists
-	is_file_already_present = dirents.find(filename) != dirents.end() ? true : false;
+	inode_ptr existingNode = dirents.erase(filename);
 
-	if (is_file_already_present)
+	if (existingNode == nullptr)
 	{
-		dirents.erase(filename);
-	}
-	else
-	{
-		throw file_error (filename+" is not a valid file/directory");
+		throw file_error (string(filename)+" is not a valid file/directory");
 	}
+
+	index.erase(existingNode.get());
+	bury(existingNode, epoch);
+	return existingNode;
 }
 
-inode_ptr directory::mkdir (const string& dirname) {
+inode_ptr directory::mkdir (string_view dirname, tree_state& tree, view_id epoch) {
    DEBUGF ('i', dirname);
 
-	bool is_dir_already_present = false;
-
-	// check if dirname already exists
-	is_dir_already_present = dirents.find(dirname) != dirents.end() ? true : false;
+	// emplace either finds dirname or reserves its entry, so the
+	// existence check and the insert share one lookup.
+	auto slot = dirents.emplace(dirname);
 
-	if (is_dir_already_present)
+	if (not slot.second)
 	{
-		throw file_error (dirname+" already exists");
+		throw file_error (string(dirname)+" already exists");
 	}
 
-	inode_ptr newNode = make_shared<inode>(file_type::DIRECTORY_TYPE);
-	dirents[dirname] = newNode;
+	// the slot reserved holds no node yet, so it must not outlive a
+	// failure to make one
+	inode_ptr newNode;
+	try
+	{
+		newNode = inode::make(file_type::DIRECTORY_TYPE, tree, epoch);
+		newNode->name = slot.first->first;
+		newNode->parent = selfNode;
+		newNode->contents->setSelfNode(newNode);
+		index.insert(newNode.get());
+	}
+	catch (...)
+	{
+		dirents.erase(dirname);
+		throw;
+	}
+	slot.first->second = newNode;
 
    return newNode;
 }
 
-inode_ptr directory::mkfile (const string& filename) {
+inode_ptr directory::mkfile (string_view filename, tree_state& tree, view_id epoch) {
    DEBUGF ('i', filename);
 
-	bool is_file_already_present = false;
-
-	// check if filename already exists
-	is_file_already_present = dirents.find(filename) != dirents.end() ? true : false;
+	auto slot = dirents.emplace(filename);
 
-	if (is_file_already_present)
+	if (not slot.second)
 	{
-		inode_ptr existingFile = dirents[filename];
+		inode_ptr existingFile = slot.first->second;
 		if (existingFile->getContentType() != file_type::PLAIN_TYPE)
 		{
 			throw file_error ("is a directory");
@@ -552,28 +2029,57 @@ inode_ptr directory::mkfile (const string& filename) {
 		return existingFile;
 	}
 
-	inode_ptr newFile = make_shared<inode>(file_type::PLAIN_TYPE);
-	dirents[filename] = newFile;
+	inode_ptr newFile;
+	try
+	{
+		newFile = inode::make(file_type::PLAIN_TYPE, tree, epoch);
+		newFile->name = slot.first->first;
+		newFile->parent = selfNode;
+		index.insert(newFile.get());
+	}
+	catch (...)
+	{
+		dirents.erase(filename);
+		throw;
+	}
+	slot.first->second = newFile;
 
    return newFile;
 }
 
-string directory::getNameOfNode(inode_ptr node) {
-	 for (map<string,inode_ptr>::iterator it=dirents.begin(); it!=dirents.end(); ++it)
-	 {
-		 if (it->second == node)
-		 {
-			 return it->first;
-		 }
-	 }
+void directory::link(string_view name, inode_ptr node) {
+	if (name.empty() or name == "." or name == ".."
+	    or name.find('/') != string_view::npos)
+	{
+		throw file_error (string(name)+": invalid name");
+	}
 
-	 return "";
+	auto slot = dirents.emplace(name);
+	if (not slot.second)
+	{
+		throw file_error (string(name)+" already exists");
+	}
+
+	node->name = slot.first->first;
+	node->parent = selfNode;
+	try
+	{
+		index.insert(node.get());
+	}
+	catch (...)
+	{
+		dirents.erase(name);
+		throw;
+	}
+	slot.first->second = move(node);
 }
 
-inode_ptr directory::getNodeByName(const string& nodeName) {
+inode_ptr directory::getNodeByName(string_view nodeName, view_id view) {
 	if (nodeName == "..")
 	{
-		return parentNode.lock();
+		inode_ptr me = selfNode.lock();
+		inode_ptr myParent = me->getParent();
+		return myParent != nullptr ? myParent : me;
 	}
 
 	if (nodeName == ".")
@@ -581,97 +2087,285 @@ inode_ptr directory::getNodeByName(const string& nodeName) {
 		return selfNode.lock();
 	}
 
-	return dirents.find(nodeName) != dirents.end() ? dirents[nodeName] : nullptr;
+	return find(nodeName, view);
+}
+
+void directory::constructLSInfo(string_view name, inode_ptr node, ls_sink& sink, view_id view) {
+	sink.entry(node->get_inode_nr(), node->getContentSize(view), name,
+	           shouldAppendSlash(name, node));
 }
 
-void directory::constructLSInfo(const string& name, const string& delimiter, inode_ptr node, string& result) {
-	result += delimiter;
-	result += std::to_string(node->get_inode_nr());
-	result += delimiter;
-	result += std::to_string(node->getContentSize());
-	result += delimiter;
-	result += name;
 
-	if(shouldAppendSlash(name, node))
-	{
-		result += "/";
-	}
+// Each directory is reported to the sink as its heading followed by
+// one entry per dirent, dot and dotdot first:
+//    /:
+//     1 2 .
+//     1 2 ..
+// The parent is counted before this directory is locked, so that no
+// lock is taken up the tree.
+void directory::getLS(const string& currentFolderName, ls_sink& sink, view_id view) {
+
+	inode_ptr me = selfNode.lock();
+	inode_ptr myParent = getNodeByName("..", view);
+	size_t parentSize = myParent == me ? 0 : myParent->getContentSize(view);
+
+	shared_lock<shared_mutex> guard(lock);
+	sink.begin(currentFolderName);
+	sink.entry(me->get_inode_nr(), size(view), ".", false);
+	sink.entry(myParent->get_inode_nr(), myParent == me ? size(view) : parentSize,
+	           "..", false);
 
-	result += "\t";
+	 for_each_visible(view, [&](string_view name, const inode_ptr& node)
+	 {
+		 constructLSInfo(name, node, sink, view);
+	 });
 }
 
+// Lists this directory and then, depth first and in lexicographic
+// order, every directory below it.  The walk keeps an explicit stack
+// of (directory, path, next entry) frames, so it needs memory only in
+// proportion to the depth of the tree and cannot overflow the call
+// stack on a deep one.  With more than one job the listing is built
+// by getLSR_parallel instead.  A snapshot has no ordered table to
+// resume in, so each of its frames holds the subdirectories it sees.
+void directory::getLSR_dir(const string &currentFolderName, ls_sink& sink, size_t jobs, view_id view){
 
-// for each directory, we will append a string with the following format (each field is separated by a space)
-// [folderName] [nodeNumber] [size] [elementName] [nodeNumber] [size] [elementName]
-// "     /            1         2          .            1         2         ..    "
-void directory::getLS(const string& currentFolderName, vector<string>& result) {
+	if (jobs > 1)
+	{
+		getLSR_parallel(currentFolderName, sink, jobs, view);
+		return;
+	}
 
-	 static const string SP = " ";
+	struct frame {
+		inode_ptr dir;
+		string path;
+		size_t next;
+		vector<inode_ptr> subdirs;
+	};
 
-	 string ls = "";
+	auto subdirsOf = [view](const inode_ptr& node)
+	{
+		vector<inode_ptr> subdirs;
+		if (view != LIVE_VIEW)
+		{
+			directory& dir = static_cast<directory&>(*node->contents);
+			shared_lock<shared_mutex> guard(dir.lock);
+			dir.for_each_visible(view, [&](string_view, const inode_ptr& child)
+			{
+				if (child->getContentType() == file_type::DIRECTORY_TYPE)
+				{
+					subdirs.push_back(child);
+				}
+			});
+		}
+		return subdirs;
+	};
 
-	ls += currentFolderName;
-	ls += "\t";
+	getLS(currentFolderName, sink, view);
 
+	vector<frame> stack;
 	inode_ptr me = selfNode.lock();
-	inode_ptr myParent = parentNode.lock();
-	constructLSInfo(".", SP, me, ls);
-	constructLSInfo("..", SP, myParent, ls);
+	stack.push_back({me, currentFolderName, 0, subdirsOf(me)});
 
-	 for (map<string,inode_ptr>::iterator it=dirents.begin(); it!=dirents.end(); ++it)
-	 {
-		 constructLSInfo(it->first, SP, it->second, ls);
-	 }
-	 result.push_back(ls);
-}
+	while (not stack.empty())
+	{
+		frame& top = stack.back();
+		inode_ptr nextDir;
 
-void directory::getLSR_dir(const string &currentFolderName, vector<string> &result){
+		if (view == LIVE_VIEW)
+		{
+			// held only to read the one entry: listing the next
+			// directory takes this one's lock again to count it.
+			// Entries removed meanwhile may end the walk early.
+			directory& dir = static_cast<directory&>(*top.dir->contents);
+			shared_lock<shared_mutex> guard(dir.lock);
 
-	static const string SP = " ";
+			if (top.next >= dir.dirents.size())
+			{
+				guard.unlock();
+				stack.pop_back();
+				continue;
+			}
 
-	string ls = "";
-	ls += currentFolderName;
-	ls += "\t";
+			const auto& entry = dir.dirents.sorted_at(top.next++);
+			if (entry.second->getContentType() != file_type::DIRECTORY_TYPE)
+			{
+				continue;
+			}
+			nextDir = entry.second;
+		}
+		else
+		{
+			if (top.next == top.subdirs.size())
+			{
+				stack.pop_back();
+				continue;
+			}
+			nextDir = move(top.subdirs[top.next++]);
+		}
 
-	inode_ptr me = selfNode.lock();
-	inode_ptr myParent = parentNode.lock();
+		string nextDirName = top.path;
+		if (top.path != "/")
+		{
+			nextDirName += "/";
+		}
+		nextDirName += nextDir->name.view();
+
+		// a mounted image lists its own subtree
+		if (dynamic_cast<directory*>(nextDir->contents) == nullptr)
+		{
+			nextDir->contents->getLSR_dir(nextDirName, sink, 1, view);
+			continue;
+		}
+
+		nextDir->contents->getLS(nextDirName, sink, view);
+		stack.push_back({nextDir, move(nextDirName), 0, subdirsOf(nextDir)});
+	}
+}
 
-	constructLSInfo(".", SP, me, ls);
-	constructLSInfo("..", SP, myParent, ls);
 
-	queue<inode_ptr> dirQueue;
-	queue<string> dirNameQueue;
-	for (map<string,inode_ptr>::iterator it=dirents.begin(); it!=dirents.end(); ++it)
+// Every directory becomes a task on a work-stealing pool that formats
+// the directory's lines into a block of text and then spawns tasks for
+// its subdirectories.  The calling thread walks the blocks in the same
+// depth-first order as the serial lsr, waiting for each one to be
+// ready, so the output is identical whatever the number of jobs.  A
+// block's text is released as soon as it is written, and its children
+// once their subtrees are done.  A task that throws hands what it threw
+// to its block, and the calling thread throws it again on reaching that
+// block, so lsr fails the same way with jobs as without.
+void directory::getLSR_parallel(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) {
+
+	struct block {
+		inode_ptr dir;
+		string path;
+		string text;
+		vector<unique_ptr<block>> children;
+		exception_ptr failure;
+		bool ready {false};
+	};
+
+	mutex readyLock;
+	condition_variable readyCond;
+	block top;
+	top.dir = selfNode.lock();
+	top.path = currentFolderName;
+
+	work_pool* pool = nullptr;
+	function<void(block*)> format = [&](block* job)
 	{
-		inode_ptr childNode = it->second;
-		constructLSInfo(it->first, SP, childNode, ls);
-		file_type fileType = childNode->getContentType();
-		if (fileType == file_type::DIRECTORY_TYPE)
+		ls_writer lines;
+		// children already submitted run on even if this task fails,
+		// so the block keeps them either way
+		vector<unique_ptr<block>> children;
+		exception_ptr failure;
+		try
+		{
+			directory* heapDir = dynamic_cast<directory*>(job->dir->contents);
+			if (heapDir == nullptr)
+			{
+				// a mounted image lists its own subtree, in one block
+				job->dir->contents->getLSR_dir(job->path, lines, 1, view);
+			}
+			else
+			{
+				directory& dir = *heapDir;
+				dir.getLS(job->path, lines, view);
+
+				// let go before the block is ready: once it is, it may be
+				// freed along with the last reference to the directory
+				shared_lock<shared_mutex> guard(dir.lock);
+				dir.for_each_visible(view, [&](string_view name, const inode_ptr& node)
+				{
+					if (node->getContentType() != file_type::DIRECTORY_TYPE)
+					{
+						return;
+					}
+					auto child = make_unique<block>();
+					child->dir = node;
+					child->path = job->path;
+					if (job->path != "/")
+					{
+						child->path += "/";
+					}
+					child->path += name;
+					block* task = child.get();
+					children.push_back(move(child));
+					pool->submit([&format, task] { format(task); });
+				});
+			}
+		}
+		catch (...)
+		{
+			failure = current_exception();
+		}
+
 		{
-			dirQueue.push(childNode);
-			dirNameQueue.push(it->first);
+			lock_guard<mutex> guard(readyLock);
+			job->text = move(lines.text());
+			job->children = move(children);
+			job->failure = failure;
+			job->ready = true;
 		}
+		readyCond.notify_all();
+	};
+
+	// Declared last so that it drains before anything its tasks refer
+	// to goes out of scope.  Without the threads to run it, nothing
+	// has been listed yet, and the listing is made serially instead.
+	unique_ptr<work_pool> workers;
+	try
+	{
+		workers = make_unique<work_pool>(jobs);
+	}
+	catch (system_error& error)
+	{
+		DEBUGF ('w', "lsr serially: " << error.what());
+		getLSR_dir(currentFolderName, sink, 1, view);
+		return;
 	}
-	result.push_back(ls);
+	pool = workers.get();
+	workers->submit([&format, &top] { format(&top); });
 
-	while (dirQueue.size() != 0)
+	auto emit = [&](block* job)
 	{
-		inode_ptr nextDir = dirQueue.front();
-		dirQueue.pop();
-		string nextDirName;
-		nextDirName += currentFolderName;
-		if (currentFolderName != "/")
+		unique_lock<mutex> guard(readyLock);
+		readyCond.wait(guard, [job] { return job->ready; });
+		guard.unlock();
+		if (job->failure != nullptr)
 		{
-			nextDirName += "/";
+			rethrow_exception(job->failure);
+		}
+		sink.block(job->text);
+		string().swap(job->text);
+	};
+
+	struct frame {
+		block* job;
+		size_t next;
+	};
+
+	emit(&top);
+	vector<frame> stack;
+	stack.push_back({&top, 0});
+
+	while (not stack.empty())
+	{
+		frame& current = stack.back();
+		if (current.next == current.job->children.size())
+		{
+			current.job->children.clear();
+			stack.pop_back();
+			continue;
 		}
-		nextDirName += dirNameQueue.front();
-		dirNameQueue.pop();
-		nextDir->getLSR_inode(nextDirName, result);
+
+		block* child = current.job->children[current.next++].get();
+		emit(child);
+		stack.push_back({child, 0});
 	}
 }
 
 
-bool directory::shouldAppendSlash(const string& folderName, inode_ptr folderNode) {
+bool directory::shouldAppendSlash(string_view folderName, inode_ptr folderNode) {
 	if (folderName == "." or folderName == "..")
 	{
 		return false;
@@ -685,16 +2379,12 @@ bool directory::shouldAppendSlash(const string& folderName, inode_ptr folderNode
 	return false;
 }
 
-inode_ptr directory::fn_catenate(const string& fileName)
+inode_ptr directory::fn_catenate(string_view fileName, view_id view)
 {
-	bool is_file_already_present = false;
-
-	// check if filename already exists.
-	is_file_already_present = dirents.find(fileName) != dirents.end() ? true : false;
+	inode_ptr existingFile = find(fileName, view);
 
-	if (is_file_already_present)
+	if (existingFile != nullptr)
 	{
-		inode_ptr existingFile = dirents[fileName];
 		if (existingFile->getContentType() != file_type::PLAIN_TYPE)
 		{
 			throw file_error ("is a directory");
@@ -708,3 +2398,252 @@ inode_ptr directory::fn_catenate(const string& fileName)
 		throw file_error ("cat: No such file or directory");
 	}
 }
+
+/*======================================================================================================================
+ *
+ =====================================================================================================================*/
+
+mapped_directory::mapped_directory(shared_ptr<const mapped_image> image_,
+                                   uint64_t offset_, inode_ptr up_):
+                  image (move(image_)), offset (offset_), up (move(up_)) {
+}
+
+// Builds the node for the record at offset, below up.  Mapped nodes
+// come from the heap rather than an arena: they are made on lookup,
+// far from any inode_state.  They keep the numbers the image saved
+// them with, outside any inode_table.
+inode_ptr mapped_directory::make(shared_ptr<const mapped_image> image,
+                                 uint64_t offset, inode_ptr up) {
+	image_node record = image->node(offset);
+	allocator<char> heap;
+	inode_ptr node;
+	if (record.kind == IMAGE_DIR)
+	{
+		node = make_inode_block<mapped_directory>(heap, file_type::DIRECTORY_TYPE,
+		                                          FIRST_EPOCH, image, offset, up);
+		node->contents->setSelfNode(node);
+	}
+	else
+	{
+		node = make_inode_block<mapped_file>(heap, file_type::PLAIN_TYPE,
+		                                     FIRST_EPOCH, image, offset, up);
+	}
+	node->inode_nr = record.inode_nr;
+	node->parent = up;
+	return node;
+}
+
+size_t mapped_directory::size(view_id) const {
+	return image->node(offset).size + 2;
+}
+
+rope_view mapped_directory::readfile(view_id) const {
+   throw file_error ("is a directory");
+}
+
+void mapped_directory::writefile (string_view, view_id) {
+   throw file_error ("is a directory");
+}
+
+void mapped_directory::appendfile (string_view, view_id) {
+   throw file_error ("is a directory");
+}
+
+inode_ptr mapped_directory::remove (string_view, view_id) {
+   throw file_error ("read-only image");
+}
+
+inode_ptr mapped_directory::rmr_dir (string_view, view_id) {
+   throw file_error ("read-only image");
+}
+
+inode_ptr mapped_directory::mkdir (string_view, tree_state&, view_id) {
+   throw file_error ("read-only image");
+}
+
+inode_ptr mapped_directory::mkfile (string_view, tree_state&, view_id) {
+   throw file_error ("read-only image");
+}
+
+void mapped_directory::setSelfNode(inode_ptr current) {
+	selfNode = current;
+}
+
+inode_ptr mapped_directory::getNodeByName(string_view nodeName, view_id) {
+	if (nodeName == "..")
+	{
+		inode_ptr me = selfNode.lock();
+		inode_ptr myParent = me->getParent();
+		return myParent != nullptr ? myParent : me;
+	}
+
+	if (nodeName == ".")
+	{
+		return selfNode.lock();
+	}
+
+	uint64_t found = image->find(offset, nodeName);
+	if (found == image->node(offset).size)
+	{
+		return nullptr;
+	}
+
+	inode_ptr child = make(image, image->dirent(offset, found).node, selfNode.lock());
+	child->name = name_ref(nodeName);
+	return child;
+}
+
+inode_ptr mapped_directory::fn_catenate(string_view fileName, view_id view)
+{
+	if (fileName == "." or fileName == "..")
+	{
+		throw file_error ("cat: No such file or directory");
+	}
+
+	inode_ptr existingFile = getNodeByName(fileName, view);
+	if (existingFile == nullptr)
+	{
+		throw file_error ("cat: No such file or directory");
+	}
+
+	if (existingFile->getContentType() != file_type::PLAIN_TYPE)
+	{
+		throw file_error ("is a directory");
+	}
+
+	return existingFile;
+}
+
+// One ls line for entry i of the directory record at dir, read from
+// the entry's own record.
+void mapped_directory::entryLSInfo(uint64_t dir, uint64_t i, ls_sink& sink) const {
+	image_dirent entry = image->dirent(dir, i);
+	image_node record = image->node(entry.node);
+	bool isDir = record.kind == IMAGE_DIR;
+	sink.entry(record.inode_nr, isDir ? record.size + 2 : record.size,
+	           image->name(dir, entry), isDir);
+}
+
+void mapped_directory::getLS(const string& currentFolderName, ls_sink& sink, view_id view) {
+
+	sink.begin(currentFolderName);
+
+	inode_ptr me = selfNode.lock();
+	inode_ptr myParent = getNodeByName("..", view);
+	sink.entry(me->get_inode_nr(), size(view), ".", false);
+	sink.entry(myParent->get_inode_nr(), myParent->getContentSize(view), "..", false);
+
+	uint64_t count = image->node(offset).size;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		entryLSInfo(offset, i, sink);
+	}
+}
+
+// The same depth-first walk as directory::getLSR_dir, over record
+// offsets instead of nodes, so that listing an image builds nothing.
+// It is always serial.
+void mapped_directory::getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t, view_id view) {
+
+	struct frame {
+		uint64_t dir;
+		string path;
+		uint64_t next;
+	};
+
+	getLS(currentFolderName, sink, view);
+
+	vector<frame> stack;
+	stack.push_back({offset, currentFolderName, 0});
+
+	while (not stack.empty())
+	{
+		frame& top = stack.back();
+		image_node topRecord = image->node(top.dir);
+
+		if (top.next == topRecord.size)
+		{
+			stack.pop_back();
+			continue;
+		}
+
+		image_dirent entry = image->dirent(top.dir, top.next++);
+		image_node record = image->node(entry.node);
+		if (record.kind != IMAGE_DIR)
+		{
+			continue;
+		}
+
+		string nextDirName = top.path;
+		if (top.path != "/")
+		{
+			nextDirName += "/";
+		}
+		nextDirName += image->name(top.dir, entry);
+
+		sink.begin(nextDirName);
+		sink.entry(record.inode_nr, record.size + 2, ".", false);
+		sink.entry(topRecord.inode_nr, topRecord.size + 2, "..", false);
+		for (uint64_t i = 0; i < record.size; ++i)
+		{
+			entryLSInfo(entry.node, i, sink);
+		}
+		stack.push_back({entry.node, move(nextDirName), 0});
+	}
+}
+
+mapped_file::mapped_file(shared_ptr<const mapped_image> image_,
+                         uint64_t offset_, inode_ptr up_):
+             image (move(image_)), offset (offset_), up (move(up_)) {
+}
+
+size_t mapped_file::size(view_id) const {
+	return image->node(offset).size;
+}
+
+rope_view mapped_file::readfile(view_id) const {
+	return rope_view(image->contents(offset));
+}
+
+void mapped_file::writefile (string_view, view_id) {
+   throw file_error ("read-only image");
+}
+
+void mapped_file::appendfile (string_view, view_id) {
+   throw file_error ("read-only image");
+}
+
+inode_ptr mapped_file::remove (string_view, view_id) {
+   throw file_error ("is a plain file");
+}
+
+inode_ptr mapped_file::rmr_dir (string_view, view_id) {
+   throw file_error ("is a plain file");
+}
+
+inode_ptr mapped_file::mkdir (string_view, tree_state&, view_id) {
+   throw file_error ("is a plain file");
+}
+
+inode_ptr mapped_file::mkfile (string_view, tree_state&, view_id) {
+   throw file_error ("is a plain file");
+}
+
+inode_ptr mapped_file::getNodeByName(string_view, view_id) {
+	throw file_error ("is a plain file");
+}
+
+void mapped_file::getLS(const string&, ls_sink&, view_id) {
+	throw file_error ("is a plain file");
+}
+
+void mapped_file::getLSR_dir(const string&, ls_sink&, size_t, view_id) {
+	throw file_error ("is a plain file");
+}
+
+void mapped_file::setSelfNode(inode_ptr) {
+}
+
+inode_ptr mapped_file::fn_catenate(string_view, view_id) {
+	throw file_error ("is a plain file");
+}
@@ -1,15 +1,26 @@
-// $Id: file_sys.h,v 1.4 2016-01-14 16:16:52-08 - - $
+// $Id: file_sys.h,v 1.5 2016-01-14 16:16:52-08 - - $
 
 #ifndef __INODE_H__
 #define __INODE_H__
 
+#include <atomic>
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <vector>
 using namespace std;
 
+#include "arena.h"
+#include "content.h"
+#include "dirents.h"
+#include "journal.h"
+#include "rcu.h"
+#include "reclaimer.h"
+#include "rope.h"
 #include "util.h"
 
 // inode_t -
@@ -20,16 +31,317 @@ class inode;
 class base_file;
 class plain_file;
 class directory;
+class mapped_image;
 using inode_ptr = shared_ptr<inode>;
 using wk_inode_ptr = weak_ptr<inode>;
 using base_file_ptr = shared_ptr<base_file>;
 ostream& operator<< (ostream&, file_type);
 
+// view_id -
+//    Time is counted in epochs.  The tree starts in FIRST_EPOCH, and
+//    each snapshot freezes the current epoch, under its number, and
+//    starts the next one.  A node records the epoch in which it was
+//    linked and a removed one the epoch in which it was unlinked, so
+//    the snapshot of epoch s sees every node linked no later than s
+//    and not unlinked by then.  LIVE_VIEW, later than any epoch,
+//    sees the current tree.
+
+using view_id = uint64_t;
+constexpr view_id FIRST_EPOCH {1};
+constexpr view_id LIVE_VIEW {UINT64_MAX};
+
+
+// ls_sink -
+//    Receives a listing as it is produced, so that ls and lsr never
+//    hold more than one line of it.  begin is called once per
+//    directory with the name for its heading, then entry once for
+//    each dirent, dot and dotdot first.  A parallel lsr formats
+//    whole directories on worker threads and hands each finished
+//    block of lines to block instead.
+// ls_writer -
+//    An ls_sink that formats each line into a fixed-size buffer and
+//    writes the buffer to an ostream whenever it fills, on flush, and
+//    when the writer is destroyed.  Without an ostream, the lines
+//    just accumulate in text().
+
+class ls_sink {
+   public:
+      virtual ~ls_sink() = default;
+      virtual void begin (string_view dirname) = 0;
+      virtual void entry (uint64_t inode_nr, size_t size, string_view name,
+                          bool append_slash) = 0;
+      virtual void block (string_view lines) = 0;
+};
+
+class ls_writer: public ls_sink {
+   private:
+      static constexpr size_t CAPACITY {64 * 1024};
+      ostream* out {nullptr};
+      string buffer;
+      void spill();
+   public:
+      ls_writer() = default;
+      explicit ls_writer (ostream& out);
+      ~ls_writer();
+      void flush();
+      string& text() { return buffer; }
+      virtual void begin (string_view dirname) override;
+      virtual void entry (uint64_t inode_nr, size_t size, string_view name,
+                          bool append_slash) override;
+      virtual void block (string_view lines) override;
+};
+
+
+// dentry_cache -
+//    A bounded, direct-mapped cache of resolved paths.  Absolute
+//    paths are keyed by the path alone; relative paths also by the
+//    inode number of the directory they were resolved from.  Every
+//    entry is stamped with the generation current when it was filled,
+//    and bumping the generation (on mkdir, rm, rmr) invalidates all
+//    entries at once.  Each session has its own cache, but the
+//    generation belongs to the tree, so a change made by one session
+//    invalidates them all.  Nodes are held weakly so the cache never
+//    keeps a removed subtree alive.  A hit is only as good as the
+//    moment it was found: find can give back the generation of the
+//    entry, for current to confirm once the node is locked, and an
+//    entry that fails is erased.
+
+class dentry_cache {
+   private:
+      struct entry {
+         size_t generation {0};
+         uint64_t base {0};
+         string path;
+         wk_inode_ptr node;
+      };
+      vector<entry> slots;
+      atomic<size_t>& generation;
+      size_t hit_count {0};
+      size_t miss_count {0};
+      entry& slot(uint64_t base, string_view path);
+   public:
+      explicit dentry_cache (atomic<size_t>& generation,
+                             size_t capacity = 1024);
+      inode_ptr find (uint64_t base, string_view path);
+      inode_ptr find (uint64_t base, string_view path, size_t& stamp);
+      void insert (uint64_t base, string_view path, inode_ptr node);
+      void erase (uint64_t base, string_view path);
+      bool current (size_t stamp) const { return stamp == generation; }
+      void invalidate() { ++generation; }
+      size_t hits() const { return hit_count; }
+      size_t misses() const { return miss_count; }
+};
+
 
+// inode_table -
+//    Every node of one tree by its inode number, so that a number, as
+//    ls prints it, leads back to its node in constant time, without
+//    walking the tree.  Numbers are 64 bits, and those of nodes that
+//    have gone are handed out again, most recently freed first, so
+//    that they stay dense however many nodes come and go; the table
+//    is a vector indexed by number, of one pointer to each node and a
+//    weak reference to it.  The nodes themselves, with everything
+//    known about them, stay where they are, in their arena blocks, for
+//    a walk to reach in one step.  A mutex makes every member safe to
+//    call from any thread.  Nodes read in place from a mapped image
+//    are not in the table.
+// enter -
+//    Gives a new node a free number and enters it under that number.
+// claim -
+//    Enters a node under the number it was saved with, giving up the
+//    one it was entered under.  A node of a tree that has since been
+//    replaced may still hold that number; it loses its slot, and gives
+//    back nothing when it goes.
+// release -
+//    Frees the number of a node that is going, if it still holds it.
+// find -
+//    The node numbered nr, or nullptr if there is none.
+// reserve -
+//    Makes room for numbers up to limit, so that claiming them cannot
+//    fail.
+// limit -
+//    One more than the highest number in the table.
+
+class inode_table {
+   private:
+      struct slot {
+         const inode* node {nullptr};
+         wk_inode_ptr ref;
+      };
+      mutex lock;
+      vector<slot> slots;
+      vector<uint64_t> freed;
+      void place (const inode_ptr& node, uint64_t nr);
+   public:
+      inode_table();
+      inode_table (const inode_table&) = delete;
+      inode_table& operator= (const inode_table&) = delete;
+      void enter (const inode_ptr& node);
+      void claim (const inode_ptr& node, uint64_t nr);
+      void release (const inode* node);
+      void reserve (uint64_t limit);
+      inode_ptr find (uint64_t nr);
+      uint64_t limit();
+};
+
+
+// tree_state -
+//    What every session on one tree shares: the nodes, the arena they
+//    live in and the table that numbers them, the epoch and the
+//    snapshots, the journal, the reclaimer, and the generation of the
+//    dentry caches.  replaced counts the times the whole tree has been
+//    swapped for another by load or mount, so that other sessions know
+//    to return to the new root.  lock is for a server running
+//    sessions concurrently: commands that change single directories
+//    hold it shared, as readers do, and lock those directories
+//    themselves (see dir_lock); those that walk or replace the whole
+//    tree, or move the epoch, hold it exclusively.  Nothing here takes
+//    it.  log_order makes checking that a change is still reachable
+//    and adding it to the journal's batch one step, against removals,
+//    which mark what they unlink under it; the batch is synced after
+//    it is let go.  Whatever was retired to rcu while the tree was in
+//    use is released when it goes.
+
+class tree_state {
+   public:
+      // Declared first so that it is destroyed last: every node, and
+      // every control block still held by a weak_ptr, lives in it.
+      node_arena arena;
+      // Next, so that every node has gone before its number is, and
+      // every body before the store that lists it.
+      inode_table inodes;
+      content_store bodies {arena};
+      inode_ptr root {nullptr};
+      view_id epoch {FIRST_EPOCH};
+      map<string,view_id,less<>> snapshots;
+      vector<string> snapshot_names;
+      unique_ptr<journal> log;
+      bool background_reclaim {false};
+      bool lockfree_reads {true};
+      reclaimer reclaim;
+      atomic<size_t> generation {1};
+      size_t replaced {0};
+      shared_mutex lock;
+      mutex log_order;
+      tree_state();
+      ~tree_state() { rcu::barrier(); }
+      tree_state (const tree_state&) = delete;
+      tree_state& operator= (const tree_state&) = delete;
+};
+
+// dir_lock -
+//    Holds the lock of a directory on the heap, shared or exclusive,
+//    until it is released or destroyed.  Other nodes have no lock to
+//    take: a plain file is guarded by the lock of its directory, and a
+//    mapped image never changes.  Locks are only taken down the tree,
+//    a directory before its children, never up, so that walks cannot
+//    wait on one another in a cycle.  A lock is let go before the last
+//    reference to its directory, which is why the inode_ptr a dir_lock
+//    is taken on is declared before it.
+
+class dir_lock {
+   private:
+      shared_mutex* held {nullptr};
+      bool exclusive {false};
+   public:
+      dir_lock() = default;
+      dir_lock (const inode& node, bool exclusive);
+      dir_lock (dir_lock&& that) noexcept;
+      dir_lock& operator= (dir_lock&& that) noexcept;
+      ~dir_lock() { release(); }
+      void release();
+};
+
 // inode_state -
 //    A small convenient class to maintain the state of the simulated
 //    process:  the root (/), the current directory (.), and the
-//    prompt.
+//    prompt.  The tree itself may be shared with other sessions, each
+//    an inode_state with its own current directory and prompt.  With
+//    no tree given, a session starts a new, empty one.
+// output -
+//    Where commands write their results; cout unless set otherwise.
+// getTargetNode -
+//    Resolves a path to an inode, consulting the dentry cache
+//    before walking the tree component by component.  The walk is
+//    lock coupled: each directory is locked shared, and its lock let
+//    go only once the next one along is held, so no change can slip
+//    in between.  The final node is left locked in held, exclusively
+//    if asked.  Without held, a path in the live tree is first walked
+//    with no locks at all (see walkLive).
+// walkLive -
+//    Follows a path through the live tree without taking any lock,
+//    over the lookup_index of each directory, and returns the node it
+//    leads to; the caller is inside an rcu::reader, which keeps every
+//    node reached alive until it leaves.  Returns nullptr, for the
+//    caller to walk the path the usual way, wherever that would have
+//    more to do: in a snapshot, in a mapped image, or on a name that
+//    is not there, so that errors are still raised in one place.
+//    Nodes above where the walk started are reached through their
+//    parent links and held in anchor.
+// findLive -
+//    walkLive for a node to be kept: a directory, returned as an
+//    inode_ptr, or nullptr.
+// getParentNode -
+//    Resolves all but the last component of a path and returns that
+//    directory, locked in held, setting name to the last component.
+// setLockFreeReads -
+//    When off, every walk takes the locks, as for a change; on by
+//    default, and only turned off to compare the two.
+// setBackgroundReclaim -
+//    When on, a subtree unlinked by rmr is freed by a background
+//    thread, unless cwd lies inside it.  drainReclaim waits until all
+//    such subtrees are gone.
+// snapshot -
+//    Freezes the tree as it is now, in constant time, under a name.
+//    The frozen tree is read through paths beginning with
+//    /.snapshot/name, and cd can enter it, but nothing there can be
+//    changed.  Later changes to the live tree keep just enough of the
+//    old state for the snapshots that can still see it.
+// getTargetNode, getParentNode -
+//    Also set view to the snapshot the path leads into, or LIVE_VIEW.
+// save -
+//    Writes the live tree to an image file (see image.h).  Snapshots
+//    are not saved.
+// load -
+//    Replaces the whole tree with the one in an image, keeping its
+//    inode numbers, and returns to its root.  Snapshots of the old
+//    tree are dropped with it.
+// mount -
+//    Maps an image and enters its root, read-only, as a new directory
+//    at path; or, if path is "/", makes it the whole tree, as load
+//    does.  Nothing in the image is read until it is looked at.
+// openJournal -
+//    Recovers the tree from the journal, if there is one, and from
+//    then on records every change to the live tree in it (see
+//    journal.h).  save, load and mounting at "/" start the journal
+//    over from their image.  Returns whether anything was recovered.
+// logChange -
+//    Records a change to the directory where that has just succeeded,
+//    with its path made absolute.  Changes inside a subtree that has
+//    been removed, by this session or another, cannot be replayed, and
+//    need not be, so they are not recorded.  A removal passes the node
+//    it unlinked, which is marked so under log_order before its own
+//    record is made.
+// isLinked -
+//    True if node can still be reached from the root: none of its
+//    ancestors has been unlinked.
+// pathOf -
+//    The absolute path of node, as seen in view.
+// getNodeByNumber -
+//    The live node numbered nr in the tree's inode_table.
+// stat, statInode -
+//    Print the path, inode number, type and size of the node at path,
+//    or numbered nr.  The number leads to the node in constant time.
+// cdInode -
+//    Changes into the directory numbered nr.
+// df -
+//    Reports how many distinct file bodies the tree stores, how many
+//    references there are to them, and the bytes that sharing them
+//    saves (see content_store), once the bodies already replaced
+//    have been released.
+// followTree -
+//    Returns to the root if another session has replaced the tree
+//    since this one last looked.
 
 class inode_state {
    friend class inode;
@@ -37,59 +349,146 @@ class inode_state {
    private:
       inode_state (const inode_state&) = delete; // copy ctor
       inode_state& operator= (const inode_state&) = delete; // op=
-      inode_ptr root {nullptr};
+      // Declared first so that the tree outlives cwd.
+      shared_ptr<tree_state> tree;
       inode_ptr cwd {nullptr};
       string prompt_ {"% "};
-      inode_ptr getTargetNode(const string& path);
+      string cwd_path;
+      bool cwd_path_valid {false};
+      dentry_cache dcache;
+      view_id cwd_view {LIVE_VIEW};
+      size_t seen_replaced {0};
+      ostream* out {&cout};
+      void followTree();
+      void logChange(journal_op op, string_view path, string_view data,
+                     const inode_ptr& where, const inode_ptr& removed = nullptr);
+      void replay(const journal_entry& entry);
+      view_id snapshotView(string_view& path);
+      inode* walkLive(string_view path, inode_ptr& anchor);
+      inode_ptr findLive(string_view path);
+      inode_ptr getTargetNode(string_view path, view_id& view);
+      inode_ptr getTargetNode(string_view path, view_id& view,
+                              dir_lock& held, bool exclusive);
+      inode_ptr getParentNode(string_view path, string_view& name,
+                              view_id& view, dir_lock& held,
+                              bool exclusive = false);
+      inode_ptr getWritableParent(string_view path, string_view& name,
+                                  dir_lock& held);
+      void replaceTree(inode_ptr newRoot);
+      void invalidatePWD(inode_ptr removed);
+      static bool isWithin(inode_ptr node, inode_ptr subtree);
+      bool isLinked(inode_ptr node);
+      string pathOf(const inode_ptr& node, view_id view);
+      inode_ptr getNodeByNumber(uint64_t nr);
+      void printStat(const inode_ptr& node, view_id view);
    public:
       inode_state();
+      explicit inode_state(shared_ptr<tree_state> tree);
+      const shared_ptr<tree_state>& sharedTree() const { return tree; }
+      ostream& output() { return *out; }
+      void setOutput(ostream& newOut) { out = &newOut; }
       const string& prompt();
+      const dentry_cache& dentries() const { return dcache; }
       string getPWD();
-      vector<string> getLS(const string& path);
-      vector<string> getLSR(const string& path);
+      void getLS(string_view path, ls_sink& sink);
+      void getLSR(string_view path, ls_sink& sink, size_t jobs = 1);
       void setPrompt(string newPrompt);
-      void mkdir(const string& path);
-      void make(const string& path, const wordvec& newdata);
-      void cat(const string& path);
-      void rm(const string& path);
-      void rmr(const string& path);
-      void cd(const string& path);
+      void mkdir(string_view path);
+      void make(string_view path, string_view newdata);
+      void append(string_view path, string_view moredata);
+      void cat(string_view path);
+      void rm(string_view path);
+      void rmr(string_view path);
+      void cd(string_view path);
+      void cdInode(uint64_t nr);
+      void stat(string_view path);
+      void statInode(uint64_t nr);
+      void df();
+      void snapshot(string_view name);
+      void save(const string& filename);
+      void load(const string& filename);
+      void mount(const string& filename, string_view path);
+      bool openJournal(const string& filename, group_commit policy);
+      journal* changeLog() { return tree->log.get(); }
+      const vector<string>& snapshotNames() const { return tree->snapshot_names; }
+      void setBackgroundReclaim(bool on) { tree->background_reclaim = on; }
+      void setLockFreeReads(bool on) { tree->lockfree_reads = on; }
+      void drainReclaim() { tree->reclaim.drain(); }
+      node_arena& nodeArena() { return tree->arena; }
 };
 
 // class inode -
 // inode ctor -
-//    Create a new inode of the given type.
+//    Create a new inode of the given type and number over contents
+//    that the caller owns.
+// make -
+//    Allocate an inode of the given type from the tree's arena,
+//    together with its directory or plain_file in the same block, so
+//    that a node costs one arena allocation rather than two heap
+//    allocations and two control blocks, and number it in the tree's
+//    inode table.  The node is born in the given epoch.
+// dtor -
+//    Gives the inode number back to its table.
 // get_inode_nr -
-//    Retrieves the serial number of the inode.  Inode numbers are
-//    allocated in sequence by small integer.
+//    Retrieves the number of the inode, as its inode_table gave it,
+//    or for a node of a mapped image, as the image saved it.
 // size -
 //    Returns the size of an inode.  For a directory, this is the
 //    number of dirents.  For a text file, the number of characters
 //    when printed (the sum of the lengths of each word, plus the
 //    number of words.
-//    
+// name, parent -
+//    The name of this inode within its parent directory, and a link
+//    back to that directory, so that a path can be rebuilt in time
+//    proportional to its depth.  The root is its own parent.
+// birth -
+//    The epoch in which the node was linked into its directory.
+// unlinked -
+//    Set once the node has been removed from its directory, or the
+//    whole tree it was in replaced.
+// getContentSize -
+//    Takes the lock of a directory to count its entries.
 
 class inode {
    friend class inode_state;
+   friend class tree_state;
+   friend class dir_lock;
+   friend class directory;
+   friend class mapped_directory;
+   friend class lookup_index;
+   friend class inode_table;
    private:
-      static int next_inode_nr;
-      int inode_nr;
-      base_file_ptr contents;
+      inode_table* table {nullptr};
+      uint64_t inode_nr;
+      name_ref name;
+      wk_inode_ptr parent;
+      view_id birth;
+      atomic<bool> unlinked {false};
+      base_file* contents;
       file_type contentType;
       inode() = delete;
    public:
-      inode (file_type);
-      int get_inode_nr() const;
-      void getLS(string path, vector<string>& result);
-      void getLSR_inode(string path, vector<string>& result);
+      inode (file_type, base_file* contents, view_id birth,
+             uint64_t inode_nr);
+      ~inode();
+      inode (const inode&) = delete;
+      inode& operator= (const inode&) = delete;
+      static inode_ptr make (file_type, tree_state& tree, view_id epoch);
+      uint64_t get_inode_nr() const;
+      void getLS(string_view path, ls_sink& sink, view_id view);
+      void getLSR_inode(string_view path, ls_sink& sink, size_t jobs, view_id view);
       file_type getContentType(){return contentType;}
-      void mkDir(const string& folderName);
-      size_t getContentSize();
-      void mkFile(const string& fileName, const wordvec& newdata);
-      void catenate(const string& fileName);
-      void remove(const string& fileName);
-      void rmr_inode(const string& fileName);
-      inode_ptr changeDir(const string& folderName);
+      string_view getName() const {return name;}
+      inode_ptr getParent() const {return parent.lock();}
+      view_id getBirth() const {return birth;}
+      void mkDir(string_view folderName, tree_state& tree, view_id epoch);
+      size_t getContentSize(view_id view = LIVE_VIEW);
+      void mkFile(string_view fileName, string_view newdata, tree_state& tree, view_id epoch);
+      void appendFile(string_view fileName, string_view moredata, tree_state& tree, view_id epoch);
+      void catenate(string_view fileName, view_id view, ostream& out);
+      inode_ptr remove(string_view fileName, view_id epoch);
+      inode_ptr rmr_inode(string_view fileName, view_id epoch);
+      inode_ptr changeDir(string_view folderName);
 
 };
 
@@ -113,58 +512,135 @@ class base_file {
       base_file& operator= (base_file&&) = delete;
    public:
       virtual ~base_file() = default;
-      virtual size_t size() const = 0;
-      virtual const wordvec& readfile() const = 0;
-      virtual void writefile (const wordvec& newdata) = 0;
-      virtual void remove (const string& filename) = 0;
-      virtual void rmr_dir (const string& filename) = 0;
-      virtual inode_ptr mkdir (const string& dirname) = 0;
-      virtual inode_ptr mkfile (const string& filename) = 0;
-      virtual string getNameOfNode(inode_ptr node) = 0;
-      virtual inode_ptr getNodeByName(const string& nodeName) = 0;
-      virtual void getLS(const string& currentFolderName, vector<string>& result) = 0;
-      virtual void getLSR_dir(const string& currentFolderName, vector<string>& result) = 0;
+      virtual size_t size(view_id view) const = 0;
+      virtual rope_view readfile(view_id view) const = 0;
+      virtual void writefile (string_view newdata, view_id epoch) = 0;
+      virtual void appendfile (string_view moredata, view_id epoch) = 0;
+      virtual inode_ptr remove (string_view filename, view_id epoch) = 0;
+      virtual inode_ptr rmr_dir (string_view filename, view_id epoch) = 0;
+      virtual inode_ptr mkdir (string_view dirname, tree_state& tree, view_id epoch) = 0;
+      virtual inode_ptr mkfile (string_view filename, tree_state& tree, view_id epoch) = 0;
+      virtual inode_ptr getNodeByName(string_view nodeName, view_id view) = 0;
+      virtual void getLS(const string& currentFolderName, ls_sink& sink, view_id view) = 0;
+      virtual void getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) = 0;
       virtual void setSelfNode(inode_ptr current) = 0;
-      virtual void setParentNode(inode_ptr parent) = 0;
-      virtual inode_ptr fn_catenate(const string& fileName) = 0;
+      virtual inode_ptr fn_catenate(string_view fileName, view_id view) = 0;
 };
 
 
 // class plain_file -
 // Used to hold data.
-// synthesized default ctor -
-//    Default vector<string> is a an empty vector.
+// ctor -
+//    The file starts out empty, as written in the given epoch.  Its
+//    ropes come from the tree's content_store: one written whole is
+//    shared with every other file holding the same bytes, and is
+//    copied before it is appended to if it still is.
+// size -
+//    The number of bytes in the file.
 // readfile -
-//    Returns a copy of the contents of the wordvec in the file.
+//    Returns the contents of the file as the view sees them, to be
+//    read chunk by chunk.
 // writefile -
 //    Replaces the contents of a file with new contents.
+// appendfile -
+//    Adds to the end of the file without touching what is there.
+// Both keep the old contents first if a snapshot has seen them.  An
+// append never changes bytes already written, so the old contents
+// are just a prefix of the rope and cost one history entry; only a
+// write moves the rope itself into the history.
+// readLive -
+//    The live contents, for a reader that holds no lock but is inside
+//    an rcu::reader.  An append goes into the rope in place, and a
+//    write publishes a new one, retiring the old one unless the
+//    history keeps it.  An empty file has no rope at all.
 
 class plain_file: public base_file {
    private:
-      wordvec data;
+      // A past version of the contents, seen by the views before
+      // until: the first length bytes of body, or of the next newer
+      // version's body if body is null.
+      struct past_body {
+         view_id until;
+         shared_ptr<rope> body;
+         size_t length;
+      };
+      // The bytes of the file, exactly as cat prints them, and the
+      // same rope again for readLive.
+      content_store& store;
+      shared_ptr<rope> data;
+      atomic<const rope*> published {nullptr};
+      view_id written;
+      vector<past_body> history;
+      size_t liveSize() const { return data == nullptr ? 0 : data->size(); }
+      void preserve(view_id epoch, bool replacing);
    public:
-      virtual size_t size() const override;
-      virtual const wordvec& readfile() const override;
-      virtual void writefile (const wordvec& newdata) override;
-      virtual void remove (const string& filename) override;
-    virtual void rmr_dir (const string& filename) override;
-      virtual inode_ptr mkdir (const string& dirname) override;
-      virtual inode_ptr mkfile (const string& filename) override;
-      virtual string getNameOfNode(inode_ptr node) override;
-      virtual inode_ptr getNodeByName(const string& nodeName) override;
-      virtual void getLS(const string& currentFolderName, vector<string>& result) override;
-      virtual void getLSR_dir(const string& currentFolderName, vector<string>& result) override;
+      plain_file (view_id epoch, content_store& store);
+      rope_view readLive() const;
+      virtual size_t size(view_id view) const override;
+      virtual rope_view readfile(view_id view) const override;
+      virtual void writefile (string_view newdata, view_id epoch) override;
+      virtual void appendfile (string_view moredata, view_id epoch) override;
+      virtual inode_ptr remove (string_view filename, view_id epoch) override;
+      virtual inode_ptr rmr_dir (string_view filename, view_id epoch) override;
+      virtual inode_ptr mkdir (string_view dirname, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr mkfile (string_view filename, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr getNodeByName(string_view nodeName, view_id view) override;
+      virtual void getLS(const string& currentFolderName, ls_sink& sink, view_id view) override;
+      virtual void getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) override;
       virtual void setSelfNode(inode_ptr current) override;
-      virtual void setParentNode(inode_ptr parent) override;
-      virtual inode_ptr fn_catenate(const string& fileName) override;
+      virtual inode_ptr fn_catenate(string_view fileName, view_id view) override;
+};
+
+// class lookup_index -
+// The live entries of a directory once more, by name, for readers
+// that hold no lock.  An open-addressing table of inode pointers,
+// each published by one atomic store, which a reader inside an
+// rcu::reader probes while a writer, holding the directory's lock,
+// adds and removes entries.  A removed entry leaves a tombstone, so
+// that no probe is cut short, and entries are only ever added to
+// empty slots, which are kept to at least half of the table.  When
+// there would be fewer, the live entries are copied into a new
+// table, which is published in place of the old one, and the old
+// one retired.
+// find -
+//    The node entered under name, or nullptr.
+// insert, erase -
+//    Add or remove one node, entered under its name.
+
+class lookup_index {
+   private:
+      struct table {
+         size_t mask;
+         unique_ptr<atomic<inode*>[]> slots;
+         explicit table (size_t capacity);
+      };
+      static inode* const TOMBSTONE;
+      atomic<table*> current {nullptr};
+      size_t live {0};
+      size_t used {0};
+      void rebuild();
+   public:
+      lookup_index() = default;
+      ~lookup_index();
+      lookup_index (const lookup_index&) = delete;
+      lookup_index& operator= (const lookup_index&) = delete;
+      inode* find(string_view name) const;
+      void insert(inode* node);
+      void erase(const inode* node);
 };
 
 // class directory -
 // Used to map filenames onto inode pointers.
 // default ctor -
 //    Creates a new map with keys "." and "..".
+// dtor -
+//    Tears the subtree down iteratively, so that freeing a deep tree
+//    does not recurse once per level.  A subdirectory still referenced
+//    from elsewhere (such as cwd) is left intact.  A directory whose
+//    parent has been freed this way treats itself as its own parent.
 // remove -
-//    Removes the file or subdirectory from the current inode.
+//    Removes the file or subdirectory from the current inode and
+//    returns the inode that was unlinked.
 //    Throws an file_error if this is not a directory, the file
 //    does not exist, or the subdirectory is not empty.
 //    Here empty means the only entries are dot (.) and dotdot (..).
@@ -176,31 +652,125 @@ class plain_file: public base_file {
 // mkfile -
 //    Create a new empty text file with the given name.  Error if
 //    a dirent with that name exists.
+// link -
+//    Enters an existing node, such as one loaded from an image, under
+//    name.  Error if a dirent with that name exists.
+// Every read takes the view it is made in.  The live view reads
+// dirents alone; a snapshot also sees the graveyard and skips
+// entries linked after it.
+// lock -
+//    Guards dirents, the graveyard, and the contents of the plain
+//    files entered here.  The caller of any of the members above holds
+//    it, as inode_state does through dir_lock, except for getLS and
+//    getLSR_dir, which lock each directory they list as they go, and
+//    remove, which locks the directory it removes.
+// index -
+//    Kept in step with dirents by the members that change them, for
+//    lookup without the lock.  The node under a live name is found in
+//    both or in neither, once they return.
 
 class directory: public base_file {
+   friend class inode_state;
+   friend class dir_lock;
    private:
-      // Must be a map, not unordered_map, so printing is lexicographic.
-      map<string,inode_ptr> dirents;
-      wk_inode_ptr parentNode;
+      // A removed entry that some snapshot can still see, kept until
+      // the directory itself goes.
+      struct buried {
+         inode_ptr node;
+         view_id death;
+      };
+      // Printing must stay lexicographic; dirent_table sorts lazily
+      // once a directory is large enough to be hashed.
+      dirent_table dirents;
+      lookup_index index;
+      // Ordered by name, and for each name by death.
+      vector<buried> graveyard;
       wk_inode_ptr selfNode;
-      bool shouldAppendSlash(const string& folderName, inode_ptr folderNode);
-      void constructLSInfo(const string& name, const string& delimiter, inode_ptr node, string& result);
+      mutable shared_mutex lock;
+      void bury(inode_ptr node, view_id epoch);
+      void releaseAll(vector<inode_ptr>& nodes);
+      inode_ptr find(string_view name, view_id view);
+      template <typename function>
+      void for_each_visible(view_id view, function fn) const;
+      bool shouldAppendSlash(string_view folderName, inode_ptr folderNode);
+      void constructLSInfo(string_view name, inode_ptr node, ls_sink& sink, view_id view);
+      void getLSR_parallel(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view);
    public:
-      virtual size_t size() const override;
-      virtual const wordvec& readfile() const override;
-      virtual void writefile (const wordvec& newdata) override;
-      virtual void remove (const string& filename) override;
-      virtual void rmr_dir (const string& filename) override;
-      virtual inode_ptr mkdir (const string& dirname) override;
-      virtual inode_ptr mkfile (const string& filename) override;
-      virtual string getNameOfNode(inode_ptr node) override;
-      virtual inode_ptr getNodeByName(const string& nodeName) override;
-      virtual void getLS(const string& currentFolderName, vector<string>& result) override;
-      virtual void getLSR_dir(const string& currentFolderName, vector<string>& result) override;
+      virtual size_t size(view_id view) const override;
+      virtual rope_view readfile(view_id view) const override;
+      virtual void writefile (string_view newdata, view_id epoch) override;
+      virtual void appendfile (string_view moredata, view_id epoch) override;
+      virtual inode_ptr remove (string_view filename, view_id epoch) override;
+      virtual inode_ptr rmr_dir (string_view filename, view_id epoch) override;
+      virtual inode_ptr mkdir (string_view dirname, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr mkfile (string_view filename, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr getNodeByName(string_view nodeName, view_id view) override;
+      virtual void getLS(const string& currentFolderName, ls_sink& sink, view_id view) override;
+      virtual void getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) override;
+      void link(string_view name, inode_ptr node);
       directory();
+      virtual ~directory();
+      virtual void setSelfNode(inode_ptr current) override;
+      virtual inode_ptr fn_catenate(string_view fileName, view_id view) override;
+};
+
+// class mapped_directory, class mapped_file -
+// A directory or plain file read in place from a mapped image, at
+// the offset of its record.  Each lookup builds a new inode for the
+// entry it finds, which keeps its parent alive, so that ".." and pwd
+// work however the entry was reached; nothing else is cached, and
+// listings are read straight from the image without building any.
+// Every change is refused as a file_error.  Views do not matter: the
+// image never changes.
+
+class mapped_directory: public base_file {
+   private:
+      shared_ptr<const mapped_image> image;
+      uint64_t offset;
+      wk_inode_ptr selfNode;
+      inode_ptr up;
+      void entryLSInfo(uint64_t dir, uint64_t i, ls_sink& sink) const;
+   public:
+      mapped_directory (shared_ptr<const mapped_image> image, uint64_t offset,
+                        inode_ptr up);
+      static inode_ptr make (shared_ptr<const mapped_image> image,
+                             uint64_t offset, inode_ptr up);
+      virtual size_t size(view_id view) const override;
+      virtual rope_view readfile(view_id view) const override;
+      virtual void writefile (string_view newdata, view_id epoch) override;
+      virtual void appendfile (string_view moredata, view_id epoch) override;
+      virtual inode_ptr remove (string_view filename, view_id epoch) override;
+      virtual inode_ptr rmr_dir (string_view filename, view_id epoch) override;
+      virtual inode_ptr mkdir (string_view dirname, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr mkfile (string_view filename, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr getNodeByName(string_view nodeName, view_id view) override;
+      virtual void getLS(const string& currentFolderName, ls_sink& sink, view_id view) override;
+      virtual void getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) override;
+      virtual void setSelfNode(inode_ptr current) override;
+      virtual inode_ptr fn_catenate(string_view fileName, view_id view) override;
+};
+
+class mapped_file: public base_file {
+   private:
+      shared_ptr<const mapped_image> image;
+      uint64_t offset;
+      inode_ptr up;
+   public:
+      mapped_file (shared_ptr<const mapped_image> image, uint64_t offset,
+                   inode_ptr up);
+      virtual size_t size(view_id view) const override;
+      virtual rope_view readfile(view_id view) const override;
+      virtual void writefile (string_view newdata, view_id epoch) override;
+      virtual void appendfile (string_view moredata, view_id epoch) override;
+      virtual inode_ptr remove (string_view filename, view_id epoch) override;
+      virtual inode_ptr rmr_dir (string_view filename, view_id epoch) override;
+      virtual inode_ptr mkdir (string_view dirname, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr mkfile (string_view filename, tree_state& tree, view_id epoch) override;
+      virtual inode_ptr getNodeByName(string_view nodeName, view_id view) override;
+      virtual void getLS(const string& currentFolderName, ls_sink& sink, view_id view) override;
+      virtual void getLSR_dir(const string& currentFolderName, ls_sink& sink, size_t jobs, view_id view) override;
       virtual void setSelfNode(inode_ptr current) override;
-      virtual void setParentNode(inode_ptr parent) override;
-      virtual inode_ptr fn_catenate(const string& fileName) override;
+      virtual inode_ptr fn_catenate(string_view fileName, view_id view) override;
 };
 
 #endif
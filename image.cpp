@@ -0,0 +1,262 @@
+// $Id: image.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "file_sys.h"
+#include "image.h"
+
+image_writer::image_writer (const string& filename_):
+              filename (filename_), partial (filename_ + ".tmp"),
+              out (partial, ios::binary | ios::trunc) {
+   if (not out) throw file_error (filename + ": cannot create image");
+   buffer.reserve (BLOCK);
+   put (IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+}
+
+image_writer::~image_writer() {
+   if (closed) return;
+   out.close();
+   remove (partial.c_str());
+}
+
+void image_writer::spill() {
+   out.write (buffer.data(), buffer.size());
+   if (not out) throw file_error (filename + ": write failed");
+   flushed += buffer.size();
+   buffer.clear();
+}
+
+void image_writer::put (const void* data, size_t size) {
+   const char* bytes = static_cast<const char*> (data);
+   while (size > 0) {
+      if (buffer.size() == BLOCK) spill();
+      size_t taken = min (size, BLOCK - buffer.size());
+      buffer.append (bytes, taken);
+      bytes += taken;
+      size -= taken;
+   }
+}
+
+void image_writer::align() {
+   static const char zeros[8] {};
+   put (zeros, -offset() & 7);
+}
+
+void image_writer::close() {
+   spill();
+   out.close();
+   if (not out) throw file_error (filename + ": write failed");
+   sync_path (partial, 0);
+   if (rename (partial.c_str(), filename.c_str()) != 0) {
+      throw file_error (filename + ": " + strerror (errno));
+   }
+   closed = true;
+   size_t slash = filename.rfind ('/');
+   sync_path (slash == string::npos ? string (".")
+              : slash == 0 ? string ("/") : filename.substr (0, slash),
+              O_DIRECTORY);
+   DEBUGF ('m', filename << ": " << flushed << " bytes");
+}
+
+image_reader::image_reader (const string& filename_):
+              filename (filename_), in (filename_, ios::binary) {
+   if (not in) throw file_error (filename + ": cannot open image");
+   in.seekg (0, ios::end);
+   length = in.tellg();
+   in.seekg (0, ios::beg);
+   if (not in) throw file_error (filename + ": cannot open image");
+   string_view magic = get (sizeof IMAGE_MAGIC);
+   if (magic != string_view (IMAGE_MAGIC, sizeof IMAGE_MAGIC)) {
+      corrupt ("not an image");
+   }
+}
+
+void image_reader::corrupt (const string& why) {
+   throw file_error (filename + ": " + why);
+}
+
+// fill -
+//    Makes at least wanted bytes available from pos, keeping the
+//    unread ones and reading a block beyond them.
+bool image_reader::fill (size_t wanted) {
+   buffer.erase (0, pos);
+   consumed += pos;
+   pos = 0;
+   size_t have = buffer.size();
+   buffer.resize (max (wanted, have + BLOCK));
+   in.read (buffer.data() + have, buffer.size() - have);
+   buffer.resize (have + in.gcount());
+   return buffer.size() >= wanted;
+}
+
+// A size read from a corrupt record may be anything, so it is checked
+// against what is left of the file before any buffer is grown to it.
+string_view image_reader::get (size_t size) {
+   if (size > length - offset()) corrupt ("truncated image");
+   if (buffer.size() - pos < size and not fill (size)) {
+      corrupt ("truncated image");
+   }
+   string_view bytes (buffer.data() + pos, size);
+   pos += size;
+   return bytes;
+}
+
+void image_reader::align() {
+   get (-offset() & 7);
+}
+
+mapped_image::mapped_image (const string& filename_):
+              filename (filename_) {
+   int fd = open (filename.c_str(), O_RDONLY);
+   if (fd < 0) throw file_error (filename + ": cannot open image");
+   struct stat status;
+   if (fstat (fd, &status) < 0) {
+      close (fd);
+      throw file_error (filename + ": cannot open image");
+   }
+   length = status.st_size;
+   if (length < sizeof IMAGE_MAGIC + sizeof (image_trailer)) {
+      close (fd);
+      corrupt ("not an image");
+   }
+   void* mapping = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+   close (fd);
+   if (mapping == MAP_FAILED) throw file_error (filename + ": cannot map image");
+   base = static_cast<const char*> (mapping);
+
+   image_trailer trailer;
+   memcpy (&trailer, base + length - sizeof trailer, sizeof trailer);
+   if (memcmp (base, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+       or memcmp (trailer.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+       or trailer.kind != IMAGE_END) {
+      munmap (const_cast<char*> (base), length);
+      corrupt ("not an image");
+   }
+   root_offset = trailer.root;
+   DEBUGF ('m', filename << ": mapped " << length << " bytes");
+}
+
+mapped_image::~mapped_image() {
+   munmap (const_cast<char*> (base), length);
+}
+
+void mapped_image::corrupt (const string& why) const {
+   throw file_error (filename + ": " + why);
+}
+
+void mapped_image::check (uint64_t offset, uint64_t size) const {
+   if (offset > length or size > length - offset) {
+      corrupt ("record out of range at offset " + to_string (offset));
+   }
+}
+
+image_node mapped_image::node (uint64_t offset) const {
+   image_node record;
+   check (offset, sizeof record);
+   memcpy (&record, base + offset, sizeof record);
+   if (record.kind != IMAGE_FILE and record.kind != IMAGE_DIR) {
+      corrupt ("bad record at offset " + to_string (offset));
+   }
+   return record;
+}
+
+image_dirent mapped_image::dirent (uint64_t dir, uint64_t i) const {
+   image_dirent entry;
+   uint64_t offset = dir + sizeof (image_node) + i * sizeof entry;
+   check (offset, sizeof entry);
+   memcpy (&entry, base + offset, sizeof entry);
+   if (entry.node >= dir) {
+      corrupt ("entry out of order at offset " + to_string (offset));
+   }
+   return entry;
+}
+
+// The names follow the last dirent of the record.
+string_view mapped_image::name (uint64_t dir,
+                                const image_dirent& entry) const {
+   uint64_t names = dir + sizeof (image_node)
+                  + node (dir).size * sizeof (image_dirent);
+   check (names, 0);
+   check (names + entry.name, entry.name_length);
+   return string_view (base + names + entry.name, entry.name_length);
+}
+
+string_view mapped_image::contents (uint64_t file) const {
+   uint64_t size = node (file).size;
+   check (file + sizeof (image_node), size);
+   return string_view (base + file + sizeof (image_node), size);
+}
+
+uint64_t mapped_image::find (uint64_t dir, string_view key) const {
+   uint64_t count = node (dir).size;
+   uint64_t low = 0;
+   uint64_t high = count;
+   while (low < high) {
+      uint64_t middle = low + (high - low) / 2;
+      if (name (dir, dirent (dir, middle)) < key) low = middle + 1;
+                                             else high = middle;
+   }
+   if (low < count and name (dir, dirent (dir, low)) == key) return low;
+   return count;
+}
+
+void sync_path (const string& filename, int flags) {
+   int fd = open (filename.c_str(), O_RDONLY | flags);
+   if (fd < 0 or fsync (fd) != 0) {
+      string why = strerror (errno);
+      if (fd >= 0) close (fd);
+      throw file_error (filename + ": " + why);
+   }
+   close (fd);
+}
+
+// identify_image -
+//    Multiply and rotate over the file eight bytes at a time, a block
+//    at a time; blocks are a multiple of eight bytes, so only the last
+//    has a tail.  A saved image is hashed once when a journal is
+//    started from it and once when the journal is recovered.
+image_identity identify_image (const string& filename) {
+   constexpr size_t BLOCK {1 << 20};
+   constexpr uint64_t PRIME1 {0x9E3779B185EBCA87ULL};
+   constexpr uint64_t PRIME2 {0xC2B2AE3D27D4EB4FULL};
+   auto rotl = [] (uint64_t word, int bits) {
+      return word << bits | word >> (64 - bits);
+   };
+   ifstream in (filename, ios::binary);
+   if (not in) throw file_error (filename + ": cannot open image");
+   image_identity identity;
+   uint64_t hash = PRIME1;
+   string buffer (BLOCK, '\0');
+   for (;;) {
+      in.read (buffer.data(), BLOCK);
+      size_t got = in.gcount();
+      const char* at = buffer.data();
+      const char* end = at + got;
+      for (; end - at >= 8; at += 8) {
+         uint64_t word;
+         memcpy (&word, at, sizeof word);
+         hash = rotl (hash ^ word * PRIME2, 31) * PRIME1;
+      }
+      for (; at < end; ++at) {
+         hash = rotl (hash ^ uint8_t (*at) * PRIME2, 11) * PRIME1;
+      }
+      identity.length += got;
+      if (got < BLOCK) break;
+   }
+   if (in.bad()) throw file_error (filename + ": cannot read image");
+   hash ^= identity.length * PRIME2;
+   hash ^= hash >> 33;
+   identity.checksum = hash * PRIME1;
+   return identity;
+}
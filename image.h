@@ -0,0 +1,175 @@
+// $Id: image.h,v 1.2 2016-01-14 16:16:52-08 - - $
+
+// Tree images -
+//    A binary copy of the live tree, for save and load.  The image is
+//    written in one sequential pass, children before their parents,
+//    so every offset a record needs is already known when it is
+//    written and nothing is ever patched.  All fields are fixed width
+//    in host byte order, and records start on 8-byte boundaries.
+//
+//       "YSHIMG02"                      magic
+//       records, each one of:
+//          image_node {IMAGE_FILE, inode_nr, length}
+//             then length bytes of contents
+//          image_node {IMAGE_DIR, inode_nr, entry count}
+//             then one image_dirent per entry, sorted by name,
+//             then the names, back to back
+//       image_trailer                   last 40 bytes of the file
+//
+//    Offsets are from the start of the file, and a dirent's name
+//    offset is from the start of its record's names.  Loading only
+//    needs to read the records in order: those of a directory's
+//    entries are exactly the last subtrees completed before its own.
+// image_writer -
+//    Buffers records and writes them out a large block at a time, to
+//    filename.tmp, which close syncs and only then renames over
+//    filename, syncing the directory after, so that a crash leaves
+//    either the old image or the new one whole.  One that is never
+//    closed, because writing it failed part way, is removed again,
+//    and whatever was at filename is left.
+// image_reader -
+//    Reads an image front to back, through a buffer of the same
+//    size.  The view get returns is only good until the next get.
+//    Throws file_error if the file is short or malformed.
+// mapped_image -
+//    An image mapped read-only into memory and read in place, so
+//    that opening it costs the same whatever its size and only the
+//    pages actually looked at are read in.  Every access is checked
+//    against the size of the file, and throws file_error if a record
+//    reaches outside it.
+// node, dirent -
+//    The record at an offset, and entry i of a directory record.
+//    Children are written before their parents, so every entry must
+//    lead to a lower offset than the directory holding it; one that
+//    does not could make a walk go round forever, and is corrupt.
+// name, contents -
+//    Views of an entry's name and of a file's bytes, valid as long as
+//    the mapping.
+// find -
+//    Binary search of a directory's sorted names; returns the entry
+//    index, or the entry count if there is no such name.
+// sync_path -
+//    Makes a file, or the entries of a directory, durable.
+// image_identity -
+//    The length of an image file and a checksum of all its bytes, by
+//    which a journal knows the image it was written against.  Throws
+//    file_error if the file cannot be read.
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+using namespace std;
+
+// Version 2 widened inode numbers to 64 bits.
+constexpr char IMAGE_MAGIC[8] {'Y','S','H','I','M','G','0','2'};
+enum image_kind: uint32_t {IMAGE_FILE = 1, IMAGE_DIR = 2, IMAGE_END = 3};
+
+struct image_node {
+   uint32_t kind;
+   uint32_t unused;
+   uint64_t inode_nr;
+   uint64_t size;
+};
+
+struct image_dirent {
+   uint64_t node;
+   uint32_t name;
+   uint32_t name_length;
+};
+
+// The first half reads as an image_node of kind IMAGE_END.
+struct image_trailer {
+   uint32_t kind;
+   uint32_t unused;
+   uint64_t next_inode_nr;
+   uint64_t nodes;
+   uint64_t root;
+   char magic[8];
+};
+
+class image_writer {
+   private:
+      static constexpr size_t BLOCK {1 << 20};
+      string filename;
+      string partial;
+      ofstream out;
+      string buffer;
+      uint64_t flushed {0};
+      bool closed {false};
+      void spill();
+   public:
+      explicit image_writer (const string& filename);
+      ~image_writer();
+      image_writer (const image_writer&) = delete;
+      image_writer& operator= (const image_writer&) = delete;
+      uint64_t offset() const { return flushed + buffer.size(); }
+      void put (const void* data, size_t size);
+      template <typename record_t>
+      void put (const record_t& record) { put (&record, sizeof record); }
+      void align();
+      void close();
+};
+
+class image_reader {
+   private:
+      static constexpr size_t BLOCK {1 << 20};
+      string filename;
+      ifstream in;
+      string buffer;
+      size_t pos {0};
+      uint64_t consumed {0};
+      uint64_t length {0};
+      bool fill (size_t wanted);
+   public:
+      explicit image_reader (const string& filename);
+      [[noreturn]] void corrupt (const string& why);
+      uint64_t offset() const { return consumed + pos; }
+      string_view get (size_t size);
+      template <typename record_t>
+      record_t get() {
+         record_t record;
+         memcpy (&record, get (sizeof record).data(), sizeof record);
+         return record;
+      }
+      void align();
+};
+
+class mapped_image {
+   private:
+      string filename;
+      const char* base {nullptr};
+      size_t length {0};
+      uint64_t root_offset {0};
+      void check (uint64_t offset, uint64_t size) const;
+   public:
+      explicit mapped_image (const string& filename);
+      ~mapped_image();
+      mapped_image (const mapped_image&) = delete;
+      mapped_image& operator= (const mapped_image&) = delete;
+      [[noreturn]] void corrupt (const string& why) const;
+      uint64_t root() const { return root_offset; }
+      image_node node (uint64_t offset) const;
+      image_dirent dirent (uint64_t dir, uint64_t i) const;
+      string_view name (uint64_t dir, const image_dirent& entry) const;
+      string_view contents (uint64_t file) const;
+      uint64_t find (uint64_t dir, string_view name) const;
+};
+
+void sync_path (const string& filename, int flags);
+
+struct image_identity {
+   uint64_t length {0};
+   uint64_t checksum {0};
+   bool operator== (const image_identity& that) const {
+      return length == that.length and checksum == that.checksum;
+   }
+};
+image_identity identify_image (const string& filename);
+
+#endif
+
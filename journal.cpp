@@ -0,0 +1,255 @@
+// $Id: journal.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "file_sys.h"
+#include "journal.h"
+#include "util.h"
+
+// checksum -
+//    FNV-1a over a record's fields, with the checksum itself zero,
+//    and then over its path and data.
+static uint32_t checksum (journal_record record, string_view path,
+                          string_view data) {
+   record.checksum = 0;
+   uint32_t hash = 2166136261u;
+   auto mix = [&hash] (const void* bytes, size_t size) {
+      const unsigned char* byte = static_cast<const unsigned char*> (bytes);
+      for (size_t i = 0; i < size; ++i) {
+         hash ^= byte[i];
+         hash *= 16777619u;
+      }
+   };
+   mix (&record, sizeof record);
+   mix (path.data(), path.size());
+   mix (data.data(), data.size());
+   return hash;
+}
+
+journal::journal (const string& filename_, group_commit policy_,
+                  size_t valid_length):
+                  filename (filename_), policy (policy_) {
+   if (policy.records == 0) policy.records = 1;
+   if (valid_length == 0) {
+      checkpoint (BASE_EMPTY, "");
+      return;
+   }
+   // Anything past the intact prefix is a torn record; new records
+   // go where it started.
+   fd = open (filename.c_str(), O_WRONLY | O_APPEND);
+   if (fd < 0 or ftruncate (fd, valid_length) != 0) {
+      throw file_error (filename + ": " + strerror (errno));
+   }
+}
+
+journal::~journal() {
+   {
+      lock_guard<mutex> guard (lock);
+      stopping = true;
+   }
+   wake.notify_one();
+   if (flusher.joinable()) flusher.join();
+   try {
+      flush();
+   }catch (file_error& error) {
+      complain() << error.what() << endl;
+   }
+   if (fd >= 0) close (fd);
+}
+
+void journal::write_out (const string& bytes) {
+   const char* next = bytes.data();
+   size_t left = bytes.size();
+   while (left > 0) {
+      ssize_t written = write (fd, next, left);
+      if (written < 0 and errno == EINTR) continue;
+      if (written < 0) throw file_error (filename + ": " + strerror (errno));
+      next += written;
+      left -= written;
+   }
+   if (fdatasync (fd) != 0) {
+      throw file_error (filename + ": " + strerror (errno));
+   }
+}
+
+void journal::record (journal_op op, string_view path, string_view data) {
+   if (append (op, path, data)) flush();
+}
+bool journal::append (journal_op op, string_view path, string_view data) {
+   journal_record header {op, uint32_t (path.size()),
+                          uint32_t (data.size()), 0};
+   header.checksum = checksum (header, path, data);
+   bool full = false;
+   {
+      lock_guard<mutex> guard (lock);
+      if (not failure.empty()) {
+         string why = move (failure);
+         failure.clear();
+         throw file_error (why);
+      }
+      batch.append (reinterpret_cast<const char*> (&header), sizeof header);
+      batch.append (path);
+      batch.append (data);
+      ++records_;
+      full = ++pending >= policy.records;
+      if (pending == 1 and not full and policy.wait.count() > 0) {
+         oldest = chrono::steady_clock::now();
+         if (not flusher.joinable()) flusher = thread (&journal::run, this);
+         wake.notify_one();
+      }
+   }
+   return full;
+}
+
+// flush -
+//    The batch is swapped out under the lock and written outside it,
+//    so that recording the next batch never waits for a sync.
+void journal::flush() {
+   lock_guard<mutex> io (io_lock);
+   {
+      lock_guard<mutex> guard (lock);
+      batch.swap (spare);
+      pending = 0;
+   }
+   if (spare.empty()) return;
+   write_out (spare);
+   spare.clear();
+   ++syncs_;
+}
+
+// run -
+//    Waits for the first record of a batch, then for it to have waited
+//    long enough, and syncs whatever has built up by then.
+void journal::run() {
+   unique_lock<mutex> guard (lock);
+   for (;;) {
+      wake.wait (guard, [this] { return stopping or pending > 0; });
+      if (stopping) return;
+      auto deadline = oldest + policy.wait;
+      if (wake.wait_until (guard, deadline, [this] { return stopping; })) {
+         return;
+      }
+      guard.unlock();
+      try {
+         flush();
+         guard.lock();
+      }catch (file_error& error) {
+         guard.lock();
+         failure = error.what();
+      }
+   }
+}
+
+// checkpoint -
+//    The new journal is written beside the old one and renamed over
+//    it, so a crash leaves one or the other whole.
+void journal::checkpoint (journal_base base, const string& image) {
+   string imagePath;
+   image_identity identity;
+   if (base != BASE_EMPTY) {
+      sync_path (image, 0);
+      imagePath = filesystem::absolute (image).string();
+      identity = identify_image (image);
+   }
+   if (fd >= 0) flush();
+   lock_guard<mutex> io (io_lock);
+
+   string fresh = filename + ".new";
+   int newfd = open (fresh.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                     0666);
+   if (newfd < 0) throw file_error (fresh + ": " + strerror (errno));
+   journal_header header {{}, base, uint32_t (imagePath.size()),
+                          identity.length, identity.checksum};
+   memcpy (header.magic, JOURNAL_MAGIC, sizeof header.magic);
+   string bytes (reinterpret_cast<const char*> (&header), sizeof header);
+   bytes += imagePath;
+   swap (fd, newfd);
+   try {
+      write_out (bytes);
+   }catch (file_error&) {
+      swap (fd, newfd);
+      close (newfd);
+      throw;
+   }
+   if (rename (fresh.c_str(), filename.c_str()) != 0) {
+      string why = strerror (errno);
+      swap (fd, newfd);
+      close (newfd);
+      throw file_error (filename + ": " + why);
+   }
+   if (newfd >= 0) close (newfd);
+   string dir = filesystem::path (filename).parent_path().string();
+   sync_path (dir.empty() ? "." : dir, O_DIRECTORY);
+   DEBUGF ('J', filename << ": checkpoint at " << (base == BASE_EMPTY
+           ? string ("empty tree") : imagePath));
+}
+
+size_t journal::records() {
+   lock_guard<mutex> guard (lock);
+   return records_;
+}
+
+size_t journal::syncs() {
+   lock_guard<mutex> io (io_lock);
+   return syncs_;
+}
+
+journal_reader::journal_reader (const string& filename_):
+                filename (filename_) {
+   ifstream in (filename, ios::binary);
+   if (not in) {
+      if (access (filename.c_str(), F_OK) != 0 and errno == ENOENT) return;
+      throw file_error (filename + ": cannot read journal");
+   }
+   exists_ = true;
+   in.seekg (0, ios::end);
+   bytes.resize (in.tellg());
+   in.seekg (0);
+   in.read (bytes.data(), bytes.size());
+   if (not in) throw file_error (filename + ": cannot read journal");
+
+   journal_header header;
+   if (bytes.size() < sizeof header) {
+      throw file_error (filename + ": not a journal");
+   }
+   memcpy (&header, bytes.data(), sizeof header);
+   if (memcmp (header.magic, JOURNAL_MAGIC, sizeof header.magic) != 0
+       or header.base > BASE_MOUNT
+       or bytes.size() - sizeof header < header.image_length) {
+      throw file_error (filename + ": not a journal");
+   }
+   base_ = journal_base (header.base);
+   image_ = bytes.substr (sizeof header, header.image_length);
+   identity_ = {header.image_size, header.image_checksum};
+   next_ = valid_ = sizeof header + header.image_length;
+}
+
+bool journal_reader::next (journal_entry& entry) {
+   journal_record record;
+   if (bytes.size() - next_ < sizeof record) return false;
+   memcpy (&record, bytes.data() + next_, sizeof record);
+   size_t start = next_ + sizeof record;
+   if (bytes.size() - start < uint64_t (record.path_length)
+                              + record.data_length) {
+      return false;
+   }
+   string_view path (bytes.data() + start, record.path_length);
+   string_view data (bytes.data() + start + path.size(), record.data_length);
+   if (record.checksum != checksum (record, path, data)
+       or record.op < JOURNAL_MKDIR or record.op > JOURNAL_MOUNT) {
+      return false;
+   }
+   entry = {journal_op (record.op), path, data};
+   next_ = valid_ = start + path.size() + data.size();
+   return true;
+}
+
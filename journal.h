@@ -0,0 +1,162 @@
+// $Id: journal.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// Mutation journal -
+//    An append-only log of every change made to the live tree since
+//    it was last saved or loaded, so that a crash loses at most the
+//    changes not yet synced.  The journal names the image the tree
+//    started from, and recovery loads that image and replays the
+//    records over it.  All fields are fixed width in host byte order.
+//
+//       journal_header {magic, base, image length, image identity}
+//          then the image filename, or nothing for an empty tree
+//       records, each one of:
+//          journal_record {op, path length, data length, checksum}
+//             then the path, then the data
+//
+//    Paths are absolute.  The checksum covers the record's fields and
+//    bytes, so a record torn by a crash in mid-write is recognized and
+//    dropped, along with anything after it.  The header holds the
+//    length and checksum of the image as it was when the journal was
+//    started from it, and recovery refuses to replay the records over
+//    an image that no longer matches it, such as one saved over it by
+//    a save that crashed before its checkpoint.
+// group_commit -
+//    When to sync: once records have built up, or once the oldest of
+//    them has waited that long, whichever comes first.  A wait of zero
+//    syncs on the count alone.  With records = 1 every change is
+//    durable before its command returns.
+// journal -
+//    Appends records to the journal file.  Records are buffered and
+//    written and synced as a batch, by the caller that completes a
+//    batch or by a flusher thread when the wait runs out.  A failure
+//    on the flusher thread is reported by the next record.
+// record -
+//    Adds a change to the current batch, and flushes the batch if that
+//    completes it.
+// append -
+//    Adds a change to the current batch, returning whether that
+//    completes it, so that a caller ordering its records under a lock
+//    of its own can flush after letting go of it, and callers that
+//    complete batches together share one sync.
+// flush -
+//    Writes and syncs everything recorded so far.
+// checkpoint -
+//    Starts the journal over from the given image, once that image is
+//    safely on disk.  The old journal is replaced atomically.
+// journal_reader -
+//    Reads a journal back for recovery.  A missing journal reads as
+//    one that does not exist; a malformed header throws file_error.
+// next -
+//    The next intact record, whose views are valid as long as the
+//    reader, or false at the end or at a torn record.
+// valid_length -
+//    The length of the intact prefix of the file, which is where new
+//    records are to be appended.
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+using namespace std;
+
+#include "image.h"
+
+// Version 2 added the identity of the image.
+constexpr char JOURNAL_MAGIC[8] {'Y','S','H','J','N','L','0','2'};
+
+enum journal_op: uint32_t {
+   JOURNAL_MKDIR = 1, JOURNAL_MAKE, JOURNAL_APPEND, JOURNAL_RM,
+   JOURNAL_RMR, JOURNAL_SNAPSHOT, JOURNAL_MOUNT,
+};
+enum journal_base: uint32_t {BASE_EMPTY, BASE_LOAD, BASE_MOUNT};
+
+struct journal_header {
+   char magic[8];
+   uint32_t base;
+   uint32_t image_length;
+   uint64_t image_size;
+   uint64_t image_checksum;
+};
+
+struct journal_record {
+   uint32_t op;
+   uint32_t path_length;
+   uint32_t data_length;
+   uint32_t checksum;
+};
+
+struct journal_entry {
+   journal_op op;
+   string_view path;
+   string_view data;
+};
+
+struct group_commit {
+   size_t records {1};
+   chrono::milliseconds wait {0};
+};
+
+class journal {
+   private:
+      string filename;
+      group_commit policy;
+      int fd {-1};
+      mutex lock;              // guards the fields below
+      condition_variable wake;
+      string batch;
+      size_t pending {0};
+      bool stopping {false};
+      string failure;
+      chrono::steady_clock::time_point oldest;
+      mutex io_lock;           // keeps batches in order on disk
+      string spare;
+      size_t records_ {0};
+      size_t syncs_ {0};
+      thread flusher;
+      void run();
+      void write_out (const string& bytes);
+   public:
+      journal (const string& filename, group_commit policy,
+               size_t valid_length);
+      ~journal();
+      journal (const journal&) = delete;
+      journal& operator= (const journal&) = delete;
+      void record (journal_op op, string_view path,
+                   string_view data = {});
+      bool append (journal_op op, string_view path,
+                   string_view data = {});
+      void flush();
+      void checkpoint (journal_base base, const string& image);
+      size_t records();
+      size_t syncs();
+};
+
+class journal_reader {
+   private:
+      string filename;
+      string bytes;
+      bool exists_ {false};
+      journal_base base_ {BASE_EMPTY};
+      string image_;
+      image_identity identity_;
+      size_t next_ {0};
+      size_t valid_ {0};
+   public:
+      explicit journal_reader (const string& filename);
+      bool exists() const { return exists_; }
+      journal_base base() const { return base_; }
+      const string& image() const { return image_; }
+      const image_identity& identity() const { return identity_; }
+      bool next (journal_entry& entry);
+      size_t valid_length() const { return valid_; }
+      size_t torn_bytes() const { return bytes.size() - valid_; }
+};
+
+#endif
+
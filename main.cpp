@@ -1,9 +1,16 @@
 // $Id: main.cpp,v 1.9 2016-01-14 16:16:52-08 - - $
 
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <utility>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 using namespace std;
@@ -11,20 +18,87 @@ using namespace std;
 #include "commands.h"
 #include "debug.h"
 #include "file_sys.h"
+#include "server.h"
 #include "util.h"
 
+// options -
+//    Settings from the command line that main applies once the
+//    inode_state exists.
+
+struct options {
+   bool background_reclaim {false};
+   size_t promote {0};
+   size_t demote {0};
+   string image;
+   bool mapped {false};
+   string journal;
+   group_commit group;
+   string script;
+   bool echo {false};
+   string socket;
+};
+
 // scan_options
-//    Options analysis:  The only option is -Dflags. 
+//    Options analysis:  -@flags sets debug flags, -b frees subtrees
+//    removed by rmr on a background thread, and -l image starts from
+//    the tree saved in image instead of an empty one.  -m image
+//    instead serves that tree read-only, straight from the mapped
+//    image.  -J journal recovers the tree from journal and records
+//    every change in it; -g records and -t milliseconds set how many
+//    changes, or how long, a sync of the journal may wait for.
+//    -f script runs the commands in script instead of those on cin,
+//    with no prompt or echo unless -e asks for them.  -s socket
+//    serves the tree to clients on a UNIX domain socket instead,
+//    until interrupted.  -d promote,demote sets the sizes at which
+//    directories switch to a hash index and back.
 
-void scan_options (int argc, char** argv) {
+options scan_options (int argc, char** argv) {
+   options opts;
    opterr = 0;
    for (;;) {
-      int option = getopt (argc, argv, "@:");
+      int option = getopt (argc, argv, "@:bd:ef:g:J:l:m:s:t:");
       if (option == EOF) break;
       switch (option) {
          case '@':
             debugflags::setflags (optarg);
             break;
+         case 'b':
+            opts.background_reclaim = true;
+            break;
+         case 'd': {
+            char* comma = nullptr;
+            opts.promote = strtoul (optarg, &comma, 10);
+            opts.demote = *comma == ',' ? strtoul (comma + 1, nullptr, 10)
+                                        : opts.promote / 2;
+            break;
+         }
+         case 'e':
+            opts.echo = true;
+            break;
+         case 'f':
+            opts.script = optarg;
+            break;
+         case 'g':
+            opts.group.records = strtoul (optarg, nullptr, 10);
+            break;
+         case 'J':
+            opts.journal = optarg;
+            break;
+         case 's':
+            opts.socket = optarg;
+            break;
+         case 't':
+            opts.group.wait = chrono::milliseconds (
+                              strtoul (optarg, nullptr, 10));
+            break;
+         case 'l':
+            opts.image = optarg;
+            opts.mapped = false;
+            break;
+         case 'm':
+            opts.image = optarg;
+            opts.mapped = true;
+            break;
          default:
             complain() << "-" << static_cast<char> (option)
                        << ": invalid option" << endl;
@@ -34,55 +108,201 @@ void scan_options (int argc, char** argv) {
    if (optind < argc) {
       complain() << "operands not permitted" << endl;
    }
+   return opts;
 }
 
 
+// execute -
+//    Splits a line into words, looks up the command and runs it,
+//    printing any error it raises.  The word views are reused from
+//    one line to the next, so once their capacity has grown to fit
+//    the longest line, splitting allocates nothing.  A blank line is
+//    not a command.
+
+void execute (inode_state& state, string_view line, viewvec& words) {
+   try {
+      split (line, command_delimiters, words);
+      DEBUGF ('y', "words = " << words);
+      if (words.empty()) return;
+      command_fn fn = find_command_fn (words[0]);
+      fn (state, words);
+   }catch (command_error& error) {
+      // If there is a problem discovered in any function, an
+      // exn is thrown and printed here.
+      complain() << error.what() << endl;
+   }
+   catch (file_error& error)
+   {
+      complain() << error.what() <<endl;
+   }
+}
+
+// run_interactive -
+//    Reads commands from cin until end of file, prompting for each
+//    and echoing it if need be.
+
+void run_interactive (inode_state& state) {
+   bool need_echo = want_echo();
+   string line;
+   viewvec words;
+   for (;;) {
+      // Read a line, break at EOF, and echo print the prompt
+      // if one is needed.
+      cout << state.prompt();
+      getline (cin, line);
+      if (cin.eof()) {
+         if (need_echo) cout << "^D";
+         cout << endl;
+         DEBUGF ('y', "EOF");
+         break;
+      }
+      if (need_echo) cout << line << endl;
+      execute (state, line, words);
+   }
+}
+
+// run_batch -
+//    Runs every command in a script file.  The file is mapped and
+//    each line is split where it lies, and cout is held in a large
+//    buffer rather than flushed by every endl.  The rate is reported
+//    on cerr at the end.
+
+void run_batch (inode_state& state, const string& script, bool echo) {
+   constexpr size_t BATCH_BUFFER {1 << 20};
+   int fd = open (script.c_str(), O_RDONLY);
+   struct stat info;
+   if (fd < 0 or fstat (fd, &info) != 0) {
+      complain() << script << ": " << strerror (errno) << endl;
+      if (fd >= 0) close (fd);
+      return;
+   }
+   size_t size = info.st_size;
+   const char* text = nullptr;
+   if (size > 0) {
+      void* mapped = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+         complain() << script << ": " << strerror (errno) << endl;
+         close (fd);
+         return;
+      }
+      madvise (mapped, size, MADV_SEQUENTIAL);
+      text = static_cast<const char*> (mapped);
+   }
+   close (fd);
+
+   size_t commands = 0;
+   bool exited = false;
+   auto start = chrono::steady_clock::now();
+   {
+      batch_output output (cout, STDOUT_FILENO, BATCH_BUFFER);
+      viewvec words;
+      const char* end = text + size;
+      try {
+         for (const char* next = text; next < end; ) {
+            const char* newline = static_cast<const char*> (
+                                  memchr (next, '\n', end - next));
+            if (newline == nullptr) newline = end;
+            string_view line (next, newline - next);
+            next = newline + 1;
+            if (echo) cout << state.prompt() << line << endl;
+            ++commands;
+            execute (state, line, words);
+         }
+         if (echo) cout << state.prompt() << "^D" << endl;
+      }catch (ysh_exit&) {
+         exited = true;
+      }
+   }
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+   if (text != nullptr) munmap (const_cast<char*> (text), size);
+   cerr << execname() << ": " << commands << " commands in "
+        << elapsed.count() << " s, " << commands / elapsed.count()
+        << " commands/s" << endl;
+   if (exited) throw ysh_exit();
+}
+
+// run_server -
+//    Serves the tree on a socket until SIGINT or SIGTERM.
+
+static server* serving {nullptr};
+
+extern "C" void stop_serving (int) {
+   if (serving != nullptr) serving->stop();
+}
+
+void run_server (inode_state& state, const string& socket) {
+   unique_ptr<server> listener;
+   try {
+      listener = make_unique<server> (state.sharedTree(), socket);
+   }catch (file_error& error) {
+      complain() << error.what() << endl;
+      return;
+   }
+   serving = listener.get();
+   struct sigaction action {};
+   action.sa_handler = stop_serving;
+   sigaction (SIGINT, &action, nullptr);
+   sigaction (SIGTERM, &action, nullptr);
+   try {
+      listener->run();
+   }catch (file_error& error) {
+      complain() << error.what() << endl;
+   }
+   serving = nullptr;
+}
+
 // main -
-//    Main program which loops reading commands until end of file.
+//    Main program which runs commands from cin, or from a script,
+//    until end of file, or serves them to clients.
 
 int main (int argc, char** argv) {
    execname (argv[0]);
    cout << boolalpha;  // Print false or true instead of 0 or 1.
    cerr << boolalpha;
    cout << argv[0] << " build " << __DATE__ << " " << __TIME__ << endl;
-   scan_options (argc, argv);
-   bool need_echo = want_echo();
+   options opts = scan_options (argc, argv);
+   // Every table consults the thresholds, so they are set before the
+   // first one, the root's, is made, and never again.
+   if (opts.promote != 0) {
+      try {
+         dirent_table::set_thresholds (opts.promote, opts.demote);
+      }catch (invalid_argument& error) {
+         complain() << error.what() << endl;
+      }
+   }
    inode_state state;
-   try {
-      for (;;) {
-         try {
-            // Read a line, break at EOF, and echo print the prompt
-            // if one is needed.
-            cout << state.prompt();
-            string line;
-            getline (cin, line);
-            if (cin.eof()) {
-               if (need_echo) cout << "^D";
-               cout << endl;
-               DEBUGF ('y', "EOF");
-               break;
-            }
-            if (need_echo) cout << line << endl;
-   
-            // Split the line into words and lookup the appropriate
-            // function.  Complain or call it.
-            wordvec words = split (line, " \t");
-            DEBUGF ('y', "words = " << words);
-            command_fn fn = find_command_fn (words.at(0));
-            fn (state, words);
-         }catch (command_error& error) {
-            // If there is a problem discovered in any function, an
-            // exn is thrown and printed here.
-            complain() << error.what() << endl;
-         }
-         catch (file_error& error)
-         {
-            complain() << error.what() <<endl;
-         }
+   state.setBackgroundReclaim (opts.background_reclaim);
+   bool recovered = false;
+   if (not opts.journal.empty()) {
+      // Carrying on without the journal asked for would lose changes
+      // the user expects to be kept.
+      try {
+         recovered = state.openJournal (opts.journal, opts.group);
+      }catch (file_error& error) {
+         complain() << error.what() << endl;
+         return exit_status_message();
       }
+   }
+   if (recovered and not opts.image.empty()) {
+      complain() << opts.image << ": ignored, tree recovered from "
+                 << opts.journal << endl;
+   }else if (not opts.image.empty()) {
+      try {
+         if (opts.mapped) state.mount (opts.image, "/");
+                     else state.load (opts.image);
+      }catch (file_error& error) {
+         complain() << error.what() << endl;
+      }
+   }
+   try {
+      if (not opts.socket.empty()) run_server (state, opts.socket);
+      else if (opts.script.empty()) run_interactive (state);
+      else run_batch (state, opts.script, opts.echo);
    } catch (ysh_exit&) {
       // This catch intentionally left blank.
    }
+   state.drainReclaim();
+   DEBUGF ('y', state);
 
    return exit_status_message();
 }
@@ -0,0 +1,171 @@
+// $Id: names.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+#include "arena.h"
+#include "debug.h"
+#include "names.h"
+
+// pool -
+//    Every record, by hash, each shard an open-addressing table kept
+//    at most half full, so that interning a new name allocates only
+//    its record.  A record whose count has dropped to zero stays
+//    listed, and may be found and taken up again, until the thread
+//    that dropped it takes the shard's lock to free it.
+struct name_ref::pool {
+   static constexpr size_t SHARDS {16};
+   struct shard {
+      mutex lock;
+      vector<record*> slots = vector<record*> (16);
+      size_t used {0};
+      size_t probe (size_t hash, string_view name) const;
+      void insert (record* held);
+      void erase (const record* held);
+   };
+   shard shards[SHARDS];
+   node_arena arena;
+   atomic<size_t> count {0};
+   // The low bits pick the slot, so the shard comes from the high.
+   shard& shard_of (size_t hash) { return shards[(hash >> 56) % SHARDS]; }
+   static pool& get() {
+      static pool* instance = new pool;   // names outlive main
+      return *instance;
+   }
+};
+
+// probe -
+//    The slot holding name, or the empty slot where it would go.
+size_t name_ref::pool::shard::probe (size_t hash, string_view name) const {
+   size_t mask = slots.size() - 1;
+   for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+      const record* found = slots[pos];
+      if (found == nullptr) return pos;
+      if (found->hash == hash
+          and string_view (found->bytes(), found->length) == name) {
+         return pos;
+      }
+   }
+}
+
+void name_ref::pool::shard::insert (record* held) {
+   if ((used + 1) * 2 > slots.size()) {
+      vector<record*> old (slots.size() * 2);
+      old.swap (slots);
+      size_t mask = slots.size() - 1;
+      for (record* moved: old) {
+         if (moved == nullptr) continue;
+         size_t pos = moved->hash & mask;
+         while (slots[pos] != nullptr) pos = (pos + 1) & mask;
+         slots[pos] = moved;
+      }
+   }
+   size_t mask = slots.size() - 1;
+   size_t pos = held->hash & mask;
+   while (slots[pos] != nullptr) pos = (pos + 1) & mask;
+   slots[pos] = held;
+   ++used;
+}
+
+// erase -
+//    Backward-shift deletion, as in dirent_table.
+void name_ref::pool::shard::erase (const record* held) {
+   size_t mask = slots.size() - 1;
+   size_t hole = held->hash & mask;
+   while (slots[hole] != held) hole = (hole + 1) & mask;
+   slots[hole] = nullptr;
+   --used;
+   for (size_t pos = (hole + 1) & mask; slots[pos] != nullptr;
+        pos = (pos + 1) & mask) {
+      size_t home = slots[pos]->hash & mask;
+      bool stays = hole <= pos ? hole < home and home <= pos
+                               : hole < home or home <= pos;
+      if (stays) continue;
+      slots[hole] = slots[pos];
+      slots[pos] = nullptr;
+      hole = pos;
+   }
+}
+
+name_ref::name_ref (string_view name):
+                    name_ref (name, std::hash<string_view>() (name)) {
+}
+
+name_ref::name_ref (string_view name, size_t hash) {
+   if (name.empty()) return;
+   pool& names = pool::get();
+   pool::shard& bucket = names.shard_of (hash);
+   lock_guard<mutex> guard (bucket.lock);
+   size_t pos = bucket.probe (hash, name);
+   if (bucket.slots[pos] != nullptr) {
+      held = bucket.slots[pos];
+      held->refs.fetch_add (1, memory_order_relaxed);
+      return;
+   }
+   char* block = static_cast<char*> (
+                 names.arena.allocate (sizeof (record) + name.size()));
+   memcpy (block + sizeof (record), name.data(), name.size());
+   held = new (block) record {{1}, uint32_t (name.size()), hash};
+   bucket.insert (held);
+   ++names.count;
+   DEBUGF ('n', "interned " << name);
+}
+
+name_ref::name_ref (const name_ref& that): held (that.held) {
+   if (held != nullptr) held->refs.fetch_add (1, memory_order_relaxed);
+}
+
+name_ref& name_ref::operator= (const name_ref& that) {
+   if (that.held != nullptr) {
+      that.held->refs.fetch_add (1, memory_order_relaxed);
+   }
+   release();
+   held = that.held;
+   return *this;
+}
+
+name_ref& name_ref::operator= (name_ref&& that) noexcept {
+   if (this != &that) {
+      release();
+      held = that.held;
+      that.held = nullptr;
+   }
+   return *this;
+}
+
+// The hash is read while the reference still keeps the record.  Once
+// it is dropped, the record may be taken up again, or freed by another
+// release, so it is only looked for among those still listed, and
+// freed if nothing has taken it up.
+void name_ref::release() {
+   if (held == nullptr) return;
+   record* dropped = held;
+   size_t hash = dropped->hash;
+   held = nullptr;
+   if (dropped->refs.fetch_sub (1, memory_order_acq_rel) != 1) return;
+   pool& names = pool::get();
+   pool::shard& bucket = names.shard_of (hash);
+   lock_guard<mutex> guard (bucket.lock);
+   size_t mask = bucket.slots.size() - 1;
+   for (size_t pos = hash & mask; bucket.slots[pos] != nullptr;
+        pos = (pos + 1) & mask) {
+      if (bucket.slots[pos] != dropped) continue;
+      if (dropped->refs.load (memory_order_acquire) == 0) {
+         bucket.erase (dropped);
+         --names.count;
+         names.arena.deallocate (dropped, sizeof (record)
+                                          + dropped->length);
+      }
+      return;
+   }
+}
+
+size_t name_ref::interned() {
+   return pool::get().count.load (memory_order_relaxed);
+}
+
@@ -0,0 +1,84 @@
+// $Id: names.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// name_ref -
+//    A directory entry name, interned: every distinct name is stored
+//    once, for the whole program, with its hash, in a record carved
+//    from an arena, and each entry or node holds a pointer to that
+//    record instead of a string of its own.  The same few names recur
+//    across a great many directories, so an entry costs a pointer
+//    rather than a string and its buffer.  The pointer identifies the
+//    name for as long as anything refers to it; a record counts its
+//    references and leaves the pool with the last of them.  Names are
+//    compared, and ordered for listings, by their bytes, exactly as
+//    strings are.  The pool is split into shards by hash, each with
+//    its own mutex, which only interning and the last release take.
+// ctor -
+//    Interns name, finding its record or making a new one, given its
+//    hash if the caller has it already.  The default is the empty
+//    name, and holds no record.
+// view -
+//    The bytes of the name, valid as long as this name_ref is.
+// hash -
+//    hash<string_view> of the name, computed once when interned.
+// interned -
+//    The number of distinct names in the pool, for benchmarks.
+
+#ifndef __NAMES_H__
+#define __NAMES_H__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+using namespace std;
+
+class name_ref {
+   private:
+      struct record {
+         atomic<uint32_t> refs;
+         uint32_t length;
+         size_t hash;
+         const char* bytes() const {
+            return reinterpret_cast<const char*> (this + 1);
+         }
+      };
+      struct pool;
+      record* held {nullptr};
+      void release();
+   public:
+      name_ref() = default;
+      explicit name_ref (string_view name);
+      name_ref (string_view name, size_t hash);
+      name_ref (const name_ref& that);
+      name_ref (name_ref&& that) noexcept: held (that.held) {
+         that.held = nullptr;
+      }
+      name_ref& operator= (const name_ref& that);
+      name_ref& operator= (name_ref&& that) noexcept;
+      ~name_ref() { release(); }
+      string_view view() const {
+         return held == nullptr ? string_view()
+                                : string_view (held->bytes(), held->length);
+      }
+      operator string_view() const { return view(); }
+      const char* data() const { return view().data(); }
+      size_t size() const { return held == nullptr ? 0 : held->length; }
+      size_t hash() const {
+         return held == nullptr ? std::hash<string_view>() (string_view())
+                                : held->hash;
+      }
+      static size_t interned();
+};
+
+inline bool operator== (const name_ref& a, string_view b) {
+   return a.view() == b;
+}
+inline bool operator!= (const name_ref& a, string_view b) {
+   return a.view() != b;
+}
+inline bool operator< (const name_ref& a, const name_ref& b) {
+   return a.view() < b.view();
+}
+
+#endif
+
@@ -0,0 +1,112 @@
+// $Id: rcu.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+#include "debug.h"
+#include "rcu.h"
+
+atomic<uint64_t> rcu::global_epoch {1};
+atomic<rcu::record*> rcu::records {nullptr};
+mutex rcu::retired_lock;
+vector<rcu::retired> rcu::pending;
+
+// owner -
+//    Claims a record for the thread, reusing one left by a thread that
+//    has exited, and gives it back when this thread exits in turn.
+//    Records are never freed, so a scan can always follow next.
+struct rcu::owner {
+   record* held {nullptr};
+   owner() {
+      for (record* next = records.load(); next != nullptr; next = next->next) {
+         bool in_use = false;
+         if (next->in_use.compare_exchange_strong (in_use, true)) {
+            held = next;
+            return;
+         }
+      }
+      held = new record;
+      held->next = records.load();
+      while (not records.compare_exchange_weak (held->next, held)) {}
+   }
+   ~owner() {
+      held->epoch = 0;
+      held->in_use = false;
+   }
+};
+
+rcu::record& rcu::mine() {
+   thread_local owner self;
+   return *self.held;
+}
+
+// A reader that read a stale epoch only holds back more than it must.
+// The fence orders its record before every pointer it loads, against
+// the fence a writer passes between unlinking and scanning.
+rcu::reader::reader(): self (mine()) {
+   if (self.depth++ == 0) {
+      self.epoch = global_epoch.load();
+      atomic_thread_fence (memory_order_seq_cst);
+   }
+}
+
+rcu::reader::~reader() {
+   if (--self.depth == 0) self.epoch.store (0, memory_order_release);
+}
+
+// oldest_reader -
+//    What was retired before this epoch is safe: no active reader
+//    entered before it was unlinked.
+uint64_t rcu::oldest_reader() {
+   uint64_t oldest = global_epoch.load();
+   atomic_thread_fence (memory_order_seq_cst);
+   for (record* next = records.load(); next != nullptr; next = next->next) {
+      uint64_t entered = next->epoch.load();
+      if (entered != 0 and entered < oldest) oldest = entered;
+   }
+   return oldest;
+}
+
+// collect -
+//    Runs what is safe outside the lock, since a release may retire
+//    something in turn.
+void rcu::collect() {
+   vector<retired> ready;
+   {
+      lock_guard<mutex> guard (retired_lock);
+      uint64_t oldest = oldest_reader();
+      auto unsafe = stable_partition (pending.begin(), pending.end(),
+                    [oldest] (const retired& item) {
+                       return item.epoch < oldest;
+                    });
+      move (pending.begin(), unsafe, back_inserter (ready));
+      pending.erase (pending.begin(), unsafe);
+   }
+   DEBUGF ('e', "releasing " << ready.size() << " retired");
+   for (auto& item: ready) item.release();
+}
+
+void rcu::retire (function<void()> release) {
+   uint64_t epoch = global_epoch.fetch_add (1);
+   bool full = false;
+   {
+      lock_guard<mutex> guard (retired_lock);
+      pending.push_back ({epoch, move (release)});
+      full = pending.size() >= BATCH;
+   }
+   if (full) collect();
+}
+
+void rcu::synchronize() {
+   uint64_t epoch = global_epoch.fetch_add (1);
+   while (oldest_reader() <= epoch) this_thread::yield();
+}
+
+void rcu::barrier() {
+   synchronize();
+   collect();
+}
+
@@ -0,0 +1,73 @@
+// $Id: rcu.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// rcu -
+//    Epoch-based reclamation, for data that readers follow without
+//    taking any lock.  A writer publishes a change with one atomic
+//    store, and instead of freeing what it replaced or unlinked, hands
+//    it to retire or waits in synchronize.  Either way it is freed only
+//    once every reader that might still hold a pointer to it is done.
+//    A global epoch counts retirements; each thread that reads has a
+//    record of the epoch it entered at, and what was retired in epoch
+//    e is safe once no reader entered at e or earlier is still active.
+// reader -
+//    Marks the span in which the calling thread may follow pointers
+//    that writers unlink concurrently.  Spans nest.  A reader must not
+//    block on anything a writer may hold while waiting in synchronize.
+// retire -
+//    Runs release once it is safe.  Retired work is batched, and run
+//    by whichever thread retires, or calls barrier, once enough has
+//    built up.
+// synchronize -
+//    Waits until every reader active when it was called has finished.
+//    Must not be called from within a reader.
+// barrier -
+//    Synchronizes, then runs everything retired so far.
+
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+class rcu {
+   private:
+      struct record {
+         atomic<uint64_t> epoch {0};      // 0 while quiescent
+         atomic<bool> in_use {true};
+         record* next {nullptr};
+         unsigned depth {0};
+      };
+      struct retired {
+         uint64_t epoch;
+         function<void()> release;
+      };
+      struct owner;
+      static constexpr size_t BATCH {64};
+      static atomic<uint64_t> global_epoch;
+      static atomic<record*> records;
+      static mutex retired_lock;
+      static vector<retired> pending;
+      static record& mine();
+      static uint64_t oldest_reader();
+      static void collect();
+   public:
+      class reader {
+         private:
+            record& self;
+         public:
+            reader();
+            ~reader();
+            reader (const reader&) = delete;
+            reader& operator= (const reader&) = delete;
+      };
+      static void retire (function<void()> release);
+      static void synchronize();
+      static void barrier();
+};
+
+#endif
+
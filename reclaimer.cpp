@@ -0,0 +1,67 @@
+// $Id: reclaimer.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <iostream>
+#include <system_error>
+
+using namespace std;
+
+#include "debug.h"
+#include "reclaimer.h"
+
+reclaimer::~reclaimer() {
+   if (not worker.joinable()) return;
+   {
+      lock_guard<mutex> guard (lock);
+      stopping = true;
+   }
+   work.notify_one();
+   worker.join();
+}
+
+// The thread is started before anything is queued for it: queued
+// with no thread to free it, a subtree would keep drain waiting
+// forever.  Without a thread the caller frees it instead.
+void reclaimer::defer (inode_ptr subtree) {
+   {
+      unique_lock<mutex> guard (lock);
+      if (not worker.joinable()) {
+         try {
+            worker = thread (&reclaimer::run, this);
+         }catch (system_error& error) {
+            guard.unlock();
+            DEBUGF ('r', "reclaiming inline: " << error.what());
+            subtree.reset();
+            return;
+         }
+      }
+      queue.push_back (move (subtree));
+   }
+   work.notify_one();
+}
+
+void reclaimer::drain() {
+   unique_lock<mutex> guard (lock);
+   idle.wait (guard, [this] { return queue.empty() and not busy; });
+}
+
+// run -
+//    Takes the whole queue at once and drops it outside the lock, so
+//    defer never waits for a teardown in progress.  The queue is
+//    finished before the thread stops.
+void reclaimer::run() {
+   unique_lock<mutex> guard (lock);
+   for (;;) {
+      work.wait (guard, [this] { return stopping or not queue.empty(); });
+      if (queue.empty()) return;
+      vector<inode_ptr> batch;
+      batch.swap (queue);
+      busy = true;
+      guard.unlock();
+      DEBUGF ('r', "reclaiming " << batch.size() << " subtrees");
+      batch.clear();
+      guard.lock();
+      busy = false;
+      if (queue.empty()) idle.notify_all();
+   }
+}
+
@@ -0,0 +1,49 @@
+// $Id: reclaimer.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// reclaimer -
+//    Frees detached subtrees on a background thread, so that rmr can
+//    return as soon as the subtree is unlinked.  The thread is started
+//    on the first defer; if it cannot be, that defer frees the subtree
+//    itself, and the next one tries again.  A subtree handed to defer must be
+//    unreachable from the live tree and from anything the caller may
+//    still look at, since its nodes are destroyed concurrently.
+// defer -
+//    Takes over the last reference to a detached subtree.
+// drain -
+//    Blocks until every deferred subtree has been freed.
+// The destructor drains and then stops the thread.
+
+#ifndef __RECLAIMER_H__
+#define __RECLAIMER_H__
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+class reclaimer {
+   private:
+      mutex lock;
+      condition_variable work;
+      condition_variable idle;
+      vector<inode_ptr> queue;
+      bool busy {false};
+      bool stopping {false};
+      thread worker;
+      void run();
+   public:
+      reclaimer() = default;
+      ~reclaimer();
+      reclaimer (const reclaimer&) = delete;
+      reclaimer& operator= (const reclaimer&) = delete;
+      void defer (inode_ptr subtree);
+      void drain();
+};
+
+#endif
+
@@ -0,0 +1,74 @@
+// $Id: rope.cpp,v 1.2 2016-01-14 16:16:52-08 - - $
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+#include "rcu.h"
+#include "rope.h"
+
+rope::~rope() {
+   atomic<char*>* table = chunks.load();
+   for (size_t i = 0; i < chunk_capacity; ++i) {
+      char* block = table[i].load();
+      if (block != first_bytes) delete[] block;
+   }
+   if (table != first_chunks) delete[] table;
+}
+
+// make_room -
+//    Returns chunk, with room for needed bytes, its first used bytes
+//    kept.  A chunk grows geometrically, but never past CHUNK_SIZE, so
+//    the copies made while it fills up are bounded by the bytes it
+//    finally holds.  Chunks are only ever added at the end, one at a
+//    time.
+char* rope::make_room (size_t chunk, size_t used, size_t needed) {
+   atomic<char*>* table = chunks.load (memory_order_relaxed);
+   if (chunk >= chunk_capacity) {
+      size_t capacity = 2 * chunk_capacity;
+      atomic<char*>* larger = new atomic<char*>[capacity];
+      for (size_t i = 0; i < capacity; ++i) {
+         larger[i].store (i < chunk_capacity
+                          ? table[i].load (memory_order_relaxed) : nullptr,
+                          memory_order_relaxed);
+      }
+      chunks.store (larger, memory_order_release);
+      if (table != first_chunks) rcu::retire ([table] { delete[] table; });
+      table = larger;
+      chunk_capacity = capacity;
+   }
+   if (used == 0) last_capacity = 0;
+   char* block = table[chunk].load (memory_order_relaxed);
+   if (needed <= last_capacity) return block;
+   if (block == nullptr and chunk == 0 and needed <= FIRST_SIZE) {
+      table[0].store (first_bytes, memory_order_release);
+      last_capacity = FIRST_SIZE;
+      return first_bytes;
+   }
+   size_t capacity = min (CHUNK_SIZE,
+                          max ({needed, 2 * last_capacity, FIRST_SIZE}));
+   char* larger = new char[capacity];
+   if (used > 0) memcpy (larger, block, used);
+   table[chunk].store (larger, memory_order_release);
+   if (block != nullptr and block != first_bytes) {
+      rcu::retire ([block] { delete[] block; });
+   }
+   last_capacity = capacity;
+   return larger;
+}
+
+void rope::append (string_view text) {
+   size_t length = bytes.load (memory_order_relaxed);
+   while (not text.empty()) {
+      size_t chunk = length / CHUNK_SIZE;
+      size_t used = length % CHUNK_SIZE;
+      size_t taken = min (CHUNK_SIZE - used, text.size());
+      char* block = make_room (chunk, used, used + taken);
+      memcpy (block + used, text.data(), taken);
+      text.remove_prefix (taken);
+      length += taken;
+   }
+   bytes.store (length, memory_order_release);
+}
+
@@ -0,0 +1,92 @@
+// $Id: rope.h,v 1.2 2016-01-14 16:16:52-08 - - $
+
+// rope -
+//    The bytes of a plain file, held as a table of chunks of at most
+//    CHUNK_SIZE bytes, chunk i holding the bytes from i * CHUNK_SIZE
+//    on.  Appending fills the last chunk and then starts new ones, so
+//    it costs time in proportion to the bytes appended, and a large
+//    file never needs one large buffer.  The bytes already in a rope
+//    never change, so it can be read while it is being appended to,
+//    without a lock, inside an rcu::reader: the length is published
+//    last, and a reader that takes the length first only ever reads
+//    bytes that were there before it.  A chunk that fills up, or the
+//    table when it runs out of room, is replaced by a larger copy, and
+//    the old one retired rather than freed.  The first chunk starts
+//    out, and the table stays until it holds more than FIRST_CHUNKS
+//    chunks, in the rope itself, so a small file costs no allocation
+//    beyond the rope.
+// append -
+//    Adds bytes at the end.  Only one thread may append at a time.
+// size -
+//    The number of bytes, kept up to date rather than summed.
+// for_each_chunk -
+//    Calls fn (string_view) on each non-empty chunk in order, up to
+//    limit bytes in all.
+// rope_view -
+//    The first length bytes of a rope.  Since appending never changes
+//    bytes already there, this is also the rope as it was when it was
+//    length bytes long.  It can also stand for a single slice of
+//    bytes held elsewhere, such as in a mapped image.
+
+#ifndef __ROPE_H__
+#define __ROPE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+using namespace std;
+
+class rope {
+   private:
+      static constexpr size_t CHUNK_SIZE {4096};
+      static constexpr size_t FIRST_SIZE {16};
+      static constexpr size_t FIRST_CHUNKS {4};
+      atomic<atomic<char*>*> chunks {first_chunks};
+      atomic<size_t> bytes {0};
+      size_t chunk_capacity {FIRST_CHUNKS};
+      size_t last_capacity {0};
+      atomic<char*> first_chunks[FIRST_CHUNKS] {};
+      char first_bytes[FIRST_SIZE];
+      char* make_room (size_t chunk, size_t used, size_t needed);
+   public:
+      rope() = default;
+      ~rope();
+      rope (const rope&) = delete;
+      rope& operator= (const rope&) = delete;
+      void append (string_view text);
+      size_t size() const { return bytes.load (memory_order_acquire); }
+      template <typename function>
+      void for_each_chunk (function fn, size_t limit = SIZE_MAX) const {
+         limit = min (limit, size());
+         if (limit == 0) return;
+         const atomic<char*>* table = chunks.load (memory_order_acquire);
+         for (size_t i = 0; limit > 0; ++i) {
+            size_t length = min (limit, CHUNK_SIZE);
+            fn (string_view (table[i].load (memory_order_acquire), length));
+            limit -= length;
+         }
+      }
+};
+
+class rope_view {
+   private:
+      const rope* body {nullptr};
+      string_view slice;
+      size_t length;
+   public:
+      rope_view (const rope& body_, size_t length_):
+                 body (&body_), length (length_) {}
+      explicit rope_view (string_view slice_):
+                 slice (slice_), length (slice_.size()) {}
+      size_t size() const { return length; }
+      template <typename function>
+      void for_each_chunk (function fn) const {
+         if (body != nullptr) body->for_each_chunk (fn, length);
+         else if (not slice.empty()) fn (slice);
+      }
+};
+
+#endif
+
@@ -0,0 +1,253 @@
+// $Id: server.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <shared_mutex>
+#include <streambuf>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "commands.h"
+#include "debug.h"
+#include "server.h"
+#include "util.h"
+
+server::server (shared_ptr<tree_state> tree_, const string& path_):
+                tree (move (tree_)), path (path_) {
+   sockaddr_un address {};
+   address.sun_family = AF_UNIX;
+   if (path.size() >= sizeof address.sun_path) {
+      throw file_error (path + ": socket path too long");
+   }
+   memcpy (address.sun_path, path.c_str(), path.size() + 1);
+   if (pipe2 (wakeup, O_CLOEXEC) != 0) {
+      throw file_error (string ("pipe: ") + strerror (errno));
+   }
+   listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   unlink (path.c_str());
+   if (listener < 0
+       or bind (listener, reinterpret_cast<sockaddr*> (&address),
+                sizeof address) != 0
+       or listen (listener, SOMAXCONN) != 0) {
+      string why = strerror (errno);
+      if (listener >= 0) close (listener);
+      close (wakeup[0]);
+      close (wakeup[1]);
+      throw file_error (path + ": " + why);
+   }
+   DEBUGF ('s', "listening on " << path);
+}
+
+server::~server() {
+   reap (true);
+   close (listener);
+   unlink (path.c_str());
+   close (wakeup[0]);
+   close (wakeup[1]);
+}
+
+void server::stop() {
+   char byte = 0;
+   if (write (wakeup[1], &byte, 1) < 0) return;
+}
+
+void server::run() {
+   for (;;) {
+      pollfd ready[2] {{listener, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+      if (poll (ready, 2, -1) < 0) {
+         if (errno == EINTR) continue;
+         throw file_error (string ("poll: ") + strerror (errno));
+      }
+      if (ready[1].revents != 0) break;
+      int fd = accept4 (listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) continue;
+      reap (false);
+      lock_guard<mutex> guard (lock);
+      connections.emplace_back();
+      connection& client = connections.back();
+      client.fd = fd;
+      // Without a thread to serve it, the connection is dropped, and
+      // the server goes on serving the others.
+      try {
+         client.session = thread (&server::serve, this, ref (client));
+      }catch (system_error& error) {
+         cerr << execname() << ": session on fd " << fd << ": "
+              << error.what() << endl;
+         connections.pop_back();
+         close (fd);
+         continue;
+      }
+      DEBUGF ('s', "session on fd " << fd << ", "
+              << connections.size() << " open");
+   }
+   reap (true);
+}
+
+// reap -
+//    Joins the sessions that have ended, or with all, ends every
+//    session first by shutting its socket down under it.  A socket is
+//    closed only here, once its session can no longer use it.
+void server::reap (bool all) {
+   lock_guard<mutex> guard (lock);
+   for (auto client = connections.begin(); client != connections.end(); ) {
+      if (all) shutdown (client->fd, SHUT_RDWR);
+      if (not all and not client->done) {
+         ++client;
+         continue;
+      }
+      client->session.join();
+      close (client->fd);
+      client = connections.erase (client);
+   }
+}
+
+// send_all -
+//    Writes all of text to a client, or returns false if it has gone.
+static bool send_all (int fd, string_view text) {
+   const char* next = text.data();
+   size_t left = text.size();
+   while (left > 0) {
+      ssize_t sent = send (fd, next, left, MSG_NOSIGNAL);
+      if (sent < 0 and errno == EINTR) continue;
+      if (sent <= 0) return false;
+      next += sent;
+      left -= sent;
+   }
+   return true;
+}
+
+// run_command -
+//    Runs one line for a session, holding the tree's lock as the
+//    command requires.  Errors go to the client, and do not touch the
+//    server's exit status.  Returns false if the session is to end:
+//    exit ends the session, not the server.
+static bool run_command (inode_state& session, string_view line,
+                         viewvec& words, ostream& out) {
+   try {
+      split (line, command_delimiters, words);
+      if (words.empty()) return true;
+      if (words[0] == "exit") return false;
+      const command_entry& command = find_command (words[0]);
+      shared_mutex& treeLock = session.sharedTree()->lock;
+      if (command.access == tree_access::WHOLE) {
+         unique_lock<shared_mutex> guard (treeLock);
+         command.fn (session, words);
+      }else {
+         shared_lock<shared_mutex> guard (treeLock);
+         command.fn (session, words);
+      }
+   }catch (command_error& error) {
+      out << execname() << ": " << error.what() << endl;
+   }catch (file_error& error) {
+      out << execname() << ": " << error.what() << endl;
+   }
+   return true;
+}
+
+// socket_output -
+//    A stream buffer that sends a session's output to its client a
+//    block at a time as it is written, so that the output of a
+//    command, however long, is never held whole.  Flushes, such as
+//    the one every endl does, are ignored; drain sends what is held,
+//    and returns false once the client has gone, after which the
+//    output is dropped.
+
+class socket_output: public streambuf {
+   private:
+      int fd;
+      bool gone {false};
+      vector<char> buffer;
+   protected:
+      virtual int_type overflow (int_type ch) override;
+      virtual int sync() override { return 0; }
+   public:
+      socket_output (int fd, size_t size);
+      bool drain();
+};
+
+socket_output::socket_output (int fd_, size_t size):
+               fd (fd_), buffer (size) {
+   setp (buffer.data(), buffer.data() + buffer.size());
+}
+socket_output::int_type socket_output::overflow (int_type ch) {
+   drain();
+   if (traits_type::eq_int_type (ch, traits_type::eof())) {
+      return traits_type::not_eof (ch);
+   }
+   *pptr() = traits_type::to_char_type (ch);
+   pbump (1);
+   return ch;
+}
+bool socket_output::drain() {
+   if (not gone) {
+      gone = not send_all (fd, string_view (pbase(), pptr() - pbase()));
+   }
+   setp (buffer.data(), buffer.data() + buffer.size());
+   return not gone;
+}
+
+// A client that sends no newline would have the session hold all it
+// sends, so a line may be at most MAX_LINE bytes, and the session ends
+// once more than that is pending.  Output goes back to the client
+// OUTPUT_BLOCK bytes at a time.
+constexpr size_t MAX_LINE {16 << 20};
+constexpr size_t OUTPUT_BLOCK {64 << 10};
+
+void server::serve (connection& client) {
+   socket_output sent (client.fd, OUTPUT_BLOCK);
+   ostream out (&sent);
+   inode_state session (tree);
+   session.setOutput (out);
+   viewvec words;
+   string pending;
+   char buffer[4096];
+
+   auto reply = [&] {
+      out << session.prompt();
+      return sent.drain();
+   };
+
+   // scanned is how far pending is known to hold no newline, so that
+   // a long line is searched once, not again after every read
+   size_t scanned = 0;
+   bool open = reply();
+   while (open) {
+      ssize_t got = read (client.fd, buffer, sizeof buffer);
+      if (got < 0 and errno == EINTR) continue;
+      if (got <= 0) break;
+      pending.append (buffer, got);
+      size_t start = 0;
+      for (;;) {
+         size_t newline = pending.find ('\n', scanned);
+         if (newline == string::npos) {
+            scanned = pending.size();
+            break;
+         }
+         string_view line (pending.data() + start, newline - start);
+         start = newline + 1;
+         scanned = start;
+         open = run_command (session, line, words, out) and reply();
+         if (not open) break;
+      }
+      pending.erase (0, start);
+      scanned -= start;
+      if (open and pending.size() > MAX_LINE) {
+         out << execname() << ": line longer than " << MAX_LINE
+             << " bytes" << endl;
+         sent.drain();
+         break;
+      }
+   }
+   shutdown (client.fd, SHUT_RDWR);
+   DEBUGF ('s', "session on fd " << client.fd << " ended");
+   client.done = true;
+}
+
@@ -0,0 +1,61 @@
+// $Id: server.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// server -
+//    Serves one tree to any number of clients over a UNIX domain
+//    socket.  Each connection is a session of its own, an inode_state
+//    on the shared tree with its own current directory and prompt,
+//    run on a thread of its own.  A session sends its prompt, then
+//    answers each line it reads with the command's output and errors
+//    followed by the prompt again, until the client hangs up, runs
+//    exit, or sends a line longer than the session will hold.  Commands that read the tree, or change single directories,
+//    run concurrently, under the tree's lock held shared, and changes
+//    to different directories do not wait for one another; paths are
+//    walked, and files read by cat, without locking any directory at
+//    all.  Those that walk or replace the whole tree hold the lock
+//    exclusively.
+// run -
+//    Accepts connections until stop is called, then shuts down the
+//    connections still open and waits for their sessions to end.
+//    Throws file_error if the socket cannot be set up.
+// stop -
+//    Makes run return.  Safe to call from a signal handler.
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+#include "file_sys.h"
+
+class server {
+   private:
+      struct connection {
+         int fd;
+         thread session;
+         atomic<bool> done {false};
+      };
+      shared_ptr<tree_state> tree;
+      string path;
+      int listener {-1};
+      int wakeup[2] {-1, -1};
+      mutex lock;
+      list<connection> connections;
+      void serve (connection& client);
+      void reap (bool all);
+   public:
+      server (shared_ptr<tree_state> tree, const string& path);
+      ~server();
+      server (const server&) = delete;
+      server& operator= (const server&) = delete;
+      void run();
+      void stop();
+};
+
+#endif
+
@@ -1,5 +1,7 @@
 // $Id: util.cpp,v 1.11 2016-01-13 16:21:53-08 - - $
 
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <unistd.h>
 
@@ -8,7 +10,7 @@ using namespace std;
 #include "util.h"
 #include "debug.h"
 
-int exit_status::status = EXIT_SUCCESS;
+atomic<int> exit_status::status {EXIT_SUCCESS};
 static string execname_string;
 
 void exit_status::set (int new_status) {
@@ -39,25 +41,119 @@ bool want_echo() {
 }
 
 
+const delimiter_set command_delimiters {" \t"};
+const delimiter_set path_delimiters {"/"};
+
+delimiter_set::delimiter_set (string_view delimiters) {
+   for (const unsigned char delim: delimiters) {
+      if (table[delim]) continue;
+      table[delim] = true;
+#ifdef __SSE2__
+      if (count < MAX_VECTOR) {
+         needles[count] = _mm_set1_epi8 (static_cast<char> (delim));
+      }
+#endif
+      ++count;
+   }
+}
+
+// scan -
+//    Returns the position of the first char at or after pos whose
+//    membership in the set equals want.
+size_t delimiter_set::scan (string_view line, size_t pos,
+                            bool want) const {
+   const char* data = line.data();
+   size_t length = line.size();
+#ifdef __SSE2__
+   if (count <= MAX_VECTOR) {
+      // pos may be npos, past the end, so it is checked before it
+      // is added to.
+      for (; pos < length and length - pos >= 16; pos += 16) {
+         __m128i block = _mm_loadu_si128 (
+                         reinterpret_cast<const __m128i*> (data + pos));
+         __m128i hits = _mm_setzero_si128();
+         for (size_t i = 0; i < count; ++i) {
+            hits = _mm_or_si128 (hits,
+                                 _mm_cmpeq_epi8 (block, needles[i]));
+         }
+         unsigned mask = _mm_movemask_epi8 (hits);
+         if (not want) mask = ~mask & 0xFFFF;
+         if (mask != 0) return pos + __builtin_ctz (mask);
+      }
+   }
+#endif
+   for (; pos < length; ++pos) {
+      if (contains (data[pos]) == want) return pos;
+   }
+   return string_view::npos;
+}
+
 wordvec split (const string& line, const string& delimiters) {
    wordvec words;
-   size_t end = 0;
-
-   // Loop over the string, splitting out words, and for each word
-   // thus found, append it to the output wordvec.
-   for (;;) {
-      size_t start = line.find_first_not_of (delimiters, end);
-      if (start == string::npos) break;
-      end = line.find_first_of (delimiters, start);
-      words.push_back (line.substr (start, end - start));
+   const delimiter_set delims (delimiters);
+   for (string_view word: tokenizer (line, delims)) {
+      words.emplace_back (word);
    }
    DEBUGF ('u', words);
    return words;
 }
 
+void split (string_view line, const delimiter_set& delimiters,
+            viewvec& words) {
+   words.clear();
+   for (string_view word: tokenizer (line, delimiters)) {
+      words.push_back (word);
+   }
+   DEBUGF ('u', words);
+}
+
 ostream& complain() {
    exit_status::set (EXIT_FAILURE);
+   batch_output::drain_installed();
    cerr << execname() << ": ";
    return cerr;
 }
 
+batch_output* batch_output::installed {nullptr};
+
+batch_output::batch_output (ostream& out_, int fd_, size_t size):
+              out (out_), fd (fd_), buffer (size) {
+   // Whatever went out through the old buffer, or stdio under it,
+   // must come before anything held here.
+   out.flush();
+   fflush (stdout);
+   setp (buffer.data(), buffer.data() + buffer.size());
+   saved = out.rdbuf (this);
+   installed = this;
+}
+
+batch_output::~batch_output() {
+   drain();
+   out.rdbuf (saved);
+   if (installed == this) installed = nullptr;
+}
+
+batch_output::int_type batch_output::overflow (int_type ch) {
+   drain();
+   if (traits_type::eq_int_type (ch, traits_type::eof())) {
+      return traits_type::not_eof (ch);
+   }
+   *pptr() = traits_type::to_char_type (ch);
+   pbump (1);
+   return ch;
+}
+
+void batch_output::drain() {
+   const char* next = pbase();
+   while (next < pptr()) {
+      ssize_t written = write (fd, next, pptr() - next);
+      if (written < 0 and errno == EINTR) continue;
+      if (written < 0) break;
+      next += written;
+   }
+   setp (buffer.data(), buffer.data() + buffer.size());
+}
+
+void batch_output::drain_installed() {
+   if (installed != nullptr) installed->drain();
+}
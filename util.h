@@ -7,12 +7,19 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <atomic>
 #include <iostream>
 #include <stdexcept>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <vector>
 using namespace std;
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Convenient type using to allow brevity of code elsewhere.
 
 template <typename iterator>
@@ -20,6 +27,8 @@ using range_type = pair<iterator,iterator>;
 
 using wordvec = vector<string>;
 using word_range = range_type<decltype(declval<wordvec>().cbegin())>;
+using viewvec = vector<string_view>;
+using view_range = range_type<decltype(declval<viewvec>().cbegin())>;
 
 // setexecname -
 //    Sets the static string to be used as an execname.
@@ -45,19 +54,110 @@ bool want_echo();
 
 class exit_status {
    private:
-      static int status;
+      static atomic<int> status;
    public:
       static void set (int);
       static int get();
 };
 
 
+// delimiter_set -
+//    A set of separator chars with scans over a string_view.  When
+//    SSE2 is available and there are at most four delimiters, both
+//    scans compare sixteen bytes at a time and fall back to a table
+//    lookup only for the tail of the line.
+// find_first_of, find_first_not_of -
+//    Like the string members of the same name, returning npos when
+//    no char at or after pos qualifies.
+
+class delimiter_set {
+   private:
+      static constexpr size_t MAX_VECTOR {4};
+      bool table[256] {};
+      size_t count {0};
+#ifdef __SSE2__
+      __m128i needles[MAX_VECTOR];
+#endif
+      size_t scan (string_view line, size_t pos, bool want) const;
+   public:
+      explicit delimiter_set (string_view delimiters);
+      bool contains (char c) const {
+         return table[static_cast<unsigned char> (c)];
+      }
+      size_t find_first_of (string_view line, size_t pos) const {
+         return scan (line, pos, true);
+      }
+      size_t find_first_not_of (string_view line, size_t pos) const {
+         return scan (line, pos, false);
+      }
+};
+
+// tokenizer -
+//    Iterates over the words of a line without copying them.  Each
+//    word is a string_view into the line, so it is only valid for as
+//    long as the line itself is.  Example:
+//       for (string_view word: tokenizer (path, slash_delimiters)) ...
+
+class tokenizer {
+   public:
+      class iterator {
+         private:
+            string_view line;
+            const delimiter_set* delims {nullptr};
+            size_t start {string_view::npos};
+            size_t end {string_view::npos};
+            void advance (size_t from) {
+               start = delims->find_first_not_of (line, from);
+               end = start == string_view::npos ? start
+                   : delims->find_first_of (line, start);
+            }
+         public:
+            using iterator_category = forward_iterator_tag;
+            using value_type = string_view;
+            using difference_type = ptrdiff_t;
+            using pointer = const string_view*;
+            using reference = string_view;
+            iterator() = default;
+            iterator (string_view line_, const delimiter_set& delims_):
+                      line (line_), delims (&delims_) { advance (0); }
+            string_view operator*() const {
+               return line.substr (start, end - start);
+            }
+            iterator& operator++() { advance (end); return *this; }
+            iterator operator++ (int) {
+               iterator old = *this; ++*this; return old;
+            }
+            bool operator== (const iterator& that) const {
+               return start == that.start;
+            }
+            bool operator!= (const iterator& that) const {
+               return start != that.start;
+            }
+      };
+      tokenizer (string_view line_, const delimiter_set& delims_):
+                 line (line_), delims (delims_) {}
+      iterator begin() const { return iterator (line, delims); }
+      iterator end() const { return iterator(); }
+   private:
+      string_view line;
+      const delimiter_set& delims;
+};
+
+// The delimiters used for command lines and for pathnames.
+
+extern const delimiter_set command_delimiters;
+extern const delimiter_set path_delimiters;
+
 // split -
 //    Split a string into a wordvec (as defined above).  Any sequence
 //    of chars in the delimiter string is used as a separator.  To
 //    Split a pathname, use "/".  To split a shell command, use " ".
+//    The second form fills a caller-owned viewvec with views into
+//    the line, so a reused vector makes splitting allocation-free.
 
 wordvec split (const string& line, const string& delimiter);
+void split (string_view line, const delimiter_set& delimiters,
+            viewvec& words);
 
 // complain -
 //    Used for starting error messages.  Sets the exit status to
@@ -67,6 +167,34 @@ wordvec split (const string& line, const string& delimiter);
 
 ostream& complain();
 
+// batch_output -
+//    A stream buffer that holds output in one large buffer and writes
+//    it to a file descriptor only when the buffer fills or drain is
+//    called.  Flushes, such as the one every endl does, are ignored.
+//    While installed in place of an ostream's own buffer, complain
+//    drains it first, so that errors on cerr still come out in order
+//    with the output that led up to them.  The destructor drains and
+//    puts the ostream's buffer back.
+
+class batch_output: public streambuf {
+   private:
+      ostream& out;
+      streambuf* saved;
+      int fd;
+      vector<char> buffer;
+      static batch_output* installed;
+   protected:
+      virtual int_type overflow (int_type ch) override;
+      virtual int sync() override { return 0; }
+   public:
+      batch_output (ostream& out, int fd, size_t size);
+      ~batch_output();
+      batch_output (const batch_output&) = delete;
+      batch_output& operator= (const batch_output&) = delete;
+      void drain();
+      static void drain_installed();
+};
+
 // operator<< (vector) -
 //    An overloaded template operator which allows vectors to be
 //    printed out as a single operator, each element separated from
@@ -0,0 +1,390 @@
+// $Id: workload.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// workload -
+//    Generates yshell scripts, and replays the transcripts of their
+//    sessions to measure and check the shell against them.
+//
+//    With no operands, a script is written to cout: commands building
+//    a tree -d levels deep, in which every directory above the bottom
+//    level holds -f subdirectories and -n files of -b bytes, then -c
+//    commands reading and changing it, -r percent of them reads.  -x
+//    seeds the choices, so that a script can be made again.
+//
+//    With a transcript as operand, its commands are run, as fast as
+//    they can be, on a tree of their own, each looked up through
+//    find_command_fn as the shell does, and everything each writes is
+//    checked against what the transcript shows it wrote.  A transcript
+//    is what yshell writes, echoing, given a script on cin:
+//    its build line, then a prompt and the command on each line by
+//    itself, followed by that command's output and errors, ending with
+//    ^D or at exit.  The time each command took is reported by command
+//    word, as tab-separated values with -m.  The exit status is 1 if
+//    any command's output differed.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#include "commands.h"
+#include "file_sys.h"
+#include "util.h"
+
+using replay_clock = chrono::steady_clock;
+
+struct options {
+   size_t depth {3};
+   size_t fanout {4};
+   size_t files {4};
+   size_t file_bytes {64};
+   size_t read_percent {80};
+   size_t commands {10000};
+   uint64_t seed {1};
+   bool machine_readable {false};
+};
+
+//
+// Generating a script.
+//
+
+// generator -
+//    Keeps the directories and files the script has made, so that the
+//    commands it writes mostly name ones that exist, as a user's would.
+//    Paths are absolute, with the root as the empty prefix.
+
+class generator {
+   private:
+      const options& opts;
+      ostream& out;
+      mt19937_64 random;
+      vector<string> dirs {""};
+      vector<string> files;
+      size_t made {0};
+      size_t pick (size_t count) { return random() % count; }
+      static string dir_path (const string& dir) {
+         return dir.empty() ? string ("/") : dir;
+      }
+      string body (size_t bytes);
+      void build (const string& path, size_t level);
+      void read();
+      void write();
+   public:
+      generator (const options& opts_, ostream& out_):
+                 opts (opts_), out (out_), random (opts_.seed) {}
+      void run();
+};
+
+// body -
+//    Words of lowercase letters, single spaces between them, as make
+//    stores them.
+
+string generator::body (size_t bytes) {
+   string text;
+   while (text.size() < bytes) {
+      if (not text.empty()) text += ' ';
+      size_t length = 1 + pick (8);
+      for (size_t letter = 0; letter < length; ++letter) {
+         text += static_cast<char> ('a' + pick (26));
+      }
+   }
+   text.resize (bytes);
+   if (not text.empty() and text.back() == ' ') text.back() = 'z';
+   return text;
+}
+
+void generator::build (const string& path, size_t level) {
+   for (size_t file = 0; file < opts.files; ++file) {
+      files.push_back (path + "/f" + to_string (file));
+      out << "make " << files.back() << " " << body (opts.file_bytes)
+          << "\n";
+   }
+   for (size_t sub = 0; sub < opts.fanout; ++sub) {
+      string subdir = path + "/d" + to_string (sub);
+      out << "mkdir " << subdir << "\n";
+      dirs.push_back (subdir);
+      if (level + 1 < opts.depth) build (subdir, level + 1);
+   }
+}
+
+void generator::read() {
+   size_t which = pick (100);
+   if (which < 40 and not files.empty()) {
+      out << "cat " << files[pick (files.size())] << "\n";
+   }else if (which < 70) {
+      out << "ls " << dir_path (dirs[pick (dirs.size())]) << "\n";
+   }else if (which < 95) {
+      out << "cd " << dir_path (dirs[pick (dirs.size())]) << "\n"
+          << "pwd\n";
+   }else {
+      out << "lsr " << dir_path (dirs[pick (dirs.size())]) << "\n";
+   }
+}
+
+// write -
+//    The root is never removed, and rmr forgets everything below the
+//    directory it removes.  cd back to the root first, so that no
+//    session is left in a directory that is gone.
+
+void generator::write() {
+   size_t which = pick (100);
+   if (which < 30 or files.empty()) {
+      files.push_back (dirs[pick (dirs.size())] + "/n" + to_string (made++));
+      out << "make " << files.back() << " " << body (opts.file_bytes)
+          << "\n";
+   }else if (which < 55) {
+      out << "append " << files[pick (files.size())] << " "
+          << body (1 + opts.file_bytes / 8) << "\n";
+   }else if (which < 75) {
+      dirs.push_back (dirs[pick (dirs.size())] + "/m" + to_string (made++));
+      out << "mkdir " << dirs.back() << "\n";
+   }else if (which < 90 or dirs.size() == 1) {
+      size_t victim = pick (files.size());
+      out << "rm " << files[victim] << "\n";
+      files[victim] = files.back();
+      files.pop_back();
+   }else {
+      string victim = dirs[1 + pick (dirs.size() - 1)];
+      string below = victim + "/";
+      auto gone = [&] (const string& path) {
+         return path == victim or path.compare (0, below.size(), below) == 0;
+      };
+      out << "cd /\n" << "rmr " << victim << "\n";
+      dirs.erase (remove_if (dirs.begin(), dirs.end(), gone), dirs.end());
+      files.erase (remove_if (files.begin(), files.end(), gone),
+                   files.end());
+   }
+}
+
+void generator::run() {
+   if (opts.depth > 0) build ("", 0);
+   for (size_t command = 0; command < opts.commands; ++command) {
+      if (pick (100) < opts.read_percent) read();
+                                      else write();
+   }
+}
+
+//
+// Replaying a transcript.
+//
+
+// timings -
+//    Nanoseconds each command took, by command word.
+
+using timings = map<string,vector<double>>;
+
+void report (ostream& out, const timings& times, size_t mismatches,
+             double seconds, bool machine_readable) {
+   vector<double> all;
+   for (const auto& command: times) {
+      all.insert (all.end(), command.second.begin(), command.second.end());
+   }
+   auto line = [&] (const string& word, vector<double> samples) {
+      double total = 0;
+      for (double sample: samples) total += sample;
+      sort (samples.begin(), samples.end());
+      auto percentile = [&] (size_t percent) {
+         size_t rank = (samples.size() * percent + 99) / 100;
+         return samples.empty() ? 0 : samples[max<size_t> (rank, 1) - 1];
+      };
+      double rate = total > 0 ? samples.size() / (total / 1e9) : 0;
+      char text[128];
+      snprintf (text, sizeof text, machine_readable
+                ? "%s\t%zu\t%.0f\t%.0f\t%.0f\n"
+                : "   %-9s %8zu %12.0f %10.0f %10.0f\n",
+                word.c_str(), samples.size(), rate, percentile (50),
+                percentile (99));
+      out << text;
+   };
+   if (machine_readable) {
+      out << "command\tcount\tops_per_s\tp50_ns\tp99_ns" << endl;
+   }else {
+      out << "replay: " << all.size() << " commands in " << seconds
+          << " s, " << mismatches << " mismatched" << endl
+          << "   command      count        ops/s     p50 ns     p99 ns"
+          << endl;
+   }
+   for (const auto& command: times) line (command.first, command.second);
+   line ("total", all);
+}
+
+// next_prompt -
+//    Where the first line at or after pos begins with prompt, or npos.
+
+size_t next_prompt (const string& text, size_t pos, const string& prompt) {
+   while (pos < text.size()) {
+      if (text.compare (pos, prompt.size(), prompt) == 0) return pos;
+      pos = text.find ('\n', pos);
+      if (pos == string::npos) break;
+      ++pos;
+   }
+   return string::npos;
+}
+
+// replay -
+//    A command's output matches if the transcript shows exactly that
+//    and then the next prompt, or its end.  After one that does not,
+//    the transcript is resumed at the next line that looks like a
+//    prompt, and only the first few differences are shown.
+
+void replay (const string& filename, const options& opts) {
+   constexpr size_t SHOWN {5};
+   ifstream file (filename);
+   if (not file) {
+      complain() << filename << ": cannot open" << endl;
+      return;
+   }
+   stringstream contents;
+   contents << file.rdbuf();
+   const string transcript = contents.str();
+
+   // The build line names the program whose errors are shown.
+   size_t build = transcript.find (" build ");
+   size_t first_newline = transcript.find ('\n');
+   if (build != string::npos and build < first_newline) {
+      execname (transcript.substr (0, build));
+   }
+
+   inode_state state;
+   stringbuf captured;
+   streambuf* saved_out = cout.rdbuf (&captured);
+   streambuf* saved_err = cerr.rdbuf (&captured);
+   ostream out (saved_out);
+   timings times;
+   size_t mismatches = 0;
+   viewvec words;
+   double seconds = 0;
+   size_t pos = next_prompt (transcript, 0, state.prompt());
+   while (pos != string::npos) {
+      pos += state.prompt().size();
+      size_t newline = transcript.find ('\n', pos);
+      if (newline == string::npos) newline = transcript.size();
+      string line = transcript.substr (pos, newline - pos);
+      pos = newline + 1;
+      if (line == "^D") break;
+
+      bool exited = false;
+      auto start = replay_clock::now();
+      try {
+         split (line, command_delimiters, words);
+         if (not words.empty()) {
+            command_fn fn = find_command_fn (words[0]);
+            fn (state, words);
+         }
+      }catch (command_error& error) {
+         complain() << error.what() << endl;
+      }catch (file_error& error) {
+         complain() << error.what() << endl;
+      }catch (ysh_exit&) {
+         exited = true;
+      }
+      chrono::duration<double,nano> elapsed = replay_clock::now() - start;
+      seconds += elapsed.count() / 1e9;
+      times[words.empty() ? string() : string (words[0])]
+            .push_back (elapsed.count());
+      if (exited) break;
+
+      const string output = captured.str();
+      captured.str ("");
+      size_t after = pos + output.size();
+      bool matched = pos <= transcript.size()
+                 and transcript.compare (pos, output.size(), output) == 0
+                 and (after >= transcript.size()
+                      or next_prompt (transcript, after, state.prompt())
+                         == after);
+      if (matched) {
+         pos = after;
+         continue;
+      }
+      size_t resume = next_prompt (transcript, min (pos, transcript.size()),
+                                   state.prompt());
+      if (mismatches++ < SHOWN) {
+         size_t end = resume == string::npos ? transcript.size() : resume;
+         out << filename << ": " << line << ": output differs" << endl
+             << "--- expected" << endl
+             << transcript.substr (min (pos, end), end - min (pos, end))
+             << "--- got" << endl << output;
+      }
+      pos = resume;
+   }
+   cout.rdbuf (saved_out);
+   cerr.rdbuf (saved_err);
+   state.drainReclaim();
+   report (cout, times, mismatches, seconds, opts.machine_readable);
+   exit_status::set (mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// scan_options -
+//    Every number given must be one; -r is at most 100.
+
+options scan_options (int argc, char** argv) {
+   options opts;
+   opterr = 0;
+   auto number = [] (char option, size_t& value) {
+      char* end = nullptr;
+      unsigned long long given = strtoull (optarg, &end, 10);
+      if (*optarg == '\0' or *end != '\0') {
+         complain() << "-" << option << " " << optarg
+                    << ": not a number" << endl;
+         return;
+      }
+      value = given;
+   };
+   for (;;) {
+      int option = getopt (argc, argv, "b:c:d:f:mn:r:x:");
+      if (option == EOF) break;
+      switch (option) {
+         case 'b': number ('b', opts.file_bytes);   break;
+         case 'c': number ('c', opts.commands);     break;
+         case 'd': number ('d', opts.depth);        break;
+         case 'f': number ('f', opts.fanout);       break;
+         case 'm': opts.machine_readable = true;    break;
+         case 'n': number ('n', opts.files);        break;
+         case 'r': number ('r', opts.read_percent); break;
+         case 'x': {
+            size_t seed = opts.seed;
+            number ('x', seed);
+            opts.seed = seed;
+            break;
+         }
+         default:
+            complain() << "-" << static_cast<char> (optopt)
+                       << ": invalid option" << endl;
+            break;
+      }
+   }
+   if (opts.read_percent > 100) {
+      complain() << "-r " << opts.read_percent << ": more than 100"
+                 << endl;
+      opts.read_percent = 100;
+   }
+   return opts;
+}
+
+int main (int argc, char** argv) {
+   execname (argv[0]);
+   cout << boolalpha;
+   cerr << boolalpha;
+   options opts = scan_options (argc, argv);
+   if (exit_status::get() != EXIT_SUCCESS) return exit_status::get();
+   if (optind == argc) {
+      generator (opts, cout).run();
+   }else if (optind + 1 == argc) {
+      replay (argv[optind], opts);
+   }else {
+      complain() << "usage: " << execname()
+                 << " [-d depth] [-f fanout] [-n files] [-b bytes]"
+                    " [-r reads%] [-c commands] [-x seed] | [-m] transcript"
+                 << endl;
+   }
+   return exit_status::get();
+}
@@ -0,0 +1,107 @@
+// $Id: workpool.cpp,v 1.1 2016-01-14 16:16:52-08 - - $
+
+#include <iostream>
+
+using namespace std;
+
+#include "debug.h"
+#include "workpool.h"
+
+// The pool and worker index of the calling thread, so that submit can
+// tell a task spawned by a worker from one coming from outside.
+static thread_local const work_pool* current_pool {nullptr};
+static thread_local size_t current_worker {0};
+
+work_pool::work_pool (size_t thread_count) {
+   if (thread_count == 0) thread_count = 1;
+   for (size_t i = 0; i < thread_count; ++i) {
+      workers.push_back (make_unique<worker>());
+   }
+   // Threads already started must be joined if a later one fails to
+   // start, since destroying a joinable thread terminates the program.
+   try {
+      for (size_t i = 0; i < thread_count; ++i) {
+         threads.emplace_back (&work_pool::run, this, i);
+      }
+   }catch (...) {
+      {
+         lock_guard<mutex> guard (idle_lock);
+         stopping = true;
+      }
+      idle.notify_all();
+      for (auto& thr: threads) thr.join();
+      throw;
+   }
+   DEBUGF ('w', "work_pool of " << thread_count << " threads");
+}
+
+work_pool::~work_pool() {
+   wait();
+   {
+      lock_guard<mutex> guard (idle_lock);
+      stopping = true;
+   }
+   idle.notify_all();
+   for (auto& thr: threads) thr.join();
+}
+
+void work_pool::submit (task job) {
+   size_t target;
+   {
+      lock_guard<mutex> guard (idle_lock);
+      target = current_pool == this ? current_worker
+                                    : next_victim++ % workers.size();
+      ++queued;
+      ++pending;
+   }
+   {
+      lock_guard<mutex> guard (workers[target]->lock);
+      workers[target]->tasks.push_back (move (job));
+   }
+   idle.notify_one();
+}
+
+void work_pool::wait() {
+   unique_lock<mutex> guard (idle_lock);
+   drained.wait (guard, [this] { return pending == 0; });
+}
+
+// take -
+//    Newest task from our own deque, else the oldest task of the
+//    first other worker that has one.
+bool work_pool::take (size_t self, task& job) {
+   for (size_t i = 0; i < workers.size(); ++i) {
+      worker& victim = *workers[(self + i) % workers.size()];
+      lock_guard<mutex> guard (victim.lock);
+      if (victim.tasks.empty()) continue;
+      if (i == 0) {
+         job = move (victim.tasks.back());
+         victim.tasks.pop_back();
+      }else {
+         job = move (victim.tasks.front());
+         victim.tasks.pop_front();
+      }
+      lock_guard<mutex> count_guard (idle_lock);
+      --queued;
+      return true;
+   }
+   return false;
+}
+
+void work_pool::run (size_t self) {
+   current_pool = this;
+   current_worker = self;
+   for (;;) {
+      task job;
+      if (take (self, job)) {
+         job();
+         lock_guard<mutex> guard (idle_lock);
+         if (--pending == 0) drained.notify_all();
+         continue;
+      }
+      unique_lock<mutex> guard (idle_lock);
+      idle.wait (guard, [this] { return stopping or queued > 0; });
+      if (stopping and queued == 0) return;
+   }
+}
+
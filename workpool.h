@@ -0,0 +1,64 @@
+// $Id: workpool.h,v 1.1 2016-01-14 16:16:52-08 - - $
+
+// work_pool -
+//    A fixed set of worker threads with one task deque each.  A task
+//    submitted from a worker goes on the back of that worker's own
+//    deque, and a worker takes its next task from the back of its
+//    own deque, so related work stays on one thread and runs roughly
+//    depth first.  An idle worker steals from the front of another
+//    worker's deque, which is where the oldest and usually largest
+//    pieces of work are.
+// submit -
+//    Queues a task.  Tasks submitted from outside the pool are dealt
+//    round robin across the workers.
+// wait -
+//    Blocks until every submitted task, including tasks submitted by
+//    other tasks, has finished.
+// The constructor, if a thread cannot be started, joins those already
+// running and passes the exception on.  The destructor waits for
+// outstanding work and joins the workers.
+
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+class work_pool {
+   public:
+      using task = function<void()>;
+   private:
+      struct worker {
+         mutex lock;
+         deque<task> tasks;
+      };
+      vector<unique_ptr<worker>> workers;
+      vector<thread> threads;
+      mutex idle_lock;
+      condition_variable idle;
+      condition_variable drained;
+      size_t queued {0};
+      size_t pending {0};
+      size_t next_victim {0};
+      bool stopping {false};
+      void run (size_t self);
+      bool take (size_t self, task& job);
+   public:
+      explicit work_pool (size_t thread_count);
+      ~work_pool();
+      work_pool (const work_pool&) = delete;
+      work_pool& operator= (const work_pool&) = delete;
+      size_t size() const { return workers.size(); }
+      void submit (task job);
+      void wait();
+};
+
+#endif
+